@@ -4,6 +4,18 @@
 
 typedef struct {
   ngx_str_t output_words;
+  // 响应包体的大小，不为 0 时用 output_words 循环填充到该长度
+  size_t size;
+  ngx_str_t type;
+  // 响应前注入的延迟，用于模拟鉴权服务的耗时
+  ngx_msec_t delay;
+  // 以鉴权服务的 JSON 格式进行响应，作为 private_image 压测时的本地鉴权桩
+  ngx_flag_t auth_reply;
+  ngx_str_t auth_user_id;
+  ngx_str_t auth_prefix;
+  time_t auth_ttl;
+  // 配置阶段生成的只读响应包体，所有请求共用
+  ngx_str_t body;
 } ngx_http_hello_world_loc_conf_t;
 
 static char* ngx_http_hello_world(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
@@ -14,12 +26,20 @@ static char* ngx_http_hello_world_merge_loc_conf(ngx_conf_t* cf, void* parent, v
 
 static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t* r);
 
+static ngx_int_t ngx_http_hello_world_send(ngx_http_request_t* r, ngx_http_hello_world_loc_conf_t* hlcf);
+
+static ngx_int_t ngx_http_hello_world_delay(ngx_http_request_t* r, ngx_msec_t delay);
+
+static void ngx_http_hello_world_delay_handler(ngx_event_t* ev);
+
+static void ngx_http_hello_world_delay_cleanup(void* data);
+
 static ngx_command_t ngx_http_hello_world_commands[] = {
   {
     // 配置指令的名称。
     ngx_string("hello_world"),
     // 该配置的类型，其实更准确一点说，是该配置指令属性的集合。nginx提供了很多预定义的属性值（一些宏定义），通过逻辑或运算符可组合在一起，形成对这个配置指令的详细的说明。下面列出可在这里使用的预定义属性值及说明。
-    NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+    NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
     // 这是一个函数指针，当nginx在解析配置的时候，如果遇到这个配置指令，将会把读取到的值传递给这个函数进行分解处理。因为具体每个配置指令的值如何处理，只有定义这个配置指令的人是最清楚的。来看一下这个函数指针要求的函数原型。
     ngx_http_hello_world,
     // 该字段被NGX_HTTP_MODULE类型模块所用 (我们编写的基本上都是NGX_HTTP_MOUDLE，只有一些nginx核心模块是非NGX_HTTP_MODULE)，该字段指定当前配置项存储的内存位置。实际上是使用哪个内存池的问题。因为http模块对所有http模块所要保存的配置信息，划分了main, server和location三个地方进行存储，每个地方都有一个内存池用来分配存储这些信息的内存。这里可能的值为 NGX_HTTP_MAIN_CONF_OFFSET、NGX_HTTP_SRV_CONF_OFFSET或NGX_HTTP_LOC_CONF_OFFSET。当然也可以直接置为0，就是NGX_HTTP_MAIN_CONF_OFFSET。
@@ -29,6 +49,62 @@ static ngx_command_t ngx_http_hello_world_commands[] = {
     // 该字段存储一个指针。可以指向任何一个在读取配置过程中需要的数据，以便于进行配置读取的处理。大多数时候，都不需要，所以简单地设为0即可。
     NULL
   },
+  {
+    ngx_string("hello_world_size"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, size),
+    NULL
+  },
+  {
+    ngx_string("hello_world_type"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, type),
+    NULL
+  },
+  {
+    ngx_string("hello_world_delay"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, delay),
+    NULL
+  },
+  {
+    ngx_string("hello_world_auth_reply"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, auth_reply),
+    NULL
+  },
+  {
+    ngx_string("hello_world_auth_user_id"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, auth_user_id),
+    NULL
+  },
+  {
+    ngx_string("hello_world_auth_ttl"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_sec_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, auth_ttl),
+    NULL
+  },
+  {
+    ngx_string("hello_world_auth_prefix"),
+    NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_hello_world_loc_conf_t, auth_prefix),
+    NULL
+  },
   // 需要注意的是，就是在ngx_http_hello_commands这个数组定义的最后，都要加一个ngx_null_command作为结尾。
   ngx_null_command
 };
@@ -63,13 +139,22 @@ static char *ngx_http_hello_world(ngx_conf_t* cf, ngx_command_t* cmd, void* conf
   ngx_http_core_loc_conf_t *clcf;
   clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
   clcf->handler = ngx_http_hello_world_handler;
-  ngx_conf_set_str_slot(cf, cmd, conf);
+  // 不带参数时使用默认的输出内容
+  if (cf->args->nelts > 1) {
+    return ngx_conf_set_str_slot(cf, cmd, conf);
+  }
   return NGX_CONF_OK;
 }
 
 static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t* r) {
-    //必须是GET或者HEAD方法，否则返回405 Not Allowed 
-    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    //必须是GET或者HEAD方法，否则返回405 Not Allowed；
+    //作为鉴权桩时还要接受private_image发来的POST
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))
+        && !(hlcf->auth_reply && (r->method & NGX_HTTP_POST)))
     {
         return NGX_HTTP_NOT_ALLOWED;
     }
@@ -81,18 +166,32 @@ static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t* r) {
         return rc;
     }
 
-    //设置返回的Content-Type。注意，ngx_str_t有一个很方便的初始化宏
-    //ngx_string，它可以把ngx_str_t的data和len成员都设置好
-    ngx_str_t type = ngx_string("text/plain");
-    //返回的包体内容
-    ngx_str_t response = ngx_string("Hello World!");
+    //配置了延迟时挂起请求，由定时器到期后再响应
+    if (hlcf->delay)
+    {
+        return ngx_http_hello_world_delay(r, hlcf->delay);
+    }
+
+    return ngx_http_hello_world_send(r, hlcf);
+}
+
+static ngx_int_t ngx_http_hello_world_send(ngx_http_request_t* r, ngx_http_hello_world_loc_conf_t* hlcf) {
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out;
 
     //设置返回状态码
     r->headers_out.status = NGX_HTTP_OK;
     //响应包是有包体内容的，所以需要设置Content-Length长度
-    r->headers_out.content_length_n = response.len;
+    r->headers_out.content_length_n = hlcf->body.len;
     //设置Content-Type
-    r->headers_out.content_type = type;
+    r->headers_out.content_type = hlcf->type;
+    r->headers_out.content_type_len = hlcf->type.len;
+
+    if (hlcf->body.len == 0)
+    {
+        r->header_only = 1;
+    }
 
     //发送http头部
     rc = ngx_http_send_header(r);
@@ -101,26 +200,24 @@ static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t* r) {
         return rc;
     }
 
-    //构造ngx_buf_t结构准备发送包体
-    ngx_buf_t                 *b;
-    b = ngx_create_temp_buf(r->pool, response.len);
+    //包体在配置阶段已经生成，这里只需要一个指向它的 ngx_buf_t，
+    //不再拷贝内容。ngx_buf_t 本身不能共用，因为输出过程中会移动 pos 指针
+    b = ngx_calloc_buf(r->pool);
     if (b == NULL)
     {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    //将Hello World拷贝到ngx_buf_t指向的内存中
-    ngx_memcpy(b->pos, response.data, response.len);
-    //注意，一定要设置好last指针
-    b->last = b->pos + response.len;
+    b->pos = hlcf->body.data;
+    b->last = hlcf->body.data + hlcf->body.len;
+    //只读内存，过滤模块不能修改其内容
+    b->memory = 1;
     //声明这是最后一块缓冲区
-    b->last_buf = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
 
     //构造发送时的ngx_chain_t结构体
-    ngx_chain_t out;
-    //赋值ngx_buf_t
     out.buf = b;
-    //设置next为NULL
     out.next = NULL;
 
     //最后一步发送包体，http框架会调用ngx_http_finalize_request方法
@@ -128,6 +225,61 @@ static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t* r) {
     return ngx_http_output_filter(r, &out);
 }
 
+static ngx_int_t ngx_http_hello_world_delay(ngx_http_request_t* r, ngx_msec_t delay) {
+    ngx_event_t               *ev;
+    ngx_pool_cleanup_t        *cln;
+
+    ev = ngx_pcalloc(r->pool, sizeof(ngx_event_t));
+    if (ev == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    //请求提前释放时需要删除定时器，避免定时器回调访问已释放的请求
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_hello_world_delay_cleanup;
+    cln->data = ev;
+
+    ev->handler = ngx_http_hello_world_delay_handler;
+    ev->data = r;
+    ev->log = r->connection->log;
+
+    ngx_add_timer(ev, delay);
+
+    //增加引用计数，由定时器回调调用 ngx_http_finalize_request 结束请求
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+static void ngx_http_hello_world_delay_handler(ngx_event_t* ev) {
+    ngx_connection_t                 *c;
+    ngx_http_request_t               *r;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    r = ev->data;
+    c = r->connection;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    ngx_http_finalize_request(r, ngx_http_hello_world_send(r, hlcf));
+    ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_hello_world_delay_cleanup(void* data) {
+    ngx_event_t *ev = data;
+
+    if (ev->timer_set)
+    {
+        ngx_del_timer(ev);
+    }
+}
+
 static void* ngx_http_hello_world_create_loc_conf(ngx_conf_t* cf) {
     ngx_http_hello_world_loc_conf_t* conf;
  
@@ -137,6 +289,10 @@ static void* ngx_http_hello_world_create_loc_conf(ngx_conf_t* cf) {
     }
     conf->output_words.len = 0;
     conf->output_words.data = NULL;
+    conf->size = NGX_CONF_UNSET_SIZE;
+    conf->delay = NGX_CONF_UNSET_MSEC;
+    conf->auth_reply = NGX_CONF_UNSET;
+    conf->auth_ttl = NGX_CONF_UNSET;
  
     return conf;
 }
@@ -145,6 +301,71 @@ static char* ngx_http_hello_world_merge_loc_conf(ngx_conf_t* cf, void* parent, v
 {
     ngx_http_hello_world_loc_conf_t* prev = parent;
     ngx_http_hello_world_loc_conf_t* conf = child;
-    ngx_conf_merge_str_value(conf->output_words, prev->output_words, "Nginx");
+    u_char *p;
+    size_t len, size;
+
+    ngx_conf_merge_str_value(conf->output_words, prev->output_words, "Hello World!");
+    ngx_conf_merge_size_value(conf->size, prev->size, 0);
+    ngx_conf_merge_msec_value(conf->delay, prev->delay, 0);
+    ngx_conf_merge_value(conf->auth_reply, prev->auth_reply, 0);
+    ngx_conf_merge_str_value(conf->auth_user_id, prev->auth_user_id, "1");
+    ngx_conf_merge_str_value(conf->auth_prefix, prev->auth_prefix, "/");
+    ngx_conf_merge_sec_value(conf->auth_ttl, prev->auth_ttl, 60);
+    if (conf->auth_reply)
+    {
+        ngx_conf_merge_str_value(conf->type, prev->type, "application/json");
+    }
+    else
+    {
+        ngx_conf_merge_str_value(conf->type, prev->type, "text/plain");
+    }
+
+    //在配置阶段一次性生成响应包体，请求处理时不再分配和拷贝
+    if (conf->auth_reply)
+    {
+        len = sizeof("{\"status\":\"200\",\"user_id\":\"\",\"ttl\":,\"prefix\":\"\"}") - 1
+              + conf->auth_user_id.len + NGX_TIME_T_LEN + conf->auth_prefix.len;
+
+        p = ngx_pnalloc(cf->pool, len);
+        if (p == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->body.data = p;
+        p = ngx_sprintf(p, "{\"status\":\"200\",\"user_id\":\"%V\",\"ttl\":%T,\"prefix\":\"%V\"}",
+                        &conf->auth_user_id, conf->auth_ttl, &conf->auth_prefix);
+        conf->body.len = p - conf->body.data;
+    }
+    else if (conf->size)
+    {
+        p = ngx_pnalloc(cf->pool, conf->size);
+        if (p == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->body.data = p;
+        conf->body.len = conf->size;
+
+        //用 output_words 循环填充到指定大小
+        if (conf->output_words.len == 0)
+        {
+            ngx_memset(p, 'x', conf->size);
+        }
+        else
+        {
+            for (size = conf->size; size; size -= len)
+            {
+                len = ngx_min(size, conf->output_words.len);
+                p = ngx_cpymem(p, conf->output_words.data, len);
+            }
+        }
+    }
+    else
+    {
+        conf->body = conf->output_words;
+    }
+
     return NGX_CONF_OK;
-}
\ No newline at end of file
+}
@@ -0,0 +1,329 @@
+#include "ngx_private_image_module.h"
+
+// 批量鉴权：缓存未命中时，同一个 token 在短时间内的多个请求合并为一次鉴权。
+// 第一个请求创建批次并启动定时器，之后的请求加入批次后挂起；定时器到期或者批次已满时
+// 发出一次鉴权请求，再把每个 uri 的结果交给对应的请求继续处理。批次只在当前 worker 内有效
+
+#define  NGX_HTTP_PRIVATE_IMAGE_BATCH_MAX  64
+
+struct ngx_http_private_image_batch_s
+{
+	ngx_queue_t                          queue;
+	// 批次的内存池，鉴权结果也分配在这里
+	ngx_pool_t                          *pool;
+	ngx_http_private_image_loc_conf_t   *plcf;
+	ngx_str_t                            token;
+	ngx_event_t                          event;
+	ngx_uint_t                           n;
+	// 等待鉴权的请求，提前结束的请求置为 NULL
+	ngx_http_request_t                  *requests[NGX_HTTP_PRIVATE_IMAGE_BATCH_MAX];
+};
+
+static ngx_http_private_image_batch_t *ngx_http_private_image_batch_create(ngx_http_request_t *r, ngx_str_t *token);
+
+static void ngx_http_private_image_batch_flush(ngx_event_t *ev);
+
+static void ngx_http_private_image_batch_cleanup(void *data);
+
+// 当前 worker 正在收集请求的批次
+static ngx_queue_t  ngx_http_private_image_batches;
+
+// private_image_auth_batch off | window=time [size=N]
+char *
+ngx_http_private_image_auth_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_loc_conf_t *plcf = conf;
+	ngx_int_t                          n;
+	ngx_uint_t                         i;
+	ngx_str_t                         *value, s;
+
+	if (plcf->batch_window != NGX_CONF_UNSET_MSEC)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	plcf->batch_window = 0;
+	plcf->batch_size = 16;
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		return (cf->args->nelts == 2) ? NGX_CONF_OK : "has too many parameters";
+	}
+
+	for (i = 1; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "window=", 7) == 0)
+		{
+			s.data = value[i].data + 7;
+			s.len = value[i].len - 7;
+
+			plcf->batch_window = ngx_parse_time(&s, 0);
+			if (plcf->batch_window == (ngx_msec_t) NGX_ERROR || plcf->batch_window == 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid window \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "size=", 5) == 0)
+		{
+			n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+			if (n < 2 || n > NGX_HTTP_PRIVATE_IMAGE_BATCH_MAX)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\", must be between 2 and %d",
+				                   &value[i], NGX_HTTP_PRIVATE_IMAGE_BATCH_MAX);
+				return NGX_CONF_ERROR;
+			}
+
+			plcf->batch_size = n;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if (plcf->batch_window == 0)
+	{
+		return "requires \"window\"";
+	}
+
+	return NGX_CONF_OK;
+}
+
+// 把请求加入同一个 token 的批次并挂起，返回 NGX_DONE；未开启批量鉴权或者无法加入时返回 NGX_DECLINED
+ngx_int_t
+ngx_http_private_image_batch_add(ngx_http_request_t *r, ngx_str_t *token)
+{
+	ngx_queue_t                        *q;
+	ngx_http_cleanup_t                 *cln;
+	ngx_http_private_image_ctx_t       *ctx;
+	ngx_http_private_image_batch_t     *batch, *b;
+	ngx_http_private_image_loc_conf_t  *plcf;
+
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+
+	if (plcf->batch_window == 0 || r != r->main)
+	{
+		return NGX_DECLINED;
+	}
+
+	if (ngx_http_private_image_batches.prev == NULL)
+	{
+		ngx_queue_init(&ngx_http_private_image_batches);
+	}
+
+	// 同时等待的 token 不多，顺序查找即可；不同 location 的鉴权配置可能不同，不合并
+	batch = NULL;
+
+	for (q = ngx_queue_head(&ngx_http_private_image_batches);
+	     q != ngx_queue_sentinel(&ngx_http_private_image_batches);
+	     q = ngx_queue_next(q))
+	{
+		b = ngx_queue_data(q, ngx_http_private_image_batch_t, queue);
+
+		if (b->plcf == plcf && b->token.len == token->len
+		    && ngx_memcmp(b->token.data, token->data, token->len) == 0)
+		{
+			batch = b;
+			break;
+		}
+	}
+
+	if (batch == NULL)
+	{
+		batch = ngx_http_private_image_batch_create(r, token);
+		if (batch == NULL)
+		{
+			return NGX_DECLINED;
+		}
+	}
+
+	// 客户端提前断开时请求会被释放，需要从批次中移除
+	cln = ngx_http_cleanup_add(r, 0);
+	if (cln == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	cln->handler = ngx_http_private_image_batch_cleanup;
+	cln->data = r;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	ctx->batch = batch;
+	ctx->batch_index = batch->n;
+
+	batch->requests[batch->n++] = r;
+
+	if (batch->n == plcf->batch_size)
+	{
+		// 批次已满，不再等待定时器，当前事件处理完后立即发出；之后的请求创建新的批次
+		ngx_queue_remove(&batch->queue);
+		ngx_del_timer(&batch->event);
+		ngx_post_event(&batch->event, &ngx_posted_events);
+	}
+
+	// 增加引用计数，由批次调用 ngx_http_finalize_request 结束请求；
+	// 等待期间检查客户端是否断开，断开的请求由 cleanup 从批次中移除，不再为它鉴权
+	r->main->count++;
+	r->read_event_handler = ngx_http_test_reading;
+	r->write_event_handler = ngx_http_request_empty_handler;
+
+	return NGX_DONE;
+}
+
+static ngx_http_private_image_batch_t *
+ngx_http_private_image_batch_create(ngx_http_request_t *r, ngx_str_t *token)
+{
+	ngx_pool_t                      *pool;
+	ngx_http_private_image_batch_t  *batch;
+
+	// 批次可能比创建它的请求结束得晚，使用单独的内存池
+	pool = ngx_create_pool(1024, ngx_cycle->log);
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+
+	batch = ngx_pcalloc(pool, sizeof(ngx_http_private_image_batch_t));
+	if (batch == NULL)
+	{
+		ngx_destroy_pool(pool);
+		return NULL;
+	}
+
+	batch->pool = pool;
+	batch->plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+
+	batch->token.len = token->len;
+	batch->token.data = ngx_pstrdup(pool, token);
+	if (batch->token.data == NULL)
+	{
+		ngx_destroy_pool(pool);
+		return NULL;
+	}
+
+	batch->event.handler = ngx_http_private_image_batch_flush;
+	batch->event.data = batch;
+	batch->event.log = ngx_cycle->log;
+
+	ngx_add_timer(&batch->event, batch->plcf->batch_window);
+
+	ngx_queue_insert_tail(&ngx_http_private_image_batches, &batch->queue);
+
+	return batch;
+}
+
+// 发出批量鉴权并恢复等待的请求。结束一个请求时可能释放同一个连接上的其他请求（HTTP/2），
+// 它们的 cleanup 会把批次中的位置置为 NULL，所以每次都从 batch->requests 重新读取
+static void
+ngx_http_private_image_batch_flush(ngx_event_t *ev)
+{
+	ngx_uint_t                       i, n, *index;
+	ngx_int_t                       *rcs, rc;
+	ngx_str_t                       *user_id;
+	ngx_connection_t                *c;
+	ngx_http_request_t              *r, **requests;
+	ngx_http_private_image_ctx_t    *ctx;
+	ngx_http_private_image_batch_t  *batch;
+	ngx_http_private_image_grant_t  *grants;
+
+	batch = ev->data;
+
+	// 定时器到期时批次还在队列中；批次已满时已经移出了队列
+	if (ev->timedout)
+	{
+		ngx_queue_remove(&batch->queue);
+	}
+
+	requests = ngx_palloc(batch->pool, batch->n * sizeof(ngx_http_request_t *));
+	rcs = ngx_palloc(batch->pool, batch->n * sizeof(ngx_int_t));
+	grants = ngx_palloc(batch->pool, batch->n * sizeof(ngx_http_private_image_grant_t));
+	// 批次中每个位置对应的鉴权结果的下标
+	index = ngx_palloc(batch->pool, batch->n * sizeof(ngx_uint_t));
+
+	n = 0;
+
+	if (requests && rcs && grants && index)
+	{
+		for (i = 0; i < batch->n; i++)
+		{
+			if (batch->requests[i])
+			{
+				index[i] = n;
+				requests[n++] = batch->requests[i];
+			}
+		}
+
+		if (n)
+		{
+			ngx_http_private_image_authorize_batch(requests, n, batch->pool, &batch->token, rcs, grants);
+		}
+	}
+
+	for (i = 0; i < batch->n; i++)
+	{
+		r = batch->requests[i];
+		if (r == NULL)
+		{
+			continue;
+		}
+
+		batch->requests[i] = NULL;
+
+		c = r->connection;
+
+		ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+		ctx->batch = NULL;
+
+		if (n == 0)
+		{
+			// 内存不足时结束所有等待的请求
+			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+			ngx_http_run_posted_requests(c);
+			continue;
+		}
+
+		// 用户 ID 在批次的内存池中，请求的 log 阶段还要使用，复制到请求的内存池
+		user_id = &grants[index[i]].user_id;
+
+		if (user_id->len)
+		{
+			user_id->data = ngx_pstrdup(r->pool, user_id);
+			if (user_id->data == NULL)
+			{
+				ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+				ngx_http_run_posted_requests(c);
+				continue;
+			}
+		}
+
+		r->read_event_handler = ngx_http_block_reading;
+
+		rc = ngx_http_private_image_access(r, rcs[index[i]], &grants[index[i]]);
+
+		ngx_http_finalize_request(r, rc);
+		ngx_http_run_posted_requests(c);
+	}
+
+	ngx_destroy_pool(batch->pool);
+}
+
+static void
+ngx_http_private_image_batch_cleanup(void *data)
+{
+	ngx_http_request_t            *r = data;
+	ngx_http_private_image_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+
+	if (ctx->batch)
+	{
+		ctx->batch->requests[ctx->batch_index] = NULL;
+		ctx->batch = NULL;
+	}
+}
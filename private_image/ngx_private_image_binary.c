@@ -0,0 +1,588 @@
+#include "ngx_private_image_module.h"
+#include <netinet/tcp.h>
+
+// 二进制鉴权协议，帧以长度开头，整数都是网络字节序：
+//
+//   请求  len(4) id(4) token_len(2) token uri_len(2) uri
+//   响应  len(4) id(4) status(1) ttl(4) user_id_len(2) user_id prefix_len(2) prefix
+//
+// len 不包括自身；status 为 0 表示通过，1 表示拒绝；ttl 为 0xffffffff 表示没有指定。
+// 一个连接上可以连续发送多个请求，鉴权服务按请求的顺序返回响应，id 原样返回用于校验。
+// 与 HTTP 协议一样在 worker（或后台刷新的线程）中同步完成，连接在每个 worker 内复用
+
+#define  NGX_HTTP_PRIVATE_IMAGE_BINARY_MAX_FRAME  65536
+#define  NGX_HTTP_PRIVATE_IMAGE_BINARY_CONNS      16
+
+typedef struct
+{
+	ngx_http_private_image_peer_t  *peer;
+	ngx_socket_t                    fd;
+} ngx_http_private_image_binary_conn_t;
+
+// 空闲的连接，后台刷新的线程也会使用，用自旋锁保护
+typedef struct
+{
+	ngx_atomic_t                          lock;
+	ngx_uint_t                            n;
+	ngx_http_private_image_binary_conn_t  conns[NGX_HTTP_PRIVATE_IMAGE_BINARY_CONNS];
+} ngx_http_private_image_binary_cache_t;
+
+static ngx_socket_t ngx_http_private_image_binary_get(ngx_http_private_image_peer_t *peer);
+
+static void ngx_http_private_image_binary_free(ngx_http_private_image_peer_t *peer, ngx_socket_t fd);
+
+static ngx_socket_t ngx_http_private_image_binary_connect(ngx_http_private_image_peer_t *peer, ngx_log_t *log, ngx_int_t deadline);
+
+static ngx_int_t ngx_http_private_image_binary_exchange(ngx_socket_t fd, ngx_log_t *log, ngx_pool_t *pool, u_char *buf, size_t len, ngx_uint_t n, ngx_int_t deadline, ngx_int_t *rcs, ngx_http_private_image_grant_t *grants);
+
+static ngx_int_t ngx_http_private_image_binary_send(ngx_socket_t fd, u_char *buf, size_t len, ngx_int_t deadline);
+
+static ngx_int_t ngx_http_private_image_binary_recv(ngx_socket_t fd, u_char *buf, size_t len, ngx_int_t deadline);
+
+static ngx_int_t ngx_http_private_image_binary_wait(ngx_socket_t fd, short events, ngx_int_t deadline);
+
+static ngx_http_private_image_binary_cache_t  ngx_http_private_image_binary_cache;
+
+static ngx_inline u_char *
+ngx_http_private_image_binary_put16(u_char *p, uint16_t v)
+{
+	*p++ = (u_char) (v >> 8);
+	*p++ = (u_char) v;
+
+	return p;
+}
+
+static ngx_inline u_char *
+ngx_http_private_image_binary_put32(u_char *p, uint32_t v)
+{
+	*p++ = (u_char) (v >> 24);
+	*p++ = (u_char) (v >> 16);
+	*p++ = (u_char) (v >> 8);
+	*p++ = (u_char) v;
+
+	return p;
+}
+
+static ngx_inline uint32_t
+ngx_http_private_image_binary_get32(u_char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// 解析二进制协议使用的地址：host:port 或者 unix 域套接字
+ngx_int_t
+ngx_http_private_image_binary_peer(ngx_conf_t *cf, ngx_http_private_image_peer_t *peer)
+{
+	ngx_url_t            u;
+	struct sockaddr_un  *sun;
+
+	// 继承上一级配置时地址已经解析过
+	if (peer->sockaddr)
+	{
+		return NGX_OK;
+	}
+
+	if (peer->unix_path.len)
+	{
+		if (peer->unix_path.len >= sizeof(sun->sun_path))
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "auth socket path \"%V\" is too long", &peer->unix_path);
+			return NGX_ERROR;
+		}
+
+		sun = ngx_pcalloc(cf->pool, sizeof(struct sockaddr_un));
+		if (sun == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		sun->sun_family = AF_UNIX;
+		ngx_memcpy(sun->sun_path, peer->unix_path.data, peer->unix_path.len);
+
+		peer->sockaddr = (struct sockaddr *) sun;
+		peer->socklen = sizeof(struct sockaddr_un);
+
+		return NGX_OK;
+	}
+
+	ngx_memzero(&u, sizeof(ngx_url_t));
+
+	u.url = peer->url;
+
+	if (ngx_strlchr(u.url.data, u.url.data + u.url.len, '/') != NULL
+	    || ngx_parse_url(cf->pool, &u) != NGX_OK || u.naddrs == 0 || u.port == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		                   "binary auth protocol requires \"host:port\" or \"unix:path\" address, got \"%V\"",
+		                   &peer->url);
+		return NGX_ERROR;
+	}
+
+	peer->sockaddr = u.addrs[0].sockaddr;
+	peer->socklen = u.addrs[0].socklen;
+
+	return NGX_OK;
+}
+
+// 用二进制协议鉴权 n 个 uri，所有请求在一个连接上连续发送。
+// 全部收到响应时返回 NGX_OK，结果保存在 rcs 和 grants 中，授权信息分配在 pool 中
+ngx_int_t
+ngx_http_private_image_binary_auth(ngx_http_private_image_peer_t *peer, ngx_log_t *log, ngx_pool_t *pool, ngx_msec_t connect_timeout, ngx_msec_t timeout, ngx_str_t *token, ngx_str_t *uris, ngx_uint_t n, ngx_int_t *rcs, ngx_http_private_image_grant_t *grants)
+{
+	u_char        *buf, *p;
+	size_t         len;
+	ngx_int_t      rc, start;
+	ngx_uint_t     i, retry;
+	ngx_socket_t   fd;
+
+	if (token->len > 0xffff)
+	{
+		return NGX_ERROR;
+	}
+
+	len = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if (uris[i].len > 0xffff)
+		{
+			return NGX_ERROR;
+		}
+
+		len += 12 + token->len + uris[i].len;
+	}
+
+	buf = ngx_pnalloc(pool, len);
+	if (buf == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	p = buf;
+
+	for (i = 0; i < n; i++)
+	{
+		p = ngx_http_private_image_binary_put32(p, 8 + token->len + uris[i].len);
+		p = ngx_http_private_image_binary_put32(p, i);
+		p = ngx_http_private_image_binary_put16(p, token->len);
+		p = ngx_cpymem(p, token->data, token->len);
+		p = ngx_http_private_image_binary_put16(p, uris[i].len);
+		p = ngx_cpymem(p, uris[i].data, uris[i].len);
+	}
+
+	start = ngx_http_private_image_usec();
+
+	for (retry = 0; retry < 2; retry++)
+	{
+		// 空闲连接可能已经被鉴权服务关闭，没有收到任何响应时换一个新连接重试一次
+		fd = retry ? (ngx_socket_t) -1 : ngx_http_private_image_binary_get(peer);
+
+		if (fd == (ngx_socket_t) -1)
+		{
+			retry = 1;
+
+			fd = ngx_http_private_image_binary_connect(peer, log, start + (ngx_int_t) connect_timeout * 1000);
+			if (fd == (ngx_socket_t) -1)
+			{
+				return NGX_ERROR;
+			}
+		}
+
+		rc = ngx_http_private_image_binary_exchange(fd, log, pool, buf, len, n,
+		                                            start + (ngx_int_t) timeout * 1000, rcs, grants);
+
+		if (rc == NGX_OK)
+		{
+			ngx_http_private_image_binary_free(peer, fd);
+			return NGX_OK;
+		}
+
+		ngx_close_socket(fd);
+
+		if (rc != NGX_DECLINED)
+		{
+			return NGX_ERROR;
+		}
+	}
+
+	ngx_log_error(NGX_LOG_ERR, log, 0, "private image auth server closed connection");
+
+	return NGX_ERROR;
+}
+
+void
+ngx_http_private_image_binary_exit_process(void)
+{
+	ngx_http_private_image_binary_cache_t  *cache = &ngx_http_private_image_binary_cache;
+
+	while (cache->n)
+	{
+		ngx_close_socket(cache->conns[--cache->n].fd);
+	}
+}
+
+static ngx_socket_t
+ngx_http_private_image_binary_get(ngx_http_private_image_peer_t *peer)
+{
+	ngx_uint_t                              i;
+	ngx_socket_t                            fd;
+	ngx_http_private_image_binary_cache_t  *cache = &ngx_http_private_image_binary_cache;
+
+	fd = (ngx_socket_t) -1;
+
+	ngx_spinlock(&cache->lock, 1, 2048);
+
+	for (i = 0; i < cache->n; i++)
+	{
+		if (cache->conns[i].peer == peer)
+		{
+			fd = cache->conns[i].fd;
+			cache->conns[i] = cache->conns[--cache->n];
+			break;
+		}
+	}
+
+	ngx_unlock(&cache->lock);
+
+	return fd;
+}
+
+// 连接放回缓存，缓存已满时关闭
+static void
+ngx_http_private_image_binary_free(ngx_http_private_image_peer_t *peer, ngx_socket_t fd)
+{
+	ngx_http_private_image_binary_cache_t  *cache = &ngx_http_private_image_binary_cache;
+
+	ngx_spinlock(&cache->lock, 1, 2048);
+
+	if (cache->n < NGX_HTTP_PRIVATE_IMAGE_BINARY_CONNS)
+	{
+		cache->conns[cache->n].peer = peer;
+		cache->conns[cache->n].fd = fd;
+		cache->n++;
+		fd = (ngx_socket_t) -1;
+	}
+
+	ngx_unlock(&cache->lock);
+
+	if (fd != (ngx_socket_t) -1)
+	{
+		ngx_close_socket(fd);
+	}
+}
+
+static ngx_socket_t
+ngx_http_private_image_binary_connect(ngx_http_private_image_peer_t *peer, ngx_log_t *log, ngx_int_t deadline)
+{
+	int           on, err;
+	socklen_t     errlen;
+	ngx_int_t     rc;
+	ngx_socket_t  fd;
+
+	fd = ngx_socket(peer->sockaddr->sa_family, SOCK_STREAM, 0);
+	if (fd == (ngx_socket_t) -1)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, "private image auth socket() failed");
+		return fd;
+	}
+
+	if (ngx_nonblocking(fd) == -1)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, "private image auth nonblocking failed");
+		goto failed;
+	}
+
+	if (peer->sockaddr->sa_family != AF_UNIX)
+	{
+		on = 1;
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &on, sizeof(int));
+	}
+
+	if (connect(fd, peer->sockaddr, peer->socklen) == 0)
+	{
+		return fd;
+	}
+
+	err = ngx_socket_errno;
+
+	if (err != NGX_EINPROGRESS)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, err, "private image auth connect() failed");
+		goto failed;
+	}
+
+	rc = ngx_http_private_image_binary_wait(fd, POLLOUT, deadline);
+	if (rc != NGX_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, rc == NGX_AGAIN ? NGX_ETIMEDOUT : ngx_socket_errno,
+		              "private image auth connect() failed");
+		goto failed;
+	}
+
+	err = 0;
+	errlen = sizeof(int);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &err, &errlen) == -1)
+	{
+		err = ngx_socket_errno;
+	}
+
+	if (err)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, err, "private image auth connect() failed");
+		goto failed;
+	}
+
+	return fd;
+
+failed:
+
+	ngx_close_socket(fd);
+
+	return (ngx_socket_t) -1;
+}
+
+// 发送所有请求后按顺序读取响应。连接在收到任何响应之前断开时返回 NGX_DECLINED，可以重试
+static ngx_int_t
+ngx_http_private_image_binary_exchange(ngx_socket_t fd, ngx_log_t *log, ngx_pool_t *pool, u_char *buf, size_t len, ngx_uint_t n, ngx_int_t deadline, ngx_int_t *rcs, ngx_http_private_image_grant_t *grants)
+{
+	u_char                          *p, *last, head[4];
+	size_t                           size, slen;
+	uint32_t                         ttl;
+	ngx_int_t                        rc;
+	ngx_uint_t                       i;
+	ngx_http_private_image_grant_t  *grant;
+
+	rc = ngx_http_private_image_binary_send(fd, buf, len, deadline);
+	if (rc != NGX_OK)
+	{
+		goto failed;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		rc = ngx_http_private_image_binary_recv(fd, head, 4, deadline);
+		if (rc != NGX_OK)
+		{
+			if (rc == NGX_DECLINED && i)
+			{
+				rc = NGX_ERROR;
+			}
+
+			goto failed;
+		}
+
+		size = ngx_http_private_image_binary_get32(head);
+		if (size < 13 || size > NGX_HTTP_PRIVATE_IMAGE_BINARY_MAX_FRAME)
+		{
+			goto invalid;
+		}
+
+		p = ngx_pnalloc(pool, size);
+		if (p == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		rc = ngx_http_private_image_binary_recv(fd, p, size, deadline);
+		if (rc != NGX_OK)
+		{
+			rc = NGX_ERROR;
+			goto failed;
+		}
+
+		last = p + size;
+
+		if (ngx_http_private_image_binary_get32(p) != i || p[4] > 1)
+		{
+			goto invalid;
+		}
+
+		rcs[i] = p[4] ? AUTHORIZE_FAIL : AUTHORIZE_OK;
+
+		grant = &grants[i];
+		ttl = ngx_http_private_image_binary_get32(p + 5);
+		grant->ttl = (ttl == 0xffffffff) ? -1 : (time_t) ttl;
+		p += 9;
+
+		// 用户 ID 和授权前缀直接引用内存池中的响应
+		slen = (p[0] << 8) | p[1];
+		p += 2;
+
+		if ((size_t) (last - p) < slen + 2)
+		{
+			goto invalid;
+		}
+
+		grant->user_id.data = p;
+		grant->user_id.len = slen;
+		p += slen;
+
+		slen = (p[0] << 8) | p[1];
+		p += 2;
+
+		if (slen > (size_t) (last - p))
+		{
+			goto invalid;
+		}
+
+		if (slen && p[0] == '/')
+		{
+			grant->prefix.data = p;
+			grant->prefix.len = slen;
+		}
+	}
+
+	return NGX_OK;
+
+invalid:
+
+	ngx_log_error(NGX_LOG_ERR, log, 0, "private image auth server returned invalid response");
+
+	return NGX_ERROR;
+
+failed:
+
+	if (rc == NGX_AGAIN)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, NGX_ETIMEDOUT, "private image auth request timed out");
+		return NGX_ERROR;
+	}
+
+	if (rc == NGX_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, "private image auth request failed");
+	}
+
+	return rc;
+}
+
+// 返回 NGX_OK、NGX_AGAIN（超时）或者 NGX_DECLINED（连接已经断开）
+static ngx_int_t
+ngx_http_private_image_binary_send(ngx_socket_t fd, u_char *buf, size_t len, ngx_int_t deadline)
+{
+	ssize_t    n;
+	ngx_err_t  err;
+	ngx_int_t  rc;
+
+	while (len)
+	{
+		n = send(fd, buf, len, 0);
+
+		if (n > 0)
+		{
+			buf += n;
+			len -= n;
+			continue;
+		}
+
+		err = ngx_socket_errno;
+
+		if (err == NGX_EINTR)
+		{
+			continue;
+		}
+
+		if (err != NGX_EAGAIN)
+		{
+			return (err == NGX_EPIPE || err == NGX_ECONNRESET) ? NGX_DECLINED : NGX_ERROR;
+		}
+
+		rc = ngx_http_private_image_binary_wait(fd, POLLOUT, deadline);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+// 读取 len 个字节，返回值与 ngx_http_private_image_binary_send 相同；
+// 读到一部分后连接断开时返回 NGX_ERROR
+static ngx_int_t
+ngx_http_private_image_binary_recv(ngx_socket_t fd, u_char *buf, size_t len, ngx_int_t deadline)
+{
+	size_t     total;
+	ssize_t    n;
+	ngx_err_t  err;
+	ngx_int_t  rc;
+
+	total = 0;
+
+	while (total < len)
+	{
+		n = recv(fd, buf + total, len - total, 0);
+
+		if (n > 0)
+		{
+			total += n;
+			continue;
+		}
+
+		if (n == 0)
+		{
+			return total ? NGX_ERROR : NGX_DECLINED;
+		}
+
+		err = ngx_socket_errno;
+
+		if (err == NGX_EINTR)
+		{
+			continue;
+		}
+
+		if (err != NGX_EAGAIN)
+		{
+			return (err == NGX_ECONNRESET && total == 0) ? NGX_DECLINED : NGX_ERROR;
+		}
+
+		rc = ngx_http_private_image_binary_wait(fd, POLLIN, deadline);
+		if (rc != NGX_OK)
+		{
+			return rc;
+		}
+	}
+
+	return NGX_OK;
+}
+
+// 等待套接字可读或可写，超过 deadline（微秒时间戳）返回 NGX_AGAIN
+static ngx_int_t
+ngx_http_private_image_binary_wait(ngx_socket_t fd, short events, ngx_int_t deadline)
+{
+	int            n;
+	ngx_int_t      left;
+	struct pollfd  pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	for ( ;; )
+	{
+		left = deadline - ngx_http_private_image_usec();
+		if (left <= 0)
+		{
+			return NGX_AGAIN;
+		}
+
+		pfd.revents = 0;
+
+		n = poll(&pfd, 1, (int) ((left + 999) / 1000));
+
+		if (n > 0)
+		{
+			return NGX_OK;
+		}
+
+		if (n == 0)
+		{
+			return NGX_AGAIN;
+		}
+
+		if (ngx_socket_errno != NGX_EINTR)
+		{
+			return NGX_ERROR;
+		}
+	}
+}
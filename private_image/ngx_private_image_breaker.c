@@ -0,0 +1,268 @@
+#include "ngx_private_image_module.h"
+
+// 鉴权服务熔断器，状态保存在统计共享内存中，所有 worker 共用：
+// 关闭状态下统计一个时间窗口内的失败率，超过阈值后打开，直接拒绝鉴权请求；
+// 打开一段时间后进入半开状态，只放行一个探测请求，成功则关闭，失败则重新打开
+
+static ngx_http_private_image_breaker_t *ngx_http_private_image_breaker_get(ngx_http_private_image_main_conf_t *pmcf);
+
+// private_image_auth_breaker threshold=50% [requests=20] [window=10s] [open=30s] | off
+char *
+ngx_http_private_image_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ngx_int_t                           n;
+	ngx_msec_t                         *t;
+	ngx_uint_t                          i;
+	ngx_str_t                          *value, s;
+
+	if (pmcf->breaker_window)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	pmcf->breaker_threshold = 0;
+	pmcf->breaker_requests = 20;
+	pmcf->breaker_window = 10000;
+	pmcf->breaker_open = 30000;
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		if (cf->args->nelts > 2)
+		{
+			return "has too many parameters";
+		}
+
+		return NGX_CONF_OK;
+	}
+
+	for (i = 1; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "threshold=", 10) == 0)
+		{
+			s.data = value[i].data + 10;
+			s.len = value[i].len - 10;
+
+			if (s.len && s.data[s.len - 1] == '%')
+			{
+				s.len--;
+			}
+
+			n = ngx_atoi(s.data, s.len);
+			if (n <= 0 || n > 100)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid threshold \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			pmcf->breaker_threshold = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "requests=", 9) == 0)
+		{
+			n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+			if (n <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid requests value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			pmcf->breaker_requests = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "window=", 7) == 0)
+		{
+			t = &pmcf->breaker_window;
+			s.data = value[i].data + 7;
+			s.len = value[i].len - 7;
+		}
+		else if (ngx_strncmp(value[i].data, "open=", 5) == 0)
+		{
+			t = &pmcf->breaker_open;
+			s.data = value[i].data + 5;
+			s.len = value[i].len - 5;
+		}
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		*t = ngx_parse_time(&s, 0);
+		if (*t == (ngx_msec_t) NGX_ERROR || *t == 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time value \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if (pmcf->breaker_threshold == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"threshold\" must be specified");
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static ngx_http_private_image_breaker_t *
+ngx_http_private_image_breaker_get(ngx_http_private_image_main_conf_t *pmcf)
+{
+	ngx_http_private_image_zone_ctx_t  *ctx;
+
+	// 熔断器的状态需要保存在 private_image_zone 中，未配置时不熔断
+	if (pmcf->breaker_threshold == 0 || pmcf->shm_zone == NULL)
+	{
+		return NULL;
+	}
+
+	ctx = pmcf->shm_zone->data;
+
+	return &ctx->sh->breaker;
+}
+
+// 是否允许向鉴权服务发请求，熔断时返回 NGX_DECLINED
+ngx_int_t
+ngx_http_private_image_breaker_allow(ngx_http_request_t *r)
+{
+	ngx_msec_t                           now;
+	ngx_atomic_uint_t                    probe;
+	ngx_http_private_image_breaker_t    *br;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+
+	br = ngx_http_private_image_breaker_get(pmcf);
+	if (br == NULL)
+	{
+		return NGX_OK;
+	}
+
+	now = ngx_current_msec;
+
+	switch (br->state)
+	{
+
+	case NGX_HTTP_PRIVATE_IMAGE_BREAKER_CLOSED:
+		return NGX_OK;
+
+	case NGX_HTTP_PRIVATE_IMAGE_BREAKER_OPEN:
+		if ((ngx_msec_int_t) (now - br->opened) < (ngx_msec_int_t) pmcf->breaker_open)
+		{
+			return NGX_DECLINED;
+		}
+
+		(void) ngx_atomic_cmp_set(&br->state, NGX_HTTP_PRIVATE_IMAGE_BREAKER_OPEN,
+		                          NGX_HTTP_PRIVATE_IMAGE_BREAKER_HALF_OPEN);
+
+		/* fall through */
+
+	default:
+		// 半开状态只放行一个探测请求；探测请求的 worker 异常退出时，超过 open 时间后允许下一个
+		probe = br->probe;
+
+		if (probe != 0 && (ngx_msec_int_t) (now - probe) < (ngx_msec_int_t) pmcf->breaker_open)
+		{
+			return NGX_DECLINED;
+		}
+
+		if (ngx_atomic_cmp_set(&br->probe, probe, now ? now : 1))
+		{
+			return NGX_OK;
+		}
+
+		return NGX_DECLINED;
+	}
+}
+
+// 报告一次鉴权请求的结果，ok 为 0 表示鉴权服务出错（超时、连接失败、5xx 等）。
+// 后台刷新的结果也会报告，此时请求可能已经结束，所以不使用 ngx_http_request_t
+void
+ngx_http_private_image_breaker_report(ngx_http_private_image_main_conf_t *pmcf, ngx_log_t *log, ngx_uint_t ok)
+{
+	ngx_msec_t                          now;
+	ngx_atomic_uint_t                   start, requests, failures;
+	ngx_http_private_image_breaker_t   *br;
+
+	br = ngx_http_private_image_breaker_get(pmcf);
+	if (br == NULL)
+	{
+		return;
+	}
+
+	now = ngx_current_msec;
+
+	// 熔断之前发出的请求在打开状态下才返回，不影响状态
+	if (br->state == NGX_HTTP_PRIVATE_IMAGE_BREAKER_OPEN)
+	{
+		return;
+	}
+
+	if (br->state == NGX_HTTP_PRIVATE_IMAGE_BREAKER_HALF_OPEN)
+	{
+		// 探测请求的结果决定关闭还是重新打开
+		if (ok)
+		{
+			br->requests = 0;
+			br->failures = 0;
+			br->window_start = now;
+
+			if (ngx_atomic_cmp_set(&br->state, NGX_HTTP_PRIVATE_IMAGE_BREAKER_HALF_OPEN,
+			                       NGX_HTTP_PRIVATE_IMAGE_BREAKER_CLOSED))
+			{
+				ngx_log_error(NGX_LOG_NOTICE, log, 0, "private image auth breaker closed");
+			}
+		}
+		else
+		{
+			// 先更新时间再切换状态，其他 worker 看到打开状态时时间已经是新的
+			br->opened = now;
+			(void) ngx_atomic_cmp_set(&br->state, NGX_HTTP_PRIVATE_IMAGE_BREAKER_HALF_OPEN,
+			                          NGX_HTTP_PRIVATE_IMAGE_BREAKER_OPEN);
+		}
+
+		br->probe = 0;
+		return;
+	}
+
+	// 窗口过期后重新计数，多个 worker 同时重置时只会丢失少量计数
+	start = br->window_start;
+	if ((ngx_msec_int_t) (now - start) >= (ngx_msec_int_t) pmcf->breaker_window
+	    && ngx_atomic_cmp_set(&br->window_start, start, now))
+	{
+		br->requests = 0;
+		br->failures = 0;
+	}
+
+	requests = ngx_atomic_fetch_add(&br->requests, 1) + 1;
+
+	if (ok)
+	{
+		return;
+	}
+
+	failures = ngx_atomic_fetch_add(&br->failures, 1) + 1;
+
+	if (requests < pmcf->breaker_requests
+	    || failures * 100 < requests * pmcf->breaker_threshold)
+	{
+		return;
+	}
+
+	br->opened = now;
+	br->probe = 0;
+
+	if (ngx_atomic_cmp_set(&br->state, NGX_HTTP_PRIVATE_IMAGE_BREAKER_CLOSED,
+	                       NGX_HTTP_PRIVATE_IMAGE_BREAKER_OPEN))
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_BREAKER_TRIPS, 1);
+
+		ngx_log_error(NGX_LOG_WARN, log, 0,
+		              "private image auth breaker opened, %uA of %uA auth requests failed",
+		              failures, requests);
+	}
+}
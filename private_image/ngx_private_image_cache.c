@@ -0,0 +1,1493 @@
+#include "ngx_private_image_module.h"
+
+// 鉴权结果缓存：只缓存鉴权通过的结果，保存在共享内存中。
+// 索引是组相联的哈希表，token 的哈希决定所在的组，每组有 8 路，每路记录哈希和节点的偏移。
+// 每组有一个序列号，写入方持有共享内存的锁，修改一组前后各把它的序列号加一；
+// 查找不加锁，读取前后序列号相同且为偶数时结果有效，否则重试，多次重试失败后才加锁查找。
+// 节点按插入顺序组成队列，共享内存不足时从队尾淘汰，查找时只在路上记录命中时间，
+// 淘汰时最近命中过的节点移回队首
+
+// 后台刷新超过这个时间（秒）没有结果时，允许下一个请求重新发起刷新
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_REFRESH_TIMEOUT  10
+
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS     8
+
+// 无锁查找的重试次数，超过后加锁查找
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_RETRIES  4
+
+// 一级缓存只保存不超过这些长度的 token、用户 ID 和 uri 前缀
+#define  NGX_HTTP_PRIVATE_IMAGE_L1_TOKEN_LEN   64
+#define  NGX_HTTP_PRIVATE_IMAGE_L1_USER_LEN    32
+#define  NGX_HTTP_PRIVATE_IMAGE_L1_PREFIX_LEN  120
+
+// 一级缓存槽数的上限，init_process 中向上取整为 2 的幂时不会溢出
+#define  NGX_HTTP_PRIVATE_IMAGE_L1_MAX         1048576
+
+#define  NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_MAGIC    0x43414950  /* "PIAC" */
+#define  NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_VERSION  2
+// 保存快照时每次持锁复制的组数，避免长时间阻塞其它 worker
+#define  NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_BUCKETS  64
+
+typedef struct
+{
+	ngx_queue_t  queue;
+	uint64_t     hash;
+	time_t       expire;
+	// 上次移回队首时这一路的命中时间，淘汰时据此判断之后是否被命中过
+	uint32_t     touched;
+	u_short      token_len;
+	u_short      user_len;
+	u_short      prefix_len;
+	// 为 1 时只授权 prefix 对应的 uri 本身，否则授权以 prefix 开头的所有 uri
+	u_char       exact;
+	// 节点在组中的位置
+	u_char       way;
+	// 依次保存 token、用户 ID 和 uri 前缀
+	u_char       data[1];
+} ngx_http_private_image_cache_node_t;
+
+typedef struct
+{
+	// 哈希为 0 表示空闲
+	uint64_t      hash;
+	// 开始后台刷新的时间，0 表示没有正在进行的刷新，查找时用 CAS 修改
+	ngx_atomic_t  updating;
+	// 节点相对共享内存起始地址的偏移
+	uint32_t      offset;
+	// 最近一次命中的时间，查找时和旧值不同才写入，不需要精确
+	uint32_t      accessed;
+} ngx_http_private_image_cache_way_t;
+
+typedef struct
+{
+	ngx_atomic_t                        seq;
+	ngx_http_private_image_cache_way_t  ways[NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS];
+} ngx_http_private_image_cache_bucket_t;
+
+typedef struct
+{
+	ngx_queue_t                             queue;
+	ngx_uint_t                              mask;
+	ngx_http_private_image_cache_bucket_t  *buckets;
+	// 每次撤销或者删除授权时加一，一级缓存中代数不同的授权失效
+	ngx_atomic_t                            generation;
+} ngx_http_private_image_cache_sh_t;
+
+// 每个 worker 私有的一级缓存，直接映射，只保存命中二级缓存且未过期的授权
+typedef struct
+{
+	uint64_t           hash;
+	// 二级缓存中的过期时间和 l1_valid 之后两者的较早者
+	time_t             expire;
+	ngx_atomic_uint_t  generation;
+	u_char             exact;
+	u_char             token_len;
+	u_char             user_len;
+	u_char             prefix_len;
+	u_char             token[NGX_HTTP_PRIVATE_IMAGE_L1_TOKEN_LEN];
+	u_char             user_id[NGX_HTTP_PRIVATE_IMAGE_L1_USER_LEN];
+	u_char             prefix[NGX_HTTP_PRIVATE_IMAGE_L1_PREFIX_LEN];
+} ngx_http_private_image_l1_slot_t;
+
+typedef struct
+{
+	ngx_http_private_image_cache_sh_t  *sh;
+	ngx_slab_pool_t                    *shpool;
+	// 共享内存的大小，无锁查找时用于检查节点的偏移
+	size_t                              size;
+	// 缓存的有效期，鉴权服务返回的 ttl 更短时以 ttl 为准
+	time_t                              valid;
+	// 过期之后的这段时间内继续使用旧的授权，同时由一个请求在后台刷新
+	time_t                              stale_while_revalidate;
+	// 过期之后的这段时间内，鉴权服务不可用时可以继续使用旧的授权
+	time_t                              stale_if_error;
+	// 过期之后节点保留的时间，取以上两者的较大值
+	time_t                              retain;
+	// 快照文件，启动时加载，由 0 号 worker 定期和退出时保存
+	ngx_str_t                           snapshot;
+	// 临时文件名在保存时加上进程号，重新加载配置时新旧 0 号 worker 不会写同一个文件
+	ngx_str_t                           snapshot_temp;
+	ngx_msec_t                          snapshot_interval;
+	// 一级缓存的槽数和有效期，槽数为 0 时不使用一级缓存
+	ngx_uint_t                          l1_size;
+	time_t                              l1_valid;
+} ngx_http_private_image_cache_ctx_t;
+
+// 快照文件由一个头部和按组的顺序排列的记录组成，
+// 每条记录之后依次是 token、用户 ID 和 uri 前缀，按 8 字节对齐，可以直接映射后读取。
+// size 和 crc 为头部之后所有记录的长度和 crc32，加载时校验，不完整或损坏的快照整个丢弃。
+// expire 为过期的 unix 时间，加载时跳过已经超过保留时间的记录
+typedef struct
+{
+	uint32_t  magic;
+	uint32_t  version;
+	uint64_t  count;
+	int64_t   saved;
+	uint64_t  size;
+	uint32_t  crc;
+	uint32_t  reserved;
+} ngx_http_private_image_snapshot_header_t;
+
+typedef struct
+{
+	int64_t   expire;
+	uint16_t  token_len;
+	uint16_t  user_len;
+	uint16_t  prefix_len;
+	uint8_t   exact;
+	uint8_t   reserved;
+} ngx_http_private_image_snapshot_record_t;
+
+// 无锁查找的结果，从节点中复制出来
+typedef struct
+{
+	ngx_http_private_image_cache_way_t  *way;
+	time_t                               expire;
+	ngx_str_t                            user_id;
+	// 使用一级缓存且 uri 前缀不超过 NGX_HTTP_PRIVATE_IMAGE_L1_PREFIX_LEN 时复制前缀，l1 置为 1
+	ngx_uint_t                           l1;
+	ngx_uint_t                           exact;
+	size_t                               prefix_len;
+	u_char                               prefix[NGX_HTTP_PRIVATE_IMAGE_L1_PREFIX_LEN];
+} ngx_http_private_image_cache_hit_t;
+
+static ngx_int_t ngx_http_private_image_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static ngx_int_t ngx_http_private_image_cache_read(ngx_http_private_image_cache_ctx_t *ctx, ngx_http_private_image_cache_bucket_t *b, uint64_t hash, ngx_str_t *token, ngx_http_request_t *r, ngx_http_private_image_cache_hit_t *hit);
+
+static ngx_http_private_image_cache_node_t *ngx_http_private_image_cache_find(ngx_http_private_image_cache_ctx_t *ctx, uint64_t hash, ngx_str_t *token);
+
+static void ngx_http_private_image_cache_delete(ngx_http_private_image_cache_ctx_t *ctx, ngx_http_private_image_cache_node_t *cn);
+
+static void ngx_http_private_image_cache_expire(ngx_http_private_image_cache_ctx_t *ctx, ngx_uint_t force);
+
+static ngx_int_t ngx_http_private_image_cache_insert(ngx_http_private_image_cache_ctx_t *ctx, ngx_str_t *token, ngx_str_t *user_id, ngx_str_t *prefix, ngx_uint_t exact, time_t expire);
+
+static void ngx_http_private_image_cache_load(ngx_http_private_image_cache_ctx_t *ctx, ngx_log_t *log);
+
+static void ngx_http_private_image_cache_save(ngx_shm_zone_t *zone, ngx_log_t *log);
+
+static void ngx_http_private_image_snapshot_handler(ngx_event_t *ev);
+
+static ngx_event_t  ngx_http_private_image_snapshot_event;
+
+// 保存快照用的缓冲区，第一次保存时分配
+static u_char  *ngx_http_private_image_snapshot_buf;
+
+static ngx_int_t ngx_http_private_image_l1_lookup(ngx_http_private_image_cache_ctx_t *ctx, ngx_http_request_t *r, uint64_t hash, ngx_str_t *token, ngx_http_private_image_grant_t *grant);
+
+static void ngx_http_private_image_l1_store(ngx_http_private_image_cache_ctx_t *ctx, uint64_t hash, ngx_str_t *token, ngx_http_private_image_cache_hit_t *hit, ngx_atomic_uint_t generation);
+
+// 当前 worker 的一级缓存，在 init_process 中分配
+static ngx_http_private_image_l1_slot_t  *ngx_http_private_image_l1;
+static ngx_uint_t                         ngx_http_private_image_l1_mask;
+
+static ngx_int_t ngx_http_private_image_revoke_handler(ngx_http_request_t *r);
+
+static ngx_uint_t ngx_http_private_image_cache_revoke_user(ngx_http_private_image_main_conf_t *pmcf, ngx_str_t *user_id);
+
+#define ngx_http_private_image_cache_bucket(ctx, hash)                        \
+	(&(ctx)->sh->buckets[(hash) & (ctx)->sh->mask])
+
+#define ngx_http_private_image_cache_node(ctx, offset)                        \
+	((ngx_http_private_image_cache_node_t *) ((u_char *) (ctx)->shpool + (offset)))
+
+// 写入方修改一组之前和之后调用，需要持有共享内存的锁
+#define ngx_http_private_image_cache_write_begin(b)                           \
+	(b)->seq++;                                                               \
+	ngx_memory_barrier()
+
+#define ngx_http_private_image_cache_write_end(b)                             \
+	ngx_memory_barrier();                                                     \
+	(b)->seq++
+
+// 哈希为 0 表示空闲的路
+static ngx_inline uint64_t
+ngx_http_private_image_cache_hash(ngx_str_t *token)
+{
+	uint64_t  hash;
+
+	hash = ngx_http_private_image_hash(token->data, token->len);
+
+	return hash ? hash : 1;
+}
+
+// private_image_auth_cache name:size [valid=time] [stale_while_revalidate=time] [stale_if_error=time]
+//                          [refresh_pool=name] [snapshot=path] [snapshot_interval=time]
+//                          [l1=number] [l1_valid=time]
+char *
+ngx_http_private_image_auth_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ssize_t                              size;
+	time_t                              *t;
+	ngx_uint_t                           i;
+	ngx_int_t                            n;
+	ngx_str_t                           *value, name, s;
+	ngx_http_private_image_cache_ctx_t  *ctx;
+#if (NGX_THREADS)
+	ngx_str_t                            pool;
+
+	ngx_str_null(&pool);
+#endif
+
+	if (pmcf->cache_zone)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_http_private_image_parse_zone(cf, &value[1], &name, &size) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	// 组中保存的是节点的 32 位偏移
+	if ((uint64_t) size > NGX_MAX_UINT32_VALUE)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too large, the maximum is 4G", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_cache_ctx_t));
+	if (ctx == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ctx->valid = 60;
+	ctx->stale_if_error = 0;
+	ctx->snapshot_interval = 60000;
+	ctx->l1_valid = 5;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0)
+		{
+			ctx->snapshot.data = value[i].data + 9;
+			ctx->snapshot.len = value[i].len - 9;
+
+			if (ngx_conf_full_name(cf->cycle, &ctx->snapshot, 0) != NGX_OK)
+			{
+				return NGX_CONF_ERROR;
+			}
+
+			// 保存时写入 "<snapshot>.<pid>.tmp"
+			ctx->snapshot_temp.data = ngx_pnalloc(cf->pool, ctx->snapshot.len + sizeof(".tmp") + NGX_INT64_LEN + 1);
+			if (ctx->snapshot_temp.data == NULL)
+			{
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "snapshot_interval=", 18) == 0)
+		{
+			s.data = value[i].data + 18;
+			s.len = value[i].len - 18;
+
+			ctx->snapshot_interval = ngx_parse_time(&s, 0);
+			if (ctx->snapshot_interval == (ngx_msec_t) NGX_ERROR || ctx->snapshot_interval == 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "refresh_pool=", 13) == 0)
+		{
+#if (NGX_THREADS)
+			pool.data = value[i].data + 13;
+			pool.len = value[i].len - 13;
+			continue;
+#else
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+			                   "\"refresh_pool\" requires nginx built with --with-threads");
+			return NGX_CONF_ERROR;
+#endif
+		}
+
+		if (ngx_strncmp(value[i].data, "l1=", 3) == 0)
+		{
+			n = ngx_atoi(value[i].data + 3, value[i].len - 3);
+			if (n == NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			if (n > NGX_HTTP_PRIVATE_IMAGE_L1_MAX)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\", the maximum is %d",
+				                   &value[i], NGX_HTTP_PRIVATE_IMAGE_L1_MAX);
+				return NGX_CONF_ERROR;
+			}
+
+			ctx->l1_size = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "valid=", 6) == 0)
+		{
+			t = &ctx->valid;
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+		}
+		else if (ngx_strncmp(value[i].data, "stale_while_revalidate=", 23) == 0)
+		{
+			t = &ctx->stale_while_revalidate;
+			s.data = value[i].data + 23;
+			s.len = value[i].len - 23;
+		}
+		else if (ngx_strncmp(value[i].data, "stale_if_error=", 15) == 0)
+		{
+			t = &ctx->stale_if_error;
+			s.data = value[i].data + 15;
+			s.len = value[i].len - 15;
+		}
+		else if (ngx_strncmp(value[i].data, "l1_valid=", 9) == 0)
+		{
+			t = &ctx->l1_valid;
+			s.data = value[i].data + 9;
+			s.len = value[i].len - 9;
+		}
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		*t = ngx_parse_time(&s, 1);
+		if (*t == (time_t) NGX_ERROR)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time value \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	ctx->retain = ngx_max(ctx->stale_while_revalidate, ctx->stale_if_error);
+
+#if (NGX_THREADS)
+	// 后台刷新在线程池中执行，未指定时使用 default 线程池
+	if (ctx->stale_while_revalidate)
+	{
+		pmcf->refresh_pool = ngx_thread_pool_add(cf, pool.len ? &pool : NULL);
+		if (pmcf->refresh_pool == NULL)
+		{
+			return NGX_CONF_ERROR;
+		}
+	}
+#endif
+
+	pmcf->cache_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_private_image_module);
+	if (pmcf->cache_zone == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	if (pmcf->cache_zone->data)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	pmcf->cache_zone->init = ngx_http_private_image_cache_init_zone;
+	pmcf->cache_zone->data = ctx;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_private_image_cache_ctx_t  *octx = data;
+	ngx_http_private_image_cache_ctx_t  *ctx;
+	size_t                               len;
+	ngx_uint_t                           n;
+
+	ctx = shm_zone->data;
+
+	// reload 时保留已缓存的鉴权结果
+	if (octx)
+	{
+		ctx->sh = octx->sh;
+		ctx->shpool = octx->shpool;
+		ctx->size = octx->size;
+		return NGX_OK;
+	}
+
+	ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+	ctx->size = shm_zone->shm.size;
+
+	if (shm_zone->shm.exists)
+	{
+		ctx->sh = ctx->shpool->data;
+		return NGX_OK;
+	}
+
+	ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_private_image_cache_sh_t));
+	if (ctx->sh == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ctx->shpool->data = ctx->sh;
+
+	ngx_queue_init(&ctx->sh->queue);
+
+	// 组数为 2 的幂，每组对应 2KB 的共享内存，即每个节点平均按 256 字节估算
+	for (n = 1; n * 2 * 2048 <= ctx->size; n <<= 1) { /* void */ }
+
+	ctx->sh->mask = n - 1;
+	ctx->sh->buckets = ngx_slab_calloc(ctx->shpool, n * sizeof(ngx_http_private_image_cache_bucket_t));
+	if (ctx->sh->buckets == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	len = sizeof(" in private_image_auth_cache zone \"\"") + shm_zone->shm.name.len;
+
+	ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+	if (ctx->shpool->log_ctx == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(ctx->shpool->log_ctx, " in private_image_auth_cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+	// 共享内存不足时淘汰旧节点，不需要在错误日志中记录分配失败
+	ctx->shpool->log_nomem = 0;
+
+	// 新启动或升级时从快照恢复，避免所有请求同时请求鉴权服务
+	if (ctx->snapshot.len)
+	{
+		ngx_http_private_image_cache_load(ctx, shm_zone->shm.log);
+	}
+
+	return NGX_OK;
+}
+
+// 加载快照，文件不存在或格式不对时从空缓存开始
+static void
+ngx_http_private_image_cache_load(ngx_http_private_image_cache_ctx_t *ctx, ngx_log_t *log)
+{
+	u_char                                    *addr, *p, *last;
+	size_t                                     size;
+	time_t                                     now;
+	uint64_t                                   i;
+	ngx_fd_t                                   fd;
+	ngx_str_t                                  token, user_id, prefix;
+	ngx_uint_t                                 loaded;
+	ngx_file_info_t                            fi;
+	ngx_http_private_image_snapshot_header_t  *header;
+	ngx_http_private_image_snapshot_record_t  *rec;
+
+	fd = ngx_open_file(ctx->snapshot.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		if (ngx_errno != NGX_ENOENT)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%V\" failed", &ctx->snapshot);
+		}
+
+		return;
+	}
+
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_fd_info_n " \"%V\" failed", &ctx->snapshot);
+		ngx_close_file(fd);
+		return;
+	}
+
+	size = (size_t) ngx_file_size(&fi);
+	addr = NULL;
+
+	if (size >= sizeof(ngx_http_private_image_snapshot_header_t))
+	{
+		addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "mmap(\"%V\") failed", &ctx->snapshot);
+			addr = NULL;
+		}
+	}
+
+	ngx_close_file(fd);
+
+	if (addr == NULL)
+	{
+		return;
+	}
+
+	header = (ngx_http_private_image_snapshot_header_t *) addr;
+
+	if (header->magic != NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_MAGIC
+	    || header->version != NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_VERSION
+	    || header->size != size - sizeof(ngx_http_private_image_snapshot_header_t)
+	    || header->crc != ngx_crc32_long(addr + sizeof(ngx_http_private_image_snapshot_header_t), (size_t) header->size))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0, "private image auth cache snapshot \"%V\" is invalid", &ctx->snapshot);
+		munmap(addr, size);
+		return;
+	}
+
+	now = ngx_time();
+	loaded = 0;
+	p = addr + sizeof(ngx_http_private_image_snapshot_header_t);
+	last = addr + size;
+
+	for (i = 0; i < header->count; i++)
+	{
+		if ((size_t) (last - p) < sizeof(ngx_http_private_image_snapshot_record_t))
+		{
+			break;
+		}
+
+		rec = (ngx_http_private_image_snapshot_record_t *) p;
+		p += sizeof(ngx_http_private_image_snapshot_record_t);
+
+		if ((size_t) (last - p) < (size_t) rec->token_len + rec->user_len + rec->prefix_len)
+		{
+			break;
+		}
+
+		token.data = p;
+		token.len = rec->token_len;
+		user_id.data = token.data + token.len;
+		user_id.len = rec->user_len;
+		prefix.data = user_id.data + user_id.len;
+		prefix.len = rec->prefix_len;
+
+		p += ngx_align(token.len + user_id.len + prefix.len, 8);
+
+		if (rec->expire + ctx->retain <= now)
+		{
+			continue;
+		}
+
+		if (ngx_http_private_image_cache_insert(ctx, &token, &user_id, &prefix, rec->exact, (time_t) rec->expire) != NGX_OK)
+		{
+			break;
+		}
+
+		loaded++;
+	}
+
+	munmap(addr, size);
+
+	ngx_log_error(NGX_LOG_NOTICE, log, 0, "private image auth cache: %ui entries loaded from \"%V\"",
+	              loaded, &ctx->snapshot);
+}
+
+// 保存快照：按组分批持锁，每批只把节点复制到缓冲区中，写文件在释放锁之后进行。
+// 记录比节点小，缓冲区按共享内存的大小分配一次，之后重复使用
+static void
+ngx_http_private_image_cache_save(ngx_shm_zone_t *zone, ngx_log_t *log)
+{
+	u_char                                    *buf, *p, *last;
+	size_t                                     len;
+	ssize_t                                    n;
+	time_t                                     now;
+	ngx_fd_t                                   fd;
+	ngx_uint_t                                 i, j, k, count;
+	ngx_http_private_image_cache_ctx_t        *ctx;
+	ngx_http_private_image_cache_way_t        *way;
+	ngx_http_private_image_cache_node_t       *cn;
+	ngx_http_private_image_snapshot_header_t  *header;
+	ngx_http_private_image_snapshot_record_t  *rec;
+
+	ctx = zone->data;
+
+	if (ngx_http_private_image_snapshot_buf == NULL)
+	{
+		ngx_http_private_image_snapshot_buf = ngx_alloc(zone->shm.size, log);
+		if (ngx_http_private_image_snapshot_buf == NULL)
+		{
+			return;
+		}
+	}
+
+	buf = ngx_http_private_image_snapshot_buf;
+	now = ngx_time();
+	count = 0;
+	p = buf + sizeof(ngx_http_private_image_snapshot_header_t);
+	last = buf + zone->shm.size;
+
+	for (i = 0; i <= ctx->sh->mask; i += NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_BUCKETS)
+	{
+		ngx_shmtx_lock(&ctx->shpool->mutex);
+
+		for (j = i; j <= ctx->sh->mask && j < i + NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_BUCKETS; j++)
+		{
+			for (k = 0; k < NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS; k++)
+			{
+				way = &ctx->sh->buckets[j].ways[k];
+				if (way->hash == 0)
+				{
+					continue;
+				}
+
+				cn = ngx_http_private_image_cache_node(ctx, way->offset);
+
+				if (cn->expire + ctx->retain <= now)
+				{
+					continue;
+				}
+
+				len = ngx_align((size_t) cn->token_len + cn->user_len + cn->prefix_len, 8);
+
+				if ((size_t) (last - p) < sizeof(ngx_http_private_image_snapshot_record_t) + len)
+				{
+					continue;
+				}
+
+				rec = (ngx_http_private_image_snapshot_record_t *) p;
+				rec->expire = cn->expire;
+				rec->token_len = cn->token_len;
+				rec->user_len = cn->user_len;
+				rec->prefix_len = cn->prefix_len;
+				rec->exact = cn->exact;
+				rec->reserved = 0;
+
+				// 对齐填充的部分清零
+				ngx_memzero(p + sizeof(ngx_http_private_image_snapshot_record_t) + len - 8, 8);
+				ngx_memcpy(p + sizeof(ngx_http_private_image_snapshot_record_t), cn->data,
+				           (size_t) cn->token_len + cn->user_len + cn->prefix_len);
+				p += sizeof(ngx_http_private_image_snapshot_record_t) + len;
+
+				count++;
+			}
+		}
+
+		ngx_shmtx_unlock(&ctx->shpool->mutex);
+	}
+
+	header = (ngx_http_private_image_snapshot_header_t *) buf;
+	header->magic = NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_MAGIC;
+	header->version = NGX_HTTP_PRIVATE_IMAGE_SNAPSHOT_VERSION;
+	header->count = count;
+	header->saved = now;
+	header->size = p - buf - sizeof(ngx_http_private_image_snapshot_header_t);
+	header->crc = ngx_crc32_long(buf + sizeof(ngx_http_private_image_snapshot_header_t), (size_t) header->size);
+	header->reserved = 0;
+
+	// 先写临时文件再 rename，加载时不会读到写了一半的快照
+	ctx->snapshot_temp.len = ngx_sprintf(ctx->snapshot_temp.data, "%V.%P.tmp%Z", &ctx->snapshot, ngx_pid)
+	                         - ctx->snapshot_temp.data - 1;
+
+	fd = ngx_open_file(ctx->snapshot_temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%V\" failed", &ctx->snapshot_temp);
+		return;
+	}
+
+	len = p - buf;
+	n = ngx_write_fd(fd, buf, len);
+
+	if (n != (ssize_t) len)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_write_fd_n " \"%V\" failed", &ctx->snapshot_temp);
+		ngx_close_file(fd);
+		ngx_delete_file(ctx->snapshot_temp.data);
+		return;
+	}
+
+	ngx_close_file(fd);
+
+	if (ngx_rename_file(ctx->snapshot_temp.data, ctx->snapshot.data) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_rename_file_n " \"%V\" to \"%V\" failed",
+		              &ctx->snapshot_temp, &ctx->snapshot);
+		ngx_delete_file(ctx->snapshot_temp.data);
+		return;
+	}
+
+	ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "private image auth cache: %ui entries saved to \"%V\"",
+	               count, &ctx->snapshot);
+}
+
+// 每个 worker 分配自己的一级缓存，只由 0 号 worker 保存快照
+ngx_int_t
+ngx_http_private_image_cache_init_process(ngx_cycle_t *cycle)
+{
+	ngx_uint_t                           n;
+	ngx_event_t                         *ev = &ngx_http_private_image_snapshot_event;
+	ngx_http_private_image_cache_ctx_t  *ctx;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	pmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_private_image_module);
+	if (pmcf == NULL || pmcf->cache_zone == NULL || !ngx_http_private_image_is_worker())
+	{
+		return NGX_OK;
+	}
+
+	ctx = pmcf->cache_zone->data;
+
+	if (ctx->l1_size && ctx->l1_valid)
+	{
+		for (n = 1; n < ctx->l1_size; n <<= 1) { /* void */ }
+
+		ngx_http_private_image_l1 = ngx_calloc(n * sizeof(ngx_http_private_image_l1_slot_t), cycle->log);
+		if (ngx_http_private_image_l1 == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		ngx_http_private_image_l1_mask = n - 1;
+	}
+
+	if (ctx->snapshot.len == 0 || ngx_worker != 0)
+	{
+		return NGX_OK;
+	}
+
+	ev->handler = ngx_http_private_image_snapshot_handler;
+	ev->data = pmcf->cache_zone;
+	ev->log = cycle->log;
+	ev->cancelable = 1;
+
+	ngx_add_timer(ev, ctx->snapshot_interval);
+
+	return NGX_OK;
+}
+
+// 退出时保存一次，reload 和升级时旧 worker 的最新状态也会写入快照
+void
+ngx_http_private_image_cache_exit_process(ngx_cycle_t *cycle)
+{
+	ngx_event_t  *ev = &ngx_http_private_image_snapshot_event;
+
+	if (ev->handler == NULL)
+	{
+		return;
+	}
+
+	ngx_http_private_image_cache_save(ev->data, cycle->log);
+}
+
+static void
+ngx_http_private_image_snapshot_handler(ngx_event_t *ev)
+{
+	ngx_shm_zone_t                      *zone = ev->data;
+	ngx_http_private_image_cache_ctx_t  *ctx = zone->data;
+
+	ngx_http_private_image_cache_save(zone, ev->log);
+
+	if (!ngx_exiting)
+	{
+		ngx_add_timer(ev, ctx->snapshot_interval);
+	}
+}
+
+// 查找 token 对应的授权，返回 NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT 等缓存状态：
+// 过期但仍在 stale_while_revalidate 时间内的授权返回 UPDATING，可以直接使用，
+// 其中只有一个请求的 refresh 被置为 1，由它发起后台刷新；
+// 仍在 stale_if_error 时间内的授权返回 STALE，由调用者在鉴权服务出错时决定是否使用
+ngx_uint_t
+ngx_http_private_image_cache_lookup(ngx_http_request_t *r, ngx_str_t *token, ngx_http_private_image_grant_t *grant, ngx_uint_t *refresh)
+{
+	time_t                                  now;
+	uint64_t                                hash;
+	ngx_int_t                               rc;
+	ngx_uint_t                              i, status;
+	ngx_atomic_uint_t                       updating, generation;
+	ngx_http_private_image_cache_hit_t      hit;
+	ngx_http_private_image_cache_ctx_t     *ctx;
+	ngx_http_private_image_cache_bucket_t  *b;
+	ngx_http_private_image_main_conf_t     *pmcf;
+
+	*refresh = 0;
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->cache_zone == NULL)
+	{
+		return NGX_HTTP_PRIVATE_IMAGE_CACHE_BYPASS;
+	}
+
+	ctx = pmcf->cache_zone->data;
+	hash = ngx_http_private_image_cache_hash(token);
+	b = ngx_http_private_image_cache_bucket(ctx, hash);
+
+	if (ngx_http_private_image_l1)
+	{
+		if (ngx_http_private_image_l1_lookup(ctx, r, hash, token, grant) == NGX_OK)
+		{
+			ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_CACHE_L1_HITS, 1);
+			return NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT;
+		}
+	}
+
+	// 在查找二级缓存之前读取代数，查找之后发生的撤销会使写入一级缓存的授权失效
+	generation = ctx->sh->generation;
+	ngx_memory_barrier();
+
+	rc = NGX_AGAIN;
+
+	for (i = 0; rc == NGX_AGAIN && i < NGX_HTTP_PRIVATE_IMAGE_CACHE_RETRIES; i++)
+	{
+		rc = ngx_http_private_image_cache_read(ctx, b, hash, token, r, &hit);
+	}
+
+	// 这一组一直在被修改，加锁之后不会再有写入方
+	if (rc == NGX_AGAIN)
+	{
+		ngx_shmtx_lock(&ctx->shpool->mutex);
+		rc = ngx_http_private_image_cache_read(ctx, b, hash, token, r, &hit);
+		ngx_shmtx_unlock(&ctx->shpool->mutex);
+	}
+
+	if (rc != NGX_OK)
+	{
+		return NGX_HTTP_PRIVATE_IMAGE_CACHE_MISS;
+	}
+
+	now = ngx_time();
+
+	// 这一路可能已经被替换，命中时间和刷新标记写错时只影响淘汰顺序和一次刷新
+	if (hit.expire > now)
+	{
+		status = NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT;
+
+		// 同一秒内的命中不再写入，避免各个 worker 反复写同一个缓存行
+		if (hit.way->accessed != (uint32_t) now)
+		{
+			hit.way->accessed = (uint32_t) now;
+		}
+
+		if (ngx_http_private_image_l1)
+		{
+			ngx_http_private_image_l1_store(ctx, hash, token, &hit, generation);
+		}
+	}
+	else if (hit.expire + ctx->stale_while_revalidate > now)
+	{
+		status = NGX_HTTP_PRIVATE_IMAGE_CACHE_UPDATING;
+
+		if (hit.way->accessed != (uint32_t) now)
+		{
+			hit.way->accessed = (uint32_t) now;
+		}
+
+		updating = hit.way->updating;
+
+		if ((updating == 0 || now - (time_t) updating >= NGX_HTTP_PRIVATE_IMAGE_CACHE_REFRESH_TIMEOUT)
+		    && ngx_atomic_cmp_set(&hit.way->updating, updating, (ngx_atomic_uint_t) now))
+		{
+			*refresh = 1;
+		}
+	}
+	else if (hit.expire + ctx->stale_if_error > now)
+	{
+		status = NGX_HTTP_PRIVATE_IMAGE_CACHE_STALE;
+	}
+	else
+	{
+		return NGX_HTTP_PRIVATE_IMAGE_CACHE_MISS;
+	}
+
+	grant->user_id = hit.user_id;
+
+	return status;
+}
+
+// 查找一级缓存，只返回未过期、没有被撤销且覆盖当前 uri 的授权
+static ngx_int_t
+ngx_http_private_image_l1_lookup(ngx_http_private_image_cache_ctx_t *ctx, ngx_http_request_t *r, uint64_t hash, ngx_str_t *token, ngx_http_private_image_grant_t *grant)
+{
+	ngx_http_private_image_l1_slot_t  *slot;
+
+	slot = &ngx_http_private_image_l1[hash & ngx_http_private_image_l1_mask];
+
+	if (slot->hash != hash
+	    || slot->token_len != token->len
+	    || ngx_memcmp(slot->token, token->data, token->len) != 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	if (slot->expire <= ngx_time() || slot->generation != ctx->sh->generation)
+	{
+		slot->hash = 0;
+		return NGX_DECLINED;
+	}
+
+	if (r->uri.len < slot->prefix_len
+	    || (slot->exact && r->uri.len != slot->prefix_len)
+	    || ngx_memcmp(r->uri.data, slot->prefix, slot->prefix_len) != 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	grant->user_id.data = ngx_pnalloc(r->pool, slot->user_len);
+	if (grant->user_id.data == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_memcpy(grant->user_id.data, slot->user_id, slot->user_len);
+	grant->user_id.len = slot->user_len;
+
+	return NGX_OK;
+}
+
+// 把命中二级缓存的授权写入一级缓存，替换同一个槽中原有的授权
+static void
+ngx_http_private_image_l1_store(ngx_http_private_image_cache_ctx_t *ctx, uint64_t hash, ngx_str_t *token, ngx_http_private_image_cache_hit_t *hit, ngx_atomic_uint_t generation)
+{
+	ngx_http_private_image_l1_slot_t  *slot;
+
+	if (!hit->l1
+	    || token->len > NGX_HTTP_PRIVATE_IMAGE_L1_TOKEN_LEN
+	    || hit->user_id.len > NGX_HTTP_PRIVATE_IMAGE_L1_USER_LEN)
+	{
+		return;
+	}
+
+	slot = &ngx_http_private_image_l1[hash & ngx_http_private_image_l1_mask];
+
+	slot->hash = hash;
+	slot->expire = ngx_min(hit->expire, ngx_time() + ctx->l1_valid);
+	slot->generation = generation;
+	slot->exact = (u_char) hit->exact;
+	slot->token_len = (u_char) token->len;
+	slot->user_len = (u_char) hit->user_id.len;
+	slot->prefix_len = (u_char) hit->prefix_len;
+
+	ngx_memcpy(slot->token, token->data, token->len);
+	ngx_memcpy(slot->user_id, hit->user_id.data, hit->user_id.len);
+	ngx_memcpy(slot->prefix, hit->prefix, hit->prefix_len);
+}
+
+// 在一组中查找 token，授权覆盖当前 uri 时把结果复制到 hit 并返回 NGX_OK。
+// 不加锁时节点可能正在被删除，内存也可能已经分配给其他节点，所以偏移和长度都先检查范围再使用；
+// 读取期间这一组被修改时返回 NGX_AGAIN
+static ngx_int_t
+ngx_http_private_image_cache_read(ngx_http_private_image_cache_ctx_t *ctx, ngx_http_private_image_cache_bucket_t *b, uint64_t hash, ngx_str_t *token, ngx_http_request_t *r, ngx_http_private_image_cache_hit_t *hit)
+{
+	u_char                               *data;
+	size_t                                token_len, user_len, prefix_len, offset;
+	ngx_int_t                             rc;
+	ngx_uint_t                            i, exact;
+	ngx_atomic_uint_t                     seq;
+	ngx_http_private_image_cache_node_t  *cn;
+
+	seq = b->seq;
+	if (seq & 1)
+	{
+		return NGX_AGAIN;
+	}
+
+	ngx_memory_barrier();
+
+	rc = NGX_DECLINED;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS; i++)
+	{
+		if (b->ways[i].hash != hash)
+		{
+			continue;
+		}
+
+		offset = b->ways[i].offset;
+		if (offset > ctx->size - offsetof(ngx_http_private_image_cache_node_t, data))
+		{
+			break;
+		}
+
+		cn = ngx_http_private_image_cache_node(ctx, offset);
+
+		token_len = cn->token_len;
+		user_len = cn->user_len;
+		prefix_len = cn->prefix_len;
+		exact = cn->exact;
+
+		if (token_len + user_len + prefix_len > ctx->size - offset - offsetof(ngx_http_private_image_cache_node_t, data))
+		{
+			break;
+		}
+
+		data = cn->data;
+
+		if (token_len != token->len || ngx_memcmp(data, token->data, token_len) != 0)
+		{
+			continue;
+		}
+
+		// 授权范围必须覆盖当前 uri
+		if (r->uri.len < prefix_len
+		    || (exact && r->uri.len != prefix_len)
+		    || ngx_memcmp(r->uri.data, data + token_len + user_len, prefix_len) != 0)
+		{
+			break;
+		}
+
+		hit->user_id.data = ngx_pnalloc(r->pool, user_len);
+		if (hit->user_id.data == NULL)
+		{
+			rc = NGX_ERROR;
+			break;
+		}
+
+		ngx_memcpy(hit->user_id.data, data + token_len, user_len);
+		hit->user_id.len = user_len;
+		hit->expire = cn->expire;
+		hit->way = &b->ways[i];
+		hit->l1 = 0;
+
+		if (ngx_http_private_image_l1 && prefix_len <= NGX_HTTP_PRIVATE_IMAGE_L1_PREFIX_LEN)
+		{
+			ngx_memcpy(hit->prefix, data + token_len + user_len, prefix_len);
+			hit->prefix_len = prefix_len;
+			hit->exact = exact;
+			hit->l1 = 1;
+		}
+
+		rc = NGX_OK;
+		break;
+	}
+
+	ngx_memory_barrier();
+
+	if (b->seq != seq)
+	{
+		return NGX_AGAIN;
+	}
+
+	return rc;
+}
+
+// 缓存一次鉴权通过的结果，已有的同一 token 的节点会被替换。
+// 后台刷新完成时请求可能已经结束，所以不使用 ngx_http_request_t
+void
+ngx_http_private_image_cache_store(ngx_http_private_image_main_conf_t *pmcf, ngx_log_t *log, ngx_str_t *token, ngx_str_t *uri, ngx_http_private_image_grant_t *grant)
+{
+	time_t                                ttl;
+	ngx_str_t                            *prefix;
+	ngx_uint_t                            exact;
+	ngx_http_private_image_cache_ctx_t   *ctx;
+
+	if (pmcf->cache_zone == NULL)
+	{
+		return;
+	}
+
+	ctx = pmcf->cache_zone->data;
+
+	ttl = ctx->valid;
+	if (grant->ttl >= 0 && grant->ttl < ttl)
+	{
+		ttl = grant->ttl;
+	}
+
+	if (ttl == 0)
+	{
+		return;
+	}
+
+	if (grant->prefix.len)
+	{
+		prefix = &grant->prefix;
+		exact = 0;
+	}
+	else
+	{
+		prefix = uri;
+		exact = 1;
+	}
+
+	if (token->len > 0xffff || grant->user_id.len > 0xffff || prefix->len > 0xffff)
+	{
+		return;
+	}
+
+	ngx_shmtx_lock(&ctx->shpool->mutex);
+
+	ngx_http_private_image_cache_expire(ctx, 0);
+
+	if (ngx_http_private_image_cache_insert(ctx, token, &grant->user_id, prefix, exact, ngx_time() + ttl) != NGX_OK)
+	{
+		ngx_shmtx_unlock(&ctx->shpool->mutex);
+		ngx_log_error(NGX_LOG_ALERT, log, 0,
+		              "could not allocate node%s", ctx->shpool->log_ctx);
+		return;
+	}
+
+	ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+// 插入一个节点并放到队首，已有的同一 token 的节点会被替换。共享内存不足时从队尾淘汰，
+// 所在的组没有空闲的路时替换其中最久没有命中的节点。调用者需要持有共享内存的锁
+static ngx_int_t
+ngx_http_private_image_cache_insert(ngx_http_private_image_cache_ctx_t *ctx, ngx_str_t *token, ngx_str_t *user_id, ngx_str_t *prefix, ngx_uint_t exact, time_t expire)
+{
+	u_char                                 *p;
+	size_t                                  size;
+	time_t                                  now;
+	uint64_t                                hash;
+	ngx_uint_t                              i, w;
+	ngx_http_private_image_cache_way_t     *way;
+	ngx_http_private_image_cache_node_t    *cn, *old;
+	ngx_http_private_image_cache_bucket_t  *b;
+
+	hash = ngx_http_private_image_cache_hash(token);
+	b = ngx_http_private_image_cache_bucket(ctx, hash);
+	now = ngx_time();
+
+	cn = ngx_http_private_image_cache_find(ctx, hash, token);
+	if (cn)
+	{
+		ngx_http_private_image_cache_delete(ctx, cn);
+	}
+
+	size = offsetof(ngx_http_private_image_cache_node_t, data)
+	       + token->len + user_id->len + prefix->len;
+
+	cn = ngx_slab_alloc_locked(ctx->shpool, size);
+	if (cn == NULL)
+	{
+		ngx_http_private_image_cache_expire(ctx, 1);
+
+		cn = ngx_slab_alloc_locked(ctx->shpool, size);
+		if (cn == NULL)
+		{
+			return NGX_ERROR;
+		}
+	}
+
+	w = NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS; i++)
+	{
+		if (b->ways[i].hash == 0)
+		{
+			w = i;
+			break;
+		}
+
+		if (w == NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS || b->ways[i].accessed < b->ways[w].accessed)
+		{
+			w = i;
+		}
+	}
+
+	way = &b->ways[w];
+
+	if (way->hash)
+	{
+		old = ngx_http_private_image_cache_node(ctx, way->offset);
+
+		if (old->expire + ctx->retain > now)
+		{
+			ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_CACHE_EVICTIONS, 1);
+		}
+
+		ngx_http_private_image_cache_delete(ctx, old);
+	}
+
+	cn->hash = hash;
+	cn->expire = expire;
+	cn->touched = (uint32_t) now;
+	cn->token_len = (u_short) token->len;
+	cn->user_len = (u_short) user_id->len;
+	cn->prefix_len = (u_short) prefix->len;
+	cn->exact = (u_char) exact;
+	cn->way = (u_char) w;
+
+	p = ngx_cpymem(cn->data, token->data, token->len);
+	p = ngx_cpymem(p, user_id->data, user_id->len);
+	ngx_memcpy(p, prefix->data, prefix->len);
+
+	ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+
+	ngx_http_private_image_cache_write_begin(b);
+
+	way->offset = (uint32_t) ((u_char *) cn - (u_char *) ctx->shpool);
+	way->updating = 0;
+	way->accessed = (uint32_t) now;
+	way->hash = hash;
+
+	ngx_http_private_image_cache_write_end(b);
+
+	return NGX_OK;
+}
+
+// 鉴权服务明确拒绝时删除缓存的授权，例如后台刷新时发现 token 已经失效。返回删除的节点数
+ngx_uint_t
+ngx_http_private_image_cache_remove(ngx_http_private_image_main_conf_t *pmcf, ngx_str_t *token)
+{
+	uint64_t                              hash;
+	ngx_uint_t                            n;
+	ngx_http_private_image_cache_ctx_t   *ctx;
+	ngx_http_private_image_cache_node_t  *cn;
+
+	if (pmcf->cache_zone == NULL)
+	{
+		return 0;
+	}
+
+	ctx = pmcf->cache_zone->data;
+	hash = ngx_http_private_image_cache_hash(token);
+	n = 0;
+
+	ngx_shmtx_lock(&ctx->shpool->mutex);
+
+	cn = ngx_http_private_image_cache_find(ctx, hash, token);
+	if (cn)
+	{
+		ngx_http_private_image_cache_delete(ctx, cn);
+		ngx_atomic_fetch_add(&ctx->sh->generation, 1);
+		n = 1;
+	}
+
+	ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+	return n;
+}
+
+// private_image_auth_revoke：退出登录、封禁等需要立即生效时，由业务方调用这个接口删除缓存的授权，
+// 缓存在共享内存中，一次调用对所有 worker 生效
+char *
+ngx_http_private_image_auth_revoke(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t  *clcf;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_private_image_revoke_handler;
+
+	return NGX_CONF_OK;
+}
+
+// POST 或 DELETE ?token=xxx 删除一个 token 的授权，?user=xxx 删除一个用户所有 token 的授权，
+// 返回 {"revoked":n}
+static ngx_int_t
+ngx_http_private_image_revoke_handler(ngx_http_request_t *r)
+{
+	u_char                              *p;
+	ngx_int_t                            rc;
+	ngx_str_t                            arg, value;
+	ngx_buf_t                           *b;
+	ngx_uint_t                           n, user;
+	ngx_chain_t                          out;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	if (!(r->method & (NGX_HTTP_POST | NGX_HTTP_DELETE)))
+	{
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->cache_zone == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "private_image_auth_revoke requires private_image_auth_cache");
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	if (ngx_http_arg(r, (u_char *) "token", 5, &arg) == NGX_OK && arg.len)
+	{
+		user = 0;
+	}
+	else if (ngx_http_arg(r, (u_char *) "user", 4, &arg) == NGX_OK && arg.len)
+	{
+		user = 1;
+	}
+	else
+	{
+		return NGX_HTTP_BAD_REQUEST;
+	}
+
+	value.data = ngx_pnalloc(r->pool, arg.len);
+	if (value.data == NULL)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	p = value.data;
+	ngx_unescape_uri(&p, &arg.data, arg.len, NGX_UNESCAPE_URI);
+	value.len = p - value.data;
+
+	if (user)
+	{
+		n = ngx_http_private_image_cache_revoke_user(pmcf, &value);
+	}
+	else
+	{
+		n = ngx_http_private_image_cache_remove(pmcf, &value);
+	}
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_REVOCATIONS, n);
+
+	ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "private image revoke %s \"%V\", %ui entries removed",
+	              user ? "user" : "token", &value, n);
+
+	b = ngx_create_temp_buf(r->pool, sizeof("{\"revoked\":}" CRLF) - 1 + NGX_INT_T_LEN);
+	if (b == NULL)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	b->last = ngx_sprintf(b->last, "{\"revoked\":%ui}" CRLF, n);
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	ngx_str_set(&r->headers_out.content_type, "application/json");
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = b->last - b->pos;
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+	{
+		return rc;
+	}
+
+	return ngx_http_output_filter(r, &out);
+}
+
+// 删除一个用户所有 token 的授权。节点按 token 索引，需要遍历整个队列，
+// 只用于不频繁的撤销操作
+static ngx_uint_t
+ngx_http_private_image_cache_revoke_user(ngx_http_private_image_main_conf_t *pmcf, ngx_str_t *user_id)
+{
+	ngx_uint_t                            n;
+	ngx_queue_t                          *q, *next;
+	ngx_http_private_image_cache_ctx_t   *ctx;
+	ngx_http_private_image_cache_node_t  *cn;
+
+	ctx = pmcf->cache_zone->data;
+	n = 0;
+
+	ngx_shmtx_lock(&ctx->shpool->mutex);
+
+	for (q = ngx_queue_head(&ctx->sh->queue); q != ngx_queue_sentinel(&ctx->sh->queue); q = next)
+	{
+		next = ngx_queue_next(q);
+		cn = ngx_queue_data(q, ngx_http_private_image_cache_node_t, queue);
+
+		if (cn->user_len == user_id->len
+		    && ngx_memcmp(cn->data + cn->token_len, user_id->data, user_id->len) == 0)
+		{
+			ngx_http_private_image_cache_delete(ctx, cn);
+			n++;
+		}
+	}
+
+	if (n)
+	{
+		ngx_atomic_fetch_add(&ctx->sh->generation, 1);
+	}
+
+	ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+	return n;
+}
+
+// 加锁查找
+static ngx_http_private_image_cache_node_t *
+ngx_http_private_image_cache_find(ngx_http_private_image_cache_ctx_t *ctx, uint64_t hash, ngx_str_t *token)
+{
+	ngx_uint_t                              i;
+	ngx_http_private_image_cache_node_t    *cn;
+	ngx_http_private_image_cache_bucket_t  *b;
+
+	b = ngx_http_private_image_cache_bucket(ctx, hash);
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_CACHE_WAYS; i++)
+	{
+		if (b->ways[i].hash != hash)
+		{
+			continue;
+		}
+
+		cn = ngx_http_private_image_cache_node(ctx, b->ways[i].offset);
+
+		if (cn->token_len == token->len && ngx_memcmp(cn->data, token->data, token->len) == 0)
+		{
+			return cn;
+		}
+	}
+
+	return NULL;
+}
+
+// 先从组中移除再释放内存，之后开始的查找不会再找到这个节点，
+// 正在读取的查找会发现序列号变化而重试
+static void
+ngx_http_private_image_cache_delete(ngx_http_private_image_cache_ctx_t *ctx, ngx_http_private_image_cache_node_t *cn)
+{
+	ngx_http_private_image_cache_bucket_t  *b;
+
+	b = ngx_http_private_image_cache_bucket(ctx, cn->hash);
+
+	ngx_http_private_image_cache_write_begin(b);
+	b->ways[cn->way].hash = 0;
+	ngx_http_private_image_cache_write_end(b);
+
+	ngx_queue_remove(&cn->queue);
+	ngx_slab_free_locked(ctx->shpool, cn);
+}
+
+// 从队尾删除最多 3 个已经彻底过期的节点；force 为 1 时无论是否过期都删除第一个，
+// 用于共享内存不足时腾出空间，此时最近命中过的节点会移回队首，最多跳过 8 个
+static void
+ngx_http_private_image_cache_expire(ngx_http_private_image_cache_ctx_t *ctx, ngx_uint_t force)
+{
+	time_t                                  now;
+	uint32_t                                accessed;
+	ngx_uint_t                              n, skipped;
+	ngx_queue_t                            *q;
+	ngx_http_private_image_cache_node_t    *cn;
+	ngx_http_private_image_cache_bucket_t  *b;
+
+	now = ngx_time();
+	skipped = 0;
+
+	for (n = 0; n < 3; /* void */ )
+	{
+		if (ngx_queue_empty(&ctx->sh->queue))
+		{
+			return;
+		}
+
+		q = ngx_queue_last(&ctx->sh->queue);
+		cn = ngx_queue_data(q, ngx_http_private_image_cache_node_t, queue);
+
+		if (cn->expire + ctx->retain > now)
+		{
+			if (!force || n != 0)
+			{
+				return;
+			}
+
+			b = ngx_http_private_image_cache_bucket(ctx, cn->hash);
+			accessed = b->ways[cn->way].accessed;
+
+			if (accessed != cn->touched && skipped++ < 8)
+			{
+				cn->touched = accessed;
+				ngx_queue_remove(q);
+				ngx_queue_insert_head(&ctx->sh->queue, q);
+				continue;
+			}
+
+			ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_CACHE_EVICTIONS, 1);
+		}
+
+		ngx_http_private_image_cache_delete(ctx, cn);
+		n++;
+	}
+}
@@ -0,0 +1,1376 @@
+#include "ngx_private_image_module.h"
+
+// 打开图片文件。图片放在网络存储上时 open() 和 fstat() 可能阻塞几十毫秒，整个 worker 都会停下来。
+// 配置 private_image_open_threads 后，open_file_cache 中没有有效记录的文件在线程池中打开，
+// 请求挂起到打开完成，之后直接使用线程打开的文件；缓存命中不需要系统调用，仍然在当前线程中完成。
+//
+// 被盗链或者已经删除的图片会被反复请求，private_image_missing_cache 记住不存在的路径，
+// 有效期内直接返回 404，不再调用 open()。每个 worker 一张直接映射的表，只保存路径的哈希。
+//
+// Content-Type 按扩展名从 types 中查找；扩展名不在 types 中时读取文件头识别图片格式，
+// 结果按路径、inode、修改时间和大小缓存，与 open_file_cache 判断文件是否变化的方式相同。
+//
+// private_image_file_cache 把小图片的内容保存在共享内存中，按路径查找，inode、修改时间和大小
+// 与打开的文件相同时直接从内存发送，不再读文件；valid 时间内检查过的内容连文件都不需要打开。
+// 内存不足时按最近最少使用淘汰。命中时持锁只增加引用计数，内容在锁外复制；
+// 配置了线程池时，未缓存的文件在线程池中读取后加入缓存，不阻塞 worker
+
+// 每个 worker 缓存的文件头识别结果数
+#define  NGX_HTTP_PRIVATE_IMAGE_SNIFF_CACHE  1024
+
+// 不存在的路径缓存的槽数上限，init_process 中向上取整为 2 的幂时不会溢出
+#define  NGX_HTTP_PRIVATE_IMAGE_MISSING_MAX  1048576
+
+// 文件缓存插入新内容时最多淘汰的节点数
+#define  NGX_HTTP_PRIVATE_IMAGE_FILE_EVICT   16
+
+// 文件缓存的节点，data 中依次保存路径和文件内容，node.key 为路径的 crc32
+typedef struct
+{
+	ngx_rbtree_node_t  node;
+	ngx_queue_t        queue;
+	ngx_file_uniq_t    uniq;
+	time_t             mtime;
+	// 最近一次确认内容与文件相同的时间
+	time_t             checked;
+	// 最近一次移到队首的时间
+	time_t             accessed;
+	size_t             size;
+	// 正在复制内容的请求数，不为 0 时节点不会被释放
+	ngx_uint_t         refs;
+	// 删除时还有请求在复制内容，由最后一个请求释放
+	u_char             removed;
+	u_short            len;
+	u_char             data[1];
+} ngx_http_private_image_file_node_t;
+
+typedef struct
+{
+	ngx_rbtree_t       rbtree;
+	ngx_rbtree_node_t  sentinel;
+	// 最近使用的节点在队首
+	ngx_queue_t        queue;
+} ngx_http_private_image_file_sh_t;
+
+typedef struct
+{
+	ngx_http_private_image_file_sh_t  *sh;
+	ngx_slab_pool_t                   *shpool;
+	// 缓存的文件大小上限
+	size_t                             max_file;
+	// 不打开文件直接使用缓存内容的时间，0 表示每次都打开文件确认
+	time_t                             valid;
+} ngx_http_private_image_file_ctx_t;
+
+static ngx_int_t ngx_http_private_image_file_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static void ngx_http_private_image_file_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+static ngx_http_private_image_file_node_t *ngx_http_private_image_file_lookup(ngx_http_private_image_file_ctx_t *fctx, ngx_str_t *path, uint32_t hash);
+
+static ngx_int_t ngx_http_private_image_file_find(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of, ngx_uint_t opened);
+
+static void ngx_http_private_image_file_add(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+
+static void ngx_http_private_image_file_insert(ngx_http_private_image_file_ctx_t *fctx, ngx_str_t *path, ngx_file_uniq_t uniq, time_t mtime, u_char *data, size_t size);
+
+static void ngx_http_private_image_file_delete(ngx_http_private_image_file_ctx_t *fctx, ngx_http_private_image_file_node_t *fn);
+
+typedef struct
+{
+	uint64_t  hash;
+	time_t    expire;
+} ngx_http_private_image_missing_t;
+
+static ngx_uint_t ngx_http_private_image_missing_test(ngx_str_t *path);
+
+static void ngx_http_private_image_missing_add(ngx_str_t *path, ngx_err_t err);
+
+typedef struct
+{
+	// 路径的 crc32，不同文件系统上的文件 inode 可能相同
+	uint32_t         hash;
+	ngx_file_uniq_t  uniq;
+	time_t           mtime;
+	off_t            size;
+	ngx_uint_t       type;
+} ngx_http_private_image_sniff_t;
+
+static ngx_uint_t ngx_http_private_image_sniff(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+
+// 文件头识别出的类型，下标保存在缓存中，0 表示无法识别
+static ngx_str_t  ngx_http_private_image_sniff_types[] =
+{
+	ngx_null_string,
+	ngx_string("image/jpeg"),
+	ngx_string("image/png"),
+	ngx_string("image/gif"),
+	ngx_string("image/webp")
+};
+
+static ngx_http_private_image_sniff_t  ngx_http_private_image_sniffed[NGX_HTTP_PRIVATE_IMAGE_SNIFF_CACHE];
+
+static ngx_http_private_image_missing_t  *ngx_http_private_image_missing;
+static ngx_uint_t                         ngx_http_private_image_missing_mask;
+static time_t                             ngx_http_private_image_missing_valid;
+
+#if (NGX_THREADS)
+
+struct ngx_http_private_image_open_s
+{
+	ngx_http_request_t    *r;
+	ngx_str_t              path;
+	ngx_open_file_info_t   of;
+	ngx_int_t              start;
+	// 线程中的结果：打开的文件，失败时的错误码和失败的调用
+	ngx_fd_t               fd;
+	ngx_err_t              err;
+	char                  *failed;
+	ngx_file_info_t        fi;
+};
+
+static ngx_uint_t ngx_http_private_image_open_cached(ngx_open_file_cache_t *cache, ngx_str_t *path, ngx_open_file_info_t *of);
+
+static ngx_int_t ngx_http_private_image_open_post(ngx_http_request_t *r, ngx_thread_pool_t *pool, ngx_str_t *path, ngx_open_file_info_t *of, ngx_int_t start);
+
+static void ngx_http_private_image_open_thread(void *data, ngx_log_t *log);
+
+static void ngx_http_private_image_open_done(ngx_event_t *ev);
+
+static void ngx_http_private_image_open_resume(ngx_http_request_t *r);
+
+static void ngx_http_private_image_open_cleanup(void *data);
+
+// 在线程池中读取文件内容，加入文件缓存
+typedef struct
+{
+	ngx_pool_t                         *pool;
+	ngx_http_private_image_file_ctx_t  *fctx;
+	ngx_str_t                           path;
+	ngx_file_uniq_t                     uniq;
+	time_t                              mtime;
+	size_t                              size;
+	u_char                             *data;
+	ngx_uint_t                          done;
+} ngx_http_private_image_fill_t;
+
+static void ngx_http_private_image_fill_post(ngx_thread_pool_t *pool, ngx_http_private_image_file_ctx_t *fctx, ngx_str_t *path, ngx_open_file_info_t *of);
+
+static void ngx_http_private_image_fill_thread(void *data, ngx_log_t *log);
+
+static void ngx_http_private_image_fill_done(ngx_event_t *ev);
+
+#endif
+
+// private_image_file_cache name:size [max_file=size] [valid=time]
+char *
+ngx_http_private_image_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ssize_t                             size, max_file;
+	ngx_uint_t                          i;
+	ngx_str_t                          *value, name, s;
+	ngx_http_private_image_file_ctx_t  *fctx;
+
+	if (pmcf->file_zone)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_http_private_image_parse_zone(cf, &value[1], &name, &size) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	fctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_file_ctx_t));
+	if (fctx == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	fctx->max_file = 32 * 1024;
+	fctx->valid = 0;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "max_file=", 9) == 0)
+		{
+			s.data = value[i].data + 9;
+			s.len = value[i].len - 9;
+
+			max_file = ngx_parse_size(&s);
+			if (max_file <= 0 || max_file > size / 8)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid max_file \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			fctx->max_file = max_file;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "valid=", 6) == 0)
+		{
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			fctx->valid = ngx_parse_time(&s, 1);
+			if (fctx->valid == (time_t) NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	pmcf->file_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_private_image_module);
+	if (pmcf->file_zone == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	if (pmcf->file_zone->data)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	pmcf->file_zone->init = ngx_http_private_image_file_init_zone;
+	pmcf->file_zone->data = fctx;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_file_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_private_image_file_ctx_t  *ofctx = data;
+	ngx_http_private_image_file_ctx_t  *fctx;
+	size_t                              len;
+
+	fctx = shm_zone->data;
+
+	// reload 时保留已缓存的内容
+	if (ofctx)
+	{
+		fctx->sh = ofctx->sh;
+		fctx->shpool = ofctx->shpool;
+		return NGX_OK;
+	}
+
+	fctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		fctx->sh = fctx->shpool->data;
+		return NGX_OK;
+	}
+
+	fctx->sh = ngx_slab_alloc(fctx->shpool, sizeof(ngx_http_private_image_file_sh_t));
+	if (fctx->sh == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	fctx->shpool->data = fctx->sh;
+
+	ngx_rbtree_init(&fctx->sh->rbtree, &fctx->sh->sentinel, ngx_http_private_image_file_rbtree_insert_value);
+	ngx_queue_init(&fctx->sh->queue);
+
+	len = sizeof(" in private_image_file_cache zone \"\"") + shm_zone->shm.name.len;
+
+	fctx->shpool->log_ctx = ngx_slab_alloc(fctx->shpool, len);
+	if (fctx->shpool->log_ctx == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(fctx->shpool->log_ctx, " in private_image_file_cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+	// 共享内存不足时淘汰旧节点，不需要在错误日志中记录分配失败
+	fctx->shpool->log_nomem = 0;
+
+	return NGX_OK;
+}
+
+// 先按 crc32，再按路径排序
+static void
+ngx_http_private_image_file_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+	ngx_rbtree_node_t                  **p;
+	ngx_http_private_image_file_node_t  *fn, *fnt;
+
+	for ( ;; )
+	{
+		if (node->key < temp->key)
+		{
+			p = &temp->left;
+		}
+		else if (node->key > temp->key)
+		{
+			p = &temp->right;
+		}
+		else
+		{
+			fn = (ngx_http_private_image_file_node_t *) node;
+			fnt = (ngx_http_private_image_file_node_t *) temp;
+
+			p = (ngx_memn2cmp(fn->data, fnt->data, fn->len, fnt->len) < 0) ? &temp->left : &temp->right;
+		}
+
+		if (*p == sentinel)
+		{
+			break;
+		}
+
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+// private_image_missing_cache max=N [valid=time]
+char *
+ngx_http_private_image_missing_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ngx_int_t                           n;
+	ngx_uint_t                          i;
+	ngx_str_t                          *value, s;
+
+	if (pmcf->missing_size)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	pmcf->missing_valid = 10;
+
+	for (i = 1; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "max=", 4) == 0)
+		{
+			n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+			if (n <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid max \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			if (n > NGX_HTTP_PRIVATE_IMAGE_MISSING_MAX)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid max \"%V\", the maximum is %d",
+				                   &value[i], NGX_HTTP_PRIVATE_IMAGE_MISSING_MAX);
+				return NGX_CONF_ERROR;
+			}
+
+			pmcf->missing_size = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "valid=", 6) == 0)
+		{
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			pmcf->missing_valid = ngx_parse_time(&s, 1);
+			if (pmcf->missing_valid == (time_t) NGX_ERROR || pmcf->missing_valid == 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if (pmcf->missing_size == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" must have \"max\" parameter", &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+// 分配当前 worker 的负缓存，槽数向上取整为 2 的幂
+ngx_int_t
+ngx_http_private_image_file_init_process(ngx_cycle_t *cycle)
+{
+	ngx_uint_t                           n;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	pmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_private_image_module);
+	if (pmcf == NULL || pmcf->missing_size == 0 || !ngx_http_private_image_is_worker())
+	{
+		return NGX_OK;
+	}
+
+	for (n = 1; n < pmcf->missing_size; n <<= 1) { /* void */ }
+
+	ngx_http_private_image_missing = ngx_calloc(n * sizeof(ngx_http_private_image_missing_t), cycle->log);
+	if (ngx_http_private_image_missing == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_http_private_image_missing_mask = n - 1;
+	ngx_http_private_image_missing_valid = pmcf->missing_valid;
+
+	return NGX_OK;
+}
+
+// private_image_open_threads pool=name | off
+char *
+ngx_http_private_image_open_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_loc_conf_t *plcf = conf;
+	ngx_str_t                         *value;
+#if (NGX_THREADS)
+	ngx_str_t                          name;
+#endif
+
+	if (plcf->open_pool != NGX_CONF_UNSET_PTR)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		plcf->open_pool = NULL;
+		return NGX_CONF_OK;
+	}
+
+	if (ngx_strncmp(value[1].data, "pool=", 5) != 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+#if (NGX_THREADS)
+	name.data = value[1].data + 5;
+	name.len = value[1].len - 5;
+
+	plcf->open_pool = ngx_thread_pool_add(cf, name.len ? &name : NULL);
+	if (plcf->open_pool == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+#else
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+	                   "\"private_image_open_threads\" requires nginx built with --with-threads");
+	return NGX_CONF_ERROR;
+#endif
+}
+
+// 打开 path，结果和 ngx_open_cached_file 相同；交给线程池时返回 NGX_AGAIN，
+// 请求已经挂起，打开完成后由 ngx_http_private_image_send_file 继续处理
+ngx_int_t
+ngx_http_private_image_open(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	ngx_int_t                          rc, start;
+	ngx_http_core_loc_conf_t          *clcf;
+	ngx_http_private_image_ctx_t      *ctx;
+#if (NGX_THREADS)
+	ngx_http_private_image_loc_conf_t *plcf;
+#endif
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	start = ngx_http_private_image_usec();
+
+	if (ngx_http_private_image_missing_test(path))
+	{
+		of->fd = NGX_INVALID_FILE;
+		of->err = NGX_ENOENT;
+		of->failed = ngx_open_file_n;
+
+		ctx->open_time = ngx_http_private_image_usec() - start;
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_MISSING_HITS, 1);
+
+		return NGX_ERROR;
+	}
+
+	if (ngx_http_private_image_file_find(r, path, of, 0) == NGX_OK)
+	{
+		ctx->open_time = ngx_http_private_image_usec() - start;
+		return NGX_OK;
+	}
+
+#if (NGX_THREADS)
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+
+	if (plcf->open_pool && !ngx_http_private_image_open_cached(clcf->open_file_cache, path, of))
+	{
+		rc = ngx_http_private_image_open_post(r, plcf->open_pool, path, of, start);
+		if (rc == NGX_AGAIN)
+		{
+			return NGX_AGAIN;
+		}
+
+		// 线程池队列已满，在当前线程中打开
+	}
+#endif
+
+	rc = ngx_open_cached_file(clcf->open_file_cache, path, of, r->pool);
+	ctx->open_time = ngx_http_private_image_usec() - start;
+
+	if (rc != NGX_OK)
+	{
+		ngx_http_private_image_missing_add(path, of->err);
+	}
+
+	return rc;
+}
+
+static ngx_uint_t
+ngx_http_private_image_missing_test(ngx_str_t *path)
+{
+	uint64_t                           hash;
+	ngx_http_private_image_missing_t  *m;
+
+	if (ngx_http_private_image_missing == NULL)
+	{
+		return 0;
+	}
+
+	hash = ngx_http_private_image_hash(path->data, path->len);
+	m = &ngx_http_private_image_missing[hash & ngx_http_private_image_missing_mask];
+
+	return (m->hash == hash && m->expire > ngx_time()) ? 1 : 0;
+}
+
+// 只记录确定不存在的路径，权限等其他错误可能很快恢复，每次都重新打开
+static void
+ngx_http_private_image_missing_add(ngx_str_t *path, ngx_err_t err)
+{
+	uint64_t                           hash;
+	ngx_http_private_image_missing_t  *m;
+
+	if (ngx_http_private_image_missing == NULL || (err != NGX_ENOENT && err != NGX_ENOTDIR))
+	{
+		return;
+	}
+
+	hash = ngx_http_private_image_hash(path->data, path->len);
+	m = &ngx_http_private_image_missing[hash & ngx_http_private_image_missing_mask];
+
+	// 直接映射，冲突时覆盖原来的路径
+	m->hash = hash;
+	m->expire = ngx_time() + ngx_http_private_image_missing_valid;
+}
+
+// 设置 Content-Type，扩展名不在 types 中时使用文件头识别的类型，无法识别时为 default_type
+ngx_int_t
+ngx_http_private_image_content_type(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	uint32_t                         hash;
+	ngx_str_t                       *type;
+	ngx_http_core_loc_conf_t        *clcf;
+	ngx_http_private_image_sniff_t  *sn;
+
+	if (ngx_http_set_content_type(r) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	// 扩展名在 types 中时 content_type 指向 types 中的值
+	if (r->headers_out.content_type.data != clcf->default_type.data)
+	{
+		return NGX_OK;
+	}
+
+	// 槽的位置由路径、inode、修改时间和大小共同决定，命中时四者都要相同
+	hash = ngx_crc32_long(path->data, path->len);
+	sn = &ngx_http_private_image_sniffed[(hash ^ (uint64_t) of->uniq ^ (uint64_t) of->mtime ^ (uint64_t) of->size)
+	                                     % NGX_HTTP_PRIVATE_IMAGE_SNIFF_CACHE];
+
+	if (sn->hash != hash || sn->uniq != of->uniq || sn->mtime != of->mtime || sn->size != of->size)
+	{
+		sn->hash = hash;
+		sn->uniq = of->uniq;
+		sn->mtime = of->mtime;
+		sn->size = of->size;
+		sn->type = ngx_http_private_image_sniff(r, path, of);
+	}
+
+	if (sn->type)
+	{
+		type = &ngx_http_private_image_sniff_types[sn->type];
+
+		r->headers_out.content_type_len = type->len;
+		r->headers_out.content_type = *type;
+		r->headers_out.content_type_lowcase = NULL;
+	}
+
+	return NGX_OK;
+}
+
+// 读取文件的前 12 字节识别图片格式，返回 ngx_http_private_image_sniff_types 的下标
+static ngx_uint_t
+ngx_http_private_image_sniff(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	u_char                        *buf, head[12];
+	ngx_file_t                     file;
+	ngx_http_private_image_ctx_t  *ctx;
+
+	if (of->size < (off_t) sizeof(head))
+	{
+		return 0;
+	}
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+
+	if (ctx->image.data)
+	{
+		// 内容在文件缓存中，不需要读文件
+		buf = ctx->image.data;
+	}
+	else
+	{
+		// directio 要求按块对齐读取
+		if (of->fd == NGX_INVALID_FILE || of->is_directio)
+		{
+			return 0;
+		}
+
+		ngx_memzero(&file, sizeof(ngx_file_t));
+		file.fd = of->fd;
+		file.name = *path;
+		file.log = r->connection->log;
+
+		if (ngx_read_file(&file, head, sizeof(head), 0) != (ssize_t) sizeof(head))
+		{
+			return 0;
+		}
+
+		buf = head;
+	}
+
+	if (buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff)
+	{
+		return 1;
+	}
+
+	if (ngx_memcmp(buf, "\x89PNG\r\n\x1a\n", 8) == 0)
+	{
+		return 2;
+	}
+
+	if (ngx_memcmp(buf, "GIF8", 4) == 0)
+	{
+		return 3;
+	}
+
+	if (ngx_memcmp(buf, "RIFF", 4) == 0 && ngx_memcmp(buf + 8, "WEBP", 4) == 0)
+	{
+		return 4;
+	}
+
+	return 0;
+}
+
+// 响应包体：文件缓存中有内容时使用内存，否则发送文件；last_buf 由调用方设置
+ngx_buf_t *
+ngx_http_private_image_file_body(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	ngx_buf_t                     *b;
+	ngx_http_private_image_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+
+	b = ngx_calloc_buf(r->pool);
+	if (b == NULL)
+	{
+		return NULL;
+	}
+
+	if (ctx->image.data == NULL && ngx_http_private_image_file_find(r, path, of, 1) != NGX_OK)
+	{
+		ngx_http_private_image_file_add(r, path, of);
+	}
+
+	if (ctx->image.data)
+	{
+		b->pos = ctx->image.data;
+		b->last = ctx->image.data + ctx->image.len;
+		b->memory = 1;
+
+		return b;
+	}
+
+	b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+	if (b->file == NULL)
+	{
+		return NULL;
+	}
+
+	b->file_pos = 0;
+	b->file_last = of->size;
+	b->in_file = b->file_last ? 1 : 0;
+
+	b->file->fd = of->fd;
+	b->file->name = *path;
+	b->file->log = r->connection->log;
+	b->file->directio = of->is_directio;
+
+	return b;
+}
+
+// 在文件缓存中查找 path，内容复制到请求的内存池并保存在 ctx->image 中。
+// opened 为 0 时还没有打开文件，只使用 valid 时间内确认过的内容，of 由缓存填写；
+// 为 1 时 of 是刚打开的文件，inode、修改时间和大小都相同才使用，不同时删除旧内容。
+// 持锁时只增加节点的引用计数，复制内容在释放锁之后进行
+static ngx_int_t
+ngx_http_private_image_file_find(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of, ngx_uint_t opened)
+{
+	u_char                              *data;
+	size_t                               size;
+	time_t                               now;
+	uint32_t                             hash;
+	ngx_http_private_image_ctx_t        *ctx;
+	ngx_http_private_image_main_conf_t  *pmcf;
+	ngx_http_private_image_file_ctx_t   *fctx;
+	ngx_http_private_image_file_node_t  *fn;
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->file_zone == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	fctx = pmcf->file_zone->data;
+
+	if (opened)
+	{
+		if (of->fd == NGX_INVALID_FILE || of->is_directio || of->size == 0 || (size_t) of->size > fctx->max_file)
+		{
+			return NGX_DECLINED;
+		}
+	}
+	else if (fctx->valid == 0)
+	{
+		return NGX_DECLINED;
+	}
+
+	hash = ngx_crc32_long(path->data, path->len);
+	now = ngx_time();
+	size = 0;
+
+	ngx_shmtx_lock(&fctx->shpool->mutex);
+
+	fn = ngx_http_private_image_file_lookup(fctx, path, hash);
+
+	if (fn && opened && (fn->uniq != of->uniq || fn->mtime != of->mtime || fn->size != (size_t) of->size))
+	{
+		// 文件已经变化
+		ngx_http_private_image_file_delete(fctx, fn);
+		fn = NULL;
+	}
+
+	if (fn && !opened && now - fn->checked >= fctx->valid)
+	{
+		fn = NULL;
+	}
+
+	if (fn)
+	{
+		fn->refs++;
+		size = fn->size;
+
+		if (opened)
+		{
+			fn->checked = now;
+		}
+		else
+		{
+			of->uniq = fn->uniq;
+			of->mtime = fn->mtime;
+		}
+
+		// 一秒内移动过的节点不再移动，热点图片的命中不需要每次修改队列
+		if (fn->accessed != now)
+		{
+			fn->accessed = now;
+			ngx_queue_remove(&fn->queue);
+			ngx_queue_insert_head(&fctx->sh->queue, &fn->queue);
+		}
+	}
+
+	ngx_shmtx_unlock(&fctx->shpool->mutex);
+
+	if (fn == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	// 引用计数不为 0 时节点不会被释放，内容也不会改变
+	data = ngx_pnalloc(r->pool, size);
+	if (data)
+	{
+		ngx_memcpy(data, fn->data + fn->len, size);
+	}
+
+	ngx_shmtx_lock(&fctx->shpool->mutex);
+
+	if (--fn->refs == 0 && fn->removed)
+	{
+		ngx_slab_free_locked(fctx->shpool, fn);
+	}
+
+	ngx_shmtx_unlock(&fctx->shpool->mutex);
+
+	if (data == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	ctx->image.data = data;
+	ctx->image.len = size;
+
+	if (!opened)
+	{
+		of->fd = NGX_INVALID_FILE;
+		of->size = size;
+		of->is_file = 1;
+	}
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_FILE_CACHE_HITS, 1);
+
+	return NGX_OK;
+}
+
+// 把刚打开的小文件加入文件缓存。配置了 private_image_open_threads 时在线程池中读取，
+// 这次请求仍然发送文件；否则在当前线程中读取，读取成功后内容保存在 ctx->image 中
+static void
+ngx_http_private_image_file_add(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	u_char                              *data;
+	size_t                               size;
+	ngx_file_t                           file;
+	ngx_http_private_image_ctx_t        *ctx;
+	ngx_http_private_image_main_conf_t  *pmcf;
+	ngx_http_private_image_file_ctx_t   *fctx;
+#if (NGX_THREADS)
+	ngx_http_private_image_loc_conf_t   *plcf;
+#endif
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->file_zone == NULL)
+	{
+		return;
+	}
+
+	fctx = pmcf->file_zone->data;
+
+	if (of->fd == NGX_INVALID_FILE || of->is_directio || of->size == 0
+	    || (size_t) of->size > fctx->max_file || path->len > 0xffff)
+	{
+		return;
+	}
+
+	size = (size_t) of->size;
+
+#if (NGX_THREADS)
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+
+	if (plcf->open_pool)
+	{
+		ngx_http_private_image_fill_post(plcf->open_pool, fctx, path, of);
+		return;
+	}
+#endif
+
+	data = ngx_pnalloc(r->pool, size);
+	if (data == NULL)
+	{
+		return;
+	}
+
+	ngx_memzero(&file, sizeof(ngx_file_t));
+	file.fd = of->fd;
+	file.name = *path;
+	file.log = r->connection->log;
+
+	// 读到的长度不对说明文件正在被修改，这次仍然发送文件
+	if (ngx_read_file(&file, data, size, 0) != (ssize_t) size)
+	{
+		return;
+	}
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	ctx->image.data = data;
+	ctx->image.len = size;
+
+	ngx_http_private_image_file_insert(fctx, path, of->uniq, of->mtime, data, size);
+}
+
+// 插入或替换 path 的内容，缓存满时淘汰最久未使用的节点
+static void
+ngx_http_private_image_file_insert(ngx_http_private_image_file_ctx_t *fctx, ngx_str_t *path, ngx_file_uniq_t uniq, time_t mtime, u_char *data, size_t size)
+{
+	size_t                               len;
+	uint32_t                             hash;
+	ngx_uint_t                           n;
+	ngx_queue_t                         *q;
+	ngx_http_private_image_file_node_t  *fn, *old;
+
+	hash = ngx_crc32_long(path->data, path->len);
+	len = offsetof(ngx_http_private_image_file_node_t, data) + path->len + size;
+
+	ngx_shmtx_lock(&fctx->shpool->mutex);
+
+	// 其他 worker 可能已经加入了同一个路径
+	old = ngx_http_private_image_file_lookup(fctx, path, hash);
+	if (old)
+	{
+		ngx_http_private_image_file_delete(fctx, old);
+	}
+
+	fn = ngx_slab_alloc_locked(fctx->shpool, len);
+
+	q = ngx_queue_last(&fctx->sh->queue);
+
+	for (n = 0; fn == NULL && n < NGX_HTTP_PRIVATE_IMAGE_FILE_EVICT && q != ngx_queue_sentinel(&fctx->sh->queue); n++)
+	{
+		old = ngx_queue_data(q, ngx_http_private_image_file_node_t, queue);
+		q = ngx_queue_prev(q);
+
+		// 正在被复制的节点释放不了，跳过
+		if (old->refs)
+		{
+			continue;
+		}
+
+		ngx_http_private_image_file_delete(fctx, old);
+
+		fn = ngx_slab_alloc_locked(fctx->shpool, len);
+	}
+
+	if (fn)
+	{
+		fn->node.key = hash;
+		fn->uniq = uniq;
+		fn->mtime = mtime;
+		fn->checked = ngx_time();
+		fn->accessed = fn->checked;
+		fn->size = size;
+		fn->refs = 0;
+		fn->removed = 0;
+		fn->len = (u_short) path->len;
+
+		ngx_memcpy(ngx_cpymem(fn->data, path->data, path->len), data, size);
+
+		ngx_rbtree_insert(&fctx->sh->rbtree, &fn->node);
+		ngx_queue_insert_head(&fctx->sh->queue, &fn->queue);
+	}
+
+	ngx_shmtx_unlock(&fctx->shpool->mutex);
+}
+
+// 从树和队列中删除节点，还有请求在复制内容时由最后一个请求释放。需要持有共享内存的锁
+static void
+ngx_http_private_image_file_delete(ngx_http_private_image_file_ctx_t *fctx, ngx_http_private_image_file_node_t *fn)
+{
+	ngx_queue_remove(&fn->queue);
+	ngx_rbtree_delete(&fctx->sh->rbtree, &fn->node);
+
+	if (fn->refs)
+	{
+		fn->removed = 1;
+		return;
+	}
+
+	ngx_slab_free_locked(fctx->shpool, fn);
+}
+
+#if (NGX_THREADS)
+
+// 在线程池中读取文件并加入文件缓存。读取可能比请求结束得晚，使用单独的内存池，
+// 线程中按路径重新打开文件，inode、修改时间或者大小与请求打开的文件不同时放弃
+static void
+ngx_http_private_image_fill_post(ngx_thread_pool_t *pool, ngx_http_private_image_file_ctx_t *fctx, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	ngx_pool_t                     *p;
+	ngx_thread_task_t              *task;
+	ngx_http_private_image_fill_t  *fill;
+
+	p = ngx_create_pool(1024, ngx_cycle->log);
+	if (p == NULL)
+	{
+		return;
+	}
+
+	task = ngx_thread_task_alloc(p, sizeof(ngx_http_private_image_fill_t));
+	if (task == NULL)
+	{
+		ngx_destroy_pool(p);
+		return;
+	}
+
+	fill = task->ctx;
+	fill->pool = p;
+	fill->fctx = fctx;
+	fill->uniq = of->uniq;
+	fill->mtime = of->mtime;
+	fill->size = (size_t) of->size;
+	fill->done = 0;
+
+	fill->path.len = path->len;
+	fill->path.data = ngx_pnalloc(p, path->len + 1);
+	fill->data = ngx_pnalloc(p, fill->size);
+
+	if (fill->path.data == NULL || fill->data == NULL)
+	{
+		ngx_destroy_pool(p);
+		return;
+	}
+
+	ngx_memcpy(fill->path.data, path->data, path->len);
+	fill->path.data[path->len] = '\0';
+
+	task->handler = ngx_http_private_image_fill_thread;
+	task->event.data = fill;
+	task->event.handler = ngx_http_private_image_fill_done;
+
+	// 线程池队列已满时放弃，之后的请求会重新读取
+	if (ngx_thread_task_post(pool, task) != NGX_OK)
+	{
+		ngx_destroy_pool(p);
+	}
+}
+
+static void
+ngx_http_private_image_fill_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_private_image_fill_t *fill = data;
+	ngx_fd_t                       fd;
+	ngx_file_t                     file;
+	ngx_file_info_t                fi;
+
+	fd = ngx_open_file(fill->path.data, NGX_FILE_RDONLY | NGX_FILE_NONBLOCK, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		return;
+	}
+
+	if (ngx_fd_info(fd, &fi) != NGX_FILE_ERROR
+	    && ngx_file_uniq(&fi) == fill->uniq
+	    && ngx_file_mtime(&fi) == fill->mtime
+	    && (size_t) ngx_file_size(&fi) == fill->size)
+	{
+		ngx_memzero(&file, sizeof(ngx_file_t));
+		file.fd = fd;
+		file.name = fill->path;
+		file.log = log;
+
+		fill->done = (ngx_read_file(&file, fill->data, fill->size, 0) == (ssize_t) fill->size);
+	}
+
+	ngx_close_file(fd);
+}
+
+static void
+ngx_http_private_image_fill_done(ngx_event_t *ev)
+{
+	ngx_http_private_image_fill_t *fill = ev->data;
+
+	if (fill->done)
+	{
+		ngx_http_private_image_file_insert(fill->fctx, &fill->path, fill->uniq, fill->mtime, fill->data, fill->size);
+	}
+
+	ngx_destroy_pool(fill->pool);
+}
+
+#endif
+
+// 需要持有共享内存的锁
+static ngx_http_private_image_file_node_t *
+ngx_http_private_image_file_lookup(ngx_http_private_image_file_ctx_t *fctx, ngx_str_t *path, uint32_t hash)
+{
+	ngx_int_t                            rc;
+	ngx_rbtree_node_t                   *node, *sentinel;
+	ngx_http_private_image_file_node_t  *fn;
+
+	node = fctx->sh->rbtree.root;
+	sentinel = fctx->sh->rbtree.sentinel;
+
+	while (node != sentinel)
+	{
+		if (hash < node->key)
+		{
+			node = node->left;
+			continue;
+		}
+
+		if (hash > node->key)
+		{
+			node = node->right;
+			continue;
+		}
+
+		fn = (ngx_http_private_image_file_node_t *) node;
+
+		rc = ngx_memn2cmp(path->data, fn->data, path->len, fn->len);
+		if (rc == 0)
+		{
+			return fn;
+		}
+
+		node = (rc < 0) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+#if (NGX_THREADS)
+
+// open_file_cache 中是否有可以直接使用的记录，条件与 ngx_open_cached_file 不做系统调用的情况相同：
+// 记录在有效期内（或者由事件通知失效），并且缓存的是打开的文件或者打开失败的错误
+static ngx_uint_t
+ngx_http_private_image_open_cached(ngx_open_file_cache_t *cache, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+	uint32_t                 hash;
+	ngx_int_t                rc;
+	ngx_rbtree_node_t       *node, *sentinel;
+	ngx_cached_open_file_t  *file;
+
+	if (cache == NULL)
+	{
+		return 0;
+	}
+
+	hash = ngx_crc32_long(path->data, path->len);
+
+	node = cache->rbtree.root;
+	sentinel = cache->rbtree.sentinel;
+
+	while (node != sentinel)
+	{
+		if (hash < node->key)
+		{
+			node = node->left;
+			continue;
+		}
+
+		if (hash > node->key)
+		{
+			node = node->right;
+			continue;
+		}
+
+		file = (ngx_cached_open_file_t *) node;
+
+		rc = ngx_strcmp(path->data, file->name);
+		if (rc == 0)
+		{
+			if (!file->use_event && (file->event || ngx_time() - file->created >= of->valid))
+			{
+				return 0;
+			}
+
+			return (file->err || file->fd != NGX_INVALID_FILE) ? 1 : 0;
+		}
+
+		node = (rc < 0) ? node->left : node->right;
+	}
+
+	return 0;
+}
+
+static ngx_int_t
+ngx_http_private_image_open_post(ngx_http_request_t *r, ngx_thread_pool_t *pool, ngx_str_t *path, ngx_open_file_info_t *of, ngx_int_t start)
+{
+	ngx_thread_task_t              *task;
+	ngx_pool_cleanup_t             *cln;
+	ngx_http_private_image_ctx_t   *ctx;
+	ngx_http_private_image_open_t  *op;
+
+	task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_private_image_open_t));
+	if (task == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	// 请求结束时关闭线程打开的文件，线程完成前请求不会结束
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if (cln == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	op = task->ctx;
+	op->r = r;
+	op->path = *path;
+	op->of = *of;
+	op->start = start;
+	op->fd = NGX_INVALID_FILE;
+
+	task->handler = ngx_http_private_image_open_thread;
+	task->event.data = op;
+	task->event.handler = ngx_http_private_image_open_done;
+
+	if (ngx_thread_task_post(pool, task) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	cln->handler = ngx_http_private_image_open_cleanup;
+	cln->data = op;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	ctx->open = op;
+
+	// blocked 让客户端断开时 nginx 等线程完成再释放请求，引用计数由 open_resume 结束请求时减少
+	r->main->blocked++;
+	r->main->count++;
+	r->aio = 1;
+	r->write_event_handler = ngx_http_private_image_open_resume;
+
+	return NGX_AGAIN;
+}
+
+static void
+ngx_http_private_image_open_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_private_image_open_t *op = data;
+	ngx_fd_t                       fd;
+
+	fd = ngx_open_file(op->path.data, NGX_FILE_RDONLY | NGX_FILE_NONBLOCK, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		op->err = ngx_errno;
+		op->failed = ngx_open_file_n;
+		return;
+	}
+
+	if (ngx_fd_info(fd, &op->fi) == NGX_FILE_ERROR)
+	{
+		op->err = ngx_errno;
+		op->failed = ngx_fd_info_n;
+		ngx_close_file(fd);
+		return;
+	}
+
+	op->fd = fd;
+}
+
+static void
+ngx_http_private_image_open_done(ngx_event_t *ev)
+{
+	ngx_http_private_image_open_t *op = ev->data;
+	ngx_http_request_t            *r;
+	ngx_connection_t              *c;
+
+	r = op->r;
+	c = r->connection;
+
+	r->main->blocked--;
+	r->aio = 0;
+
+	// 请求在等待期间被终止时 write_event_handler 已经换成了 nginx 结束请求的处理函数
+	r->write_event_handler(r);
+	ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_private_image_open_resume(ngx_http_request_t *r)
+{
+	ngx_int_t                       rc;
+	ngx_open_file_info_t           *of;
+	ngx_http_private_image_ctx_t   *ctx;
+	ngx_http_private_image_open_t  *op;
+
+	// 打开文件的线程还没有完成，忽略期间的写事件
+	if (r->aio)
+	{
+		return;
+	}
+
+	r->write_event_handler = ngx_http_request_empty_handler;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+
+	op = ctx->open;
+	of = &op->of;
+
+	if (op->fd == NGX_INVALID_FILE)
+	{
+		of->fd = NGX_INVALID_FILE;
+		of->err = op->err;
+		of->failed = op->failed;
+		rc = NGX_ERROR;
+
+		ngx_http_private_image_missing_add(&op->path, op->err);
+	}
+	else
+	{
+		// 直接使用线程中打开的文件，不在 worker 中再打开一次：网络存储上每次 open() 都要
+		// 向服务器确认，重新打开会把这次阻塞带回 worker。op->fd 由请求结束时的清理函数关闭
+		of->fd = op->fd;
+		of->uniq = ngx_file_uniq(&op->fi);
+		of->mtime = ngx_file_mtime(&op->fi);
+		of->size = ngx_file_size(&op->fi);
+		of->is_dir = ngx_is_dir(&op->fi);
+		of->is_file = ngx_is_file(&op->fi);
+		of->is_link = ngx_is_link(&op->fi);
+		of->is_exec = ngx_is_exec(&op->fi);
+
+		if (of->directio <= of->size && of->is_file)
+		{
+			if (ngx_directio_on(of->fd) == NGX_FILE_ERROR)
+			{
+				ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+				              ngx_directio_on_n " \"%V\" failed", &op->path);
+			}
+			else
+			{
+				of->is_directio = 1;
+			}
+		}
+
+		rc = NGX_OK;
+	}
+
+	ctx->open_time = ngx_http_private_image_usec() - op->start;
+
+	ngx_http_finalize_request(r, ngx_http_private_image_send_file(r, &op->path, of, rc));
+}
+
+static void
+ngx_http_private_image_open_cleanup(void *data)
+{
+	ngx_http_private_image_open_t *op = data;
+
+	if (op->fd != NGX_INVALID_FILE && ngx_close_file(op->fd) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, op->r->connection->log, ngx_errno,
+		              ngx_close_file_n " \"%V\" failed", &op->path);
+	}
+}
+
+#endif
@@ -0,0 +1,410 @@
+#include "ngx_private_image_module.h"
+
+// 按用户 ID 或 token 限流的令牌桶。共享内存中是一张开放寻址的哈希表，
+// 每个桶的状态（上次更新时间和剩余令牌数）压缩在一个 64 位原子变量里，
+// 用 CAS 更新，多个 worker 之间不需要加锁。ngx_atomic_t 在 32 位平台上只有 32 位，不支持限流
+
+#define  NGX_HTTP_PRIVATE_IMAGE_LIMIT_USER    0
+#define  NGX_HTTP_PRIVATE_IMAGE_LIMIT_TOKEN   1
+
+// 查找空位或已有节点时最多探测的节点数
+#define  NGX_HTTP_PRIVATE_IMAGE_LIMIT_PROBES  8
+
+// 令牌的单位为百万分之一个请求
+#define  NGX_HTTP_PRIVATE_IMAGE_LIMIT_UNIT    1000000
+
+typedef struct
+{
+	// key 的 64 位哈希，0 表示空节点
+	ngx_atomic_t  key;
+	// 高 32 位为上次更新的时间（毫秒），低 32 位为剩余令牌数，0 表示尚未使用
+	ngx_atomic_t  state;
+} ngx_http_private_image_limit_node_t;
+
+typedef struct
+{
+	ngx_http_private_image_limit_node_t  *nodes;
+	ngx_uint_t                            mask;
+	// 每秒请求数乘以 1000，与 limit_req 的 rate 相同，刚好等于每毫秒补充的令牌数
+	ngx_uint_t                            rate;
+	ngx_uint_t                            burst;
+	ngx_uint_t                            key;
+} ngx_http_private_image_limit_ctx_t;
+
+static ngx_int_t ngx_http_private_image_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+#if (NGX_PTR_SIZE == 8)
+
+static ngx_http_private_image_limit_node_t *ngx_http_private_image_limit_lookup(ngx_http_private_image_limit_ctx_t *ctx, uint64_t key);
+
+#endif
+
+// 共享内存的 tag，避免与模块的其他共享内存混用
+static ngx_uint_t ngx_http_private_image_limit_tag;
+
+// private_image_limit_zone name:size rate=10r/s [burst=N] [key=user|token]
+char *
+ngx_http_private_image_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	u_char                              *p;
+	ssize_t                              size;
+	ngx_int_t                            rate, scale, burst;
+	ngx_uint_t                           i, n;
+	ngx_str_t                           *value, name;
+	ngx_shm_zone_t                      *shm_zone;
+	ngx_http_private_image_limit_ctx_t  *ctx;
+
+#if (NGX_PTR_SIZE != 8)
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" requires a 64-bit platform", &cmd->name);
+	return NGX_CONF_ERROR;
+#endif
+
+	value = cf->args->elts;
+
+	if (ngx_http_private_image_parse_zone(cf, &value[1], &name, &size) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_limit_ctx_t));
+	if (ctx == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	rate = 1;
+	scale = 1;
+	burst = 0;
+	ctx->key = NGX_HTTP_PRIVATE_IMAGE_LIMIT_USER;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "rate=", 5) == 0)
+		{
+			n = value[i].len;
+			p = value[i].data + n - 3;
+
+			if (ngx_strncmp(p, "r/s", 3) == 0)
+			{
+				scale = 1;
+				n -= 3;
+			}
+			else if (ngx_strncmp(p, "r/m", 3) == 0)
+			{
+				scale = 60;
+				n -= 3;
+			}
+
+			rate = ngx_atoi(value[i].data + 5, n - 5);
+			if (rate <= 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "burst=", 6) == 0)
+		{
+			burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+			// 令牌数只有 32 位
+			if (burst < 0 || burst > 4000)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid burst value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data, "key=user") == 0)
+		{
+			ctx->key = NGX_HTTP_PRIVATE_IMAGE_LIMIT_USER;
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data, "key=token") == 0)
+		{
+			ctx->key = NGX_HTTP_PRIVATE_IMAGE_LIMIT_TOKEN;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	ctx->rate = rate * 1000 / scale;
+	ctx->burst = burst;
+
+	shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_private_image_limit_tag);
+	if (shm_zone == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	if (shm_zone->data)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	shm_zone->init = ngx_http_private_image_limit_init_zone;
+	shm_zone->data = ctx;
+
+	return NGX_CONF_OK;
+}
+
+// private_image_limit zone=name | off
+char *
+ngx_http_private_image_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_loc_conf_t *plcf = conf;
+	ngx_str_t                         *value, name;
+
+	if (plcf->limit_zone != NGX_CONF_UNSET_PTR)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		plcf->limit_zone = NULL;
+		return NGX_CONF_OK;
+	}
+
+	if (ngx_strncmp(value[1].data, "zone=", 5) != 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	name.data = value[1].data + 5;
+	name.len = value[1].len - 5;
+
+	// 允许先引用后定义，大小在 private_image_limit_zone 中确定
+	plcf->limit_zone = ngx_shared_memory_add(cf, &name, 0, &ngx_http_private_image_limit_tag);
+	if (plcf->limit_zone == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_private_image_limit_ctx_t  *octx = data;
+	ngx_http_private_image_limit_ctx_t  *ctx;
+	ngx_slab_pool_t                     *shpool;
+	ngx_uint_t                           n;
+	size_t                               len;
+
+	ctx = shm_zone->data;
+
+	if (octx)
+	{
+		if (ctx->key != octx->key)
+		{
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+			              "private_image_limit_zone \"%V\" uses a different key, "
+			              "while previously it used another", &shm_zone->shm.name);
+			return NGX_ERROR;
+		}
+
+		ctx->nodes = octx->nodes;
+		ctx->mask = octx->mask;
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	// 节点数取 2 的幂，占用共享内存的一半左右
+	n = 1024;
+	while (n * 2 * sizeof(ngx_http_private_image_limit_node_t) <= shm_zone->shm.size / 2)
+	{
+		n *= 2;
+	}
+
+	if (shm_zone->shm.exists)
+	{
+		ctx->nodes = shpool->data;
+		ctx->mask = n - 1;
+		return NGX_OK;
+	}
+
+	ctx->nodes = ngx_slab_calloc(shpool, n * sizeof(ngx_http_private_image_limit_node_t));
+	if (ctx->nodes == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ctx->mask = n - 1;
+	shpool->data = ctx->nodes;
+
+	len = sizeof(" in private_image_limit zone \"\"") + shm_zone->shm.name.len;
+
+	shpool->log_ctx = ngx_slab_alloc(shpool, len);
+	if (shpool->log_ctx == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(shpool->log_ctx, " in private_image_limit zone \"%V\"%Z", &shm_zone->shm.name);
+
+	return NGX_OK;
+}
+
+#if (NGX_PTR_SIZE == 8)
+
+// 在鉴权之后、打开文件之前调用，超过限制时返回 NGX_BUSY
+ngx_int_t
+ngx_http_private_image_limit_check(ngx_http_request_t *r, ngx_str_t *token, ngx_str_t *user_id)
+{
+	uint32_t                              now, last;
+	uint64_t                              key, tokens, max;
+	ngx_atomic_uint_t                     old, state;
+	ngx_http_private_image_limit_ctx_t   *ctx;
+	ngx_http_private_image_limit_node_t  *node;
+	ngx_http_private_image_loc_conf_t    *plcf;
+
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+	if (plcf->limit_zone == NULL)
+	{
+		return NGX_OK;
+	}
+
+	ctx = plcf->limit_zone->data;
+
+	if (ctx->key == NGX_HTTP_PRIVATE_IMAGE_LIMIT_USER)
+	{
+		// 鉴权服务没有返回用户 ID 时不限流
+		if (user_id->len == 0)
+		{
+			return NGX_OK;
+		}
+
+		key = ngx_http_private_image_hash(user_id->data, user_id->len);
+	}
+	else
+	{
+		key = ngx_http_private_image_hash(token->data, token->len);
+	}
+
+	if (key == 0)
+	{
+		key = 1;
+	}
+
+	node = ngx_http_private_image_limit_lookup(ctx, key);
+
+	now = (uint32_t) ngx_current_msec;
+	max = (uint64_t) (ctx->burst + 1) * NGX_HTTP_PRIVATE_IMAGE_LIMIT_UNIT;
+
+	for ( ;; )
+	{
+		old = node->state;
+
+		if (old == 0)
+		{
+			tokens = max;
+		}
+		else
+		{
+			// 32 位的时间差在 49 天内不会回绕
+			last = (uint32_t) (old >> 32);
+			tokens = (old & 0xffffffff) + (uint64_t) (uint32_t) (now - last) * ctx->rate;
+			tokens = ngx_min(tokens, max);
+		}
+
+		if (tokens < NGX_HTTP_PRIVATE_IMAGE_LIMIT_UNIT)
+		{
+			// 不在日志中输出 token
+			ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+			              "private image limiting requests, key: %s, user: \"%V\"",
+			              ctx->key == NGX_HTTP_PRIVATE_IMAGE_LIMIT_USER ? "user" : "token",
+			              user_id);
+			return NGX_BUSY;
+		}
+
+		state = ((ngx_atomic_uint_t) now << 32) | (tokens - NGX_HTTP_PRIVATE_IMAGE_LIMIT_UNIT);
+		if (state == 0)
+		{
+			state = 1;
+		}
+
+		if (ngx_atomic_cmp_set(&node->state, old, state))
+		{
+			return NGX_OK;
+		}
+	}
+}
+
+static ngx_http_private_image_limit_node_t *
+ngx_http_private_image_limit_lookup(ngx_http_private_image_limit_ctx_t *ctx, uint64_t key)
+{
+	uint32_t                              oldest, last;
+	ngx_uint_t                            i, n;
+	ngx_atomic_uint_t                     k;
+	ngx_http_private_image_limit_node_t  *node, *victim;
+
+	// 每个探测位置都被其他 key 抢先占用时没有候选节点，复用第一个位置
+	victim = &ctx->nodes[key & ctx->mask];
+	oldest = 0;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_LIMIT_PROBES; i++)
+	{
+		n = (key + i) & ctx->mask;
+		node = &ctx->nodes[n];
+		k = node->key;
+
+		if (k == key)
+		{
+			return node;
+		}
+
+		if (k == 0)
+		{
+			// 抢占空节点，失败说明其他 worker 刚刚占用，需要再看一下是不是同一个 key
+			if (ngx_atomic_cmp_set(&node->key, 0, key) || node->key == key)
+			{
+				return node;
+			}
+
+			continue;
+		}
+
+		// 记录最久没有更新的节点，探测不到时复用它
+		last = (uint32_t) ((uint32_t) ngx_current_msec - (uint32_t) (node->state >> 32));
+		if (last > oldest)
+		{
+			victim = node;
+			oldest = last;
+		}
+	}
+
+	// 复用最久未更新的节点，重置为满的令牌桶。与原来的 key 并发更新时可能少算几次请求，
+	// 对限流的效果没有影响
+	k = victim->key;
+	if (ngx_atomic_cmp_set(&victim->key, k, key))
+	{
+		victim->state = 0;
+	}
+
+	return victim;
+}
+
+#else
+
+// 32 位平台上不能配置 private_image_limit_zone，不限流
+ngx_int_t
+ngx_http_private_image_limit_check(ngx_http_request_t *r, ngx_str_t *token, ngx_str_t *user_id)
+{
+	return NGX_OK;
+}
+
+#endif
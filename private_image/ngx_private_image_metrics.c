@@ -0,0 +1,832 @@
+#include "ngx_private_image_module.h"
+#include "cJSON.h"
+
+#define  NGX_HTTP_PRIVATE_IMAGE_STATUS_JSON        0
+#define  NGX_HTTP_PRIVATE_IMAGE_STATUS_PROMETHEUS  1
+
+static ngx_int_t ngx_http_private_image_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static ngx_int_t ngx_http_private_image_status_handler(ngx_http_request_t *r);
+
+static void ngx_http_private_image_sum(ngx_http_private_image_shctx_t *sh, ngx_http_private_image_slot_t *total);
+
+static ngx_uint_t ngx_http_private_image_hist_index(ngx_int_t usec);
+
+static ngx_int_t ngx_http_private_image_hist_value(ngx_uint_t index);
+
+static ngx_int_t ngx_http_private_image_hist_percentile(ngx_http_private_image_hist_t *h, ngx_atomic_uint_t count, ngx_uint_t p);
+
+static ngx_atomic_uint_t ngx_http_private_image_hist_count(ngx_http_private_image_hist_t *h);
+
+static ngx_uint_t ngx_http_private_image_percentiles(ngx_http_request_t *r, ngx_uint_t *percentiles);
+
+static ngx_buf_t *ngx_http_private_image_status_json(ngx_http_request_t *r, ngx_http_private_image_shctx_t *sh, ngx_http_private_image_slot_t *total, ngx_uint_t *percentiles, ngx_uint_t n);
+
+static ngx_buf_t *ngx_http_private_image_status_prometheus(ngx_http_request_t *r, ngx_http_private_image_shctx_t *sh, ngx_http_private_image_slot_t *total, ngx_uint_t *percentiles, ngx_uint_t n);
+
+// 状态接口最多输出的分位数个数
+#define  NGX_HTTP_PRIVATE_IMAGE_MAX_PERCENTILES  8
+
+// 当前 worker 使用的统计槽，在 init_process 中确定，未配置统计共享内存时为 NULL
+static ngx_http_private_image_slot_t *ngx_http_private_image_slot;
+
+static ngx_http_private_image_shctx_t *ngx_http_private_image_sh;
+
+// 计数器名称，顺序与 NGX_HTTP_PRIVATE_IMAGE_REQUESTS 等定义一致。数组按计数器个数定义，
+// 名称多于计数器时编译失败，少于计数器时在加载配置时报错，输出时不会越界
+static ngx_str_t ngx_http_private_image_counter_names[NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS] =
+{
+	ngx_string("requests"),
+	ngx_string("auth_calls"),
+	ngx_string("auth_failures"),
+	ngx_string("cache_hits"),
+	ngx_string("cache_misses"),
+	ngx_string("cache_evictions"),
+	ngx_string("open_failures"),
+	ngx_string("bytes_sent"),
+	ngx_string("limited"),
+	ngx_string("auth_errors"),
+	ngx_string("auth_rejected"),
+	ngx_string("stale_served"),
+	ngx_string("breaker_trips"),
+	ngx_string("cache_refreshes"),
+	ngx_string("auth_hedges"),
+	ngx_string("auth_hedge_wins"),
+	ngx_string("auth_batches"),
+	ngx_string("token_table_hits"),
+	ngx_string("revocations"),
+	ngx_string("cache_l1_hits"),
+	ngx_string("missing_hits"),
+	ngx_string("not_modified"),
+	ngx_string("file_cache_hits")
+};
+
+// 熔断器状态名称，顺序与 NGX_HTTP_PRIVATE_IMAGE_BREAKER_CLOSED 等定义一致
+static ngx_str_t ngx_http_private_image_breaker_states[] =
+{
+	ngx_string("closed"),
+	ngx_string("open"),
+	ngx_string("half_open")
+};
+
+// 直方图名称，顺序与 NGX_HTTP_PRIVATE_IMAGE_HIST_AUTH 等定义一致
+static ngx_str_t ngx_http_private_image_hist_names[] =
+{
+	ngx_string("auth"),
+	ngx_string("open"),
+	ngx_string("total")
+};
+
+// 默认输出的分位数，单位为千分之一百分点（99900 即 p99.9）
+static ngx_uint_t ngx_http_private_image_default_percentiles[] =
+{
+	50000, 90000, 99000, 99900
+};
+
+// 解析 name:size 形式的共享内存参数，各个共享内存指令共用
+ngx_int_t
+ngx_http_private_image_parse_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_str_t *name, ssize_t *size)
+{
+	u_char     *p;
+	ngx_str_t   s;
+
+	p = (u_char *) ngx_strlchr(value->data, value->data + value->len, ':');
+	if (p == NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", value);
+		return NGX_ERROR;
+	}
+
+	name->data = value->data;
+	name->len = p - value->data;
+
+	s.data = p + 1;
+	s.len = value->data + value->len - s.data;
+
+	*size = ngx_parse_size(&s);
+	if (*size == NGX_ERROR || *size < (ssize_t) (8 * ngx_pagesize))
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", value);
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+char *
+ngx_http_private_image_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ssize_t                             size;
+	ngx_str_t                          *value, name;
+	ngx_http_private_image_zone_ctx_t  *ctx;
+
+	if (pmcf->shm_zone)
+	{
+		return "is duplicate";
+	}
+
+	if (ngx_http_private_image_counter_names[NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS - 1].len == 0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "private image counter names are incomplete");
+		return NGX_CONF_ERROR;
+	}
+
+	value = cf->args->elts;
+
+	// 格式为 name:size
+	if (ngx_http_private_image_parse_zone(cf, &value[1], &name, &size) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_zone_ctx_t));
+	if (ctx == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	// 初始化共享内存时需要读取 worker_processes 确定统计槽的数量
+	ctx->cycle = cf->cycle;
+
+	pmcf->shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_private_image_module);
+	if (pmcf->shm_zone == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	if (pmcf->shm_zone->data)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	pmcf->shm_zone->init = ngx_http_private_image_init_zone;
+	pmcf->shm_zone->data = ctx;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_private_image_zone_ctx_t  *octx = data;
+	ngx_http_private_image_zone_ctx_t  *ctx;
+	ngx_core_conf_t                    *ccf;
+	ngx_uint_t                          nslots;
+	size_t                              stride, len;
+
+	ctx = shm_zone->data;
+
+	// reload 时沿用原来的共享内存，统计数据不清零
+	if (octx)
+	{
+		ctx->sh = octx->sh;
+		ctx->shpool = octx->shpool;
+		return NGX_OK;
+	}
+
+	ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		ctx->sh = ctx->shpool->data;
+		return NGX_OK;
+	}
+
+	ccf = (ngx_core_conf_t *) ngx_get_conf(ctx->cycle->conf_ctx, ngx_core_module);
+
+	nslots = (ccf->worker_processes > 0) ? ccf->worker_processes : 1;
+	stride = ngx_align(sizeof(ngx_http_private_image_slot_t), NGX_CPU_CACHE_LINE);
+	len = sizeof(ngx_http_private_image_shctx_t) + NGX_CPU_CACHE_LINE + nslots * stride;
+
+	ctx->sh = ngx_slab_calloc(ctx->shpool, len);
+	if (ctx->sh == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ctx->sh->start = ngx_time();
+	ctx->sh->nslots = nslots;
+	ctx->sh->stride = stride;
+	ctx->sh->slots = ngx_align_ptr((u_char *) ctx->sh + sizeof(ngx_http_private_image_shctx_t), NGX_CPU_CACHE_LINE);
+
+	ctx->shpool->data = ctx->sh;
+
+	len = sizeof(" in private_image zone \"\"") + shm_zone->shm.name.len;
+
+	ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+	if (ctx->shpool->log_ctx == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(ctx->shpool->log_ctx, " in private_image zone \"%V\"%Z", &shm_zone->shm.name);
+
+	return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_private_image_metrics_init_process(ngx_cycle_t *cycle)
+{
+	ngx_http_private_image_shctx_t      *sh;
+	ngx_http_private_image_zone_ctx_t   *ctx;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	ngx_http_private_image_slot = NULL;
+	ngx_http_private_image_sh = NULL;
+
+	pmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_private_image_module);
+	if (pmcf == NULL || pmcf->shm_zone == NULL || !ngx_http_private_image_is_worker())
+	{
+		return NGX_OK;
+	}
+
+	ctx = pmcf->shm_zone->data;
+	sh = ctx->sh;
+
+	// reload 期间新旧 worker 可能使用同一个槽，所以更新时仍使用原子操作，
+	// 正常情况下每个槽只有一个写者，不会产生竞争
+	ngx_http_private_image_slot = (ngx_http_private_image_slot_t *)
+		(sh->slots + (ngx_worker % sh->nslots) * sh->stride);
+	ngx_http_private_image_sh = sh;
+
+	return NGX_OK;
+}
+
+void
+ngx_http_private_image_count(ngx_uint_t counter, ngx_atomic_int_t n)
+{
+	if (ngx_http_private_image_slot == NULL)
+	{
+		return;
+	}
+
+	(void) ngx_atomic_fetch_add(&ngx_http_private_image_slot->counters[counter], n);
+}
+
+// 记录一次耗时：计算桶下标只需要一次前导零计数，更新为当前 worker 统计槽上的两次原子加
+void
+ngx_http_private_image_record(ngx_uint_t hist, ngx_int_t usec)
+{
+	ngx_atomic_uint_t               max;
+	ngx_http_private_image_hist_t  *h;
+
+	if (ngx_http_private_image_slot == NULL)
+	{
+		return;
+	}
+
+	if (usec < 0)
+	{
+		usec = 0;
+	}
+
+	h = &ngx_http_private_image_slot->hists[hist];
+
+	(void) ngx_atomic_fetch_add(&h->buckets[ngx_http_private_image_hist_index(usec)], 1);
+	(void) ngx_atomic_fetch_add(&h->sum, usec);
+
+	max = h->max;
+	while ((ngx_atomic_uint_t) usec > max)
+	{
+		if (ngx_atomic_cmp_set(&h->max, max, (ngx_atomic_uint_t) usec))
+		{
+			break;
+		}
+		max = h->max;
+	}
+}
+
+static ngx_uint_t
+ngx_http_private_image_hist_index(ngx_int_t usec)
+{
+	ngx_uint_t  e, shift;
+	uint64_t    v;
+
+	v = (uint64_t) usec;
+
+	// 线性区间，每个值一个桶
+	if (v < (1 << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS))
+	{
+		return (ngx_uint_t) v;
+	}
+
+	if (v >> (NGX_HTTP_PRIVATE_IMAGE_HIST_MAX_EXP + 1))
+	{
+		return NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS - 1;
+	}
+
+	// e = floor(log2(v))
+#if defined(__GNUC__)
+	e = 63 - __builtin_clzll(v);
+#else
+	for (e = NGX_HTTP_PRIVATE_IMAGE_HIST_MAX_EXP; (v >> e) == 0; e--) { /* void */ }
+#endif
+
+	shift = e - NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS;
+
+	return ((shift + 1) << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS)
+	       + (ngx_uint_t) (v >> shift) - (1 << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS);
+}
+
+// 桶内可能出现的最大值，分位数按该值报告，保证不会低估
+static ngx_int_t
+ngx_http_private_image_hist_value(ngx_uint_t index)
+{
+	ngx_uint_t  shift, sub;
+
+	if (index < (1 << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS))
+	{
+		return (ngx_int_t) index;
+	}
+
+	shift = (index >> NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS) - 1;
+	sub = index & ((1 << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS) - 1);
+
+	return (ngx_int_t) ((((ngx_uint_t) 1 << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static ngx_atomic_uint_t
+ngx_http_private_image_hist_count(ngx_http_private_image_hist_t *h)
+{
+	ngx_uint_t         i;
+	ngx_atomic_uint_t  count;
+
+	count = 0;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS; i++)
+	{
+		count += h->buckets[i];
+	}
+
+	return count;
+}
+
+// p 的单位为千分之一百分点，例如 99900 表示 p99.9
+static ngx_int_t
+ngx_http_private_image_hist_percentile(ngx_http_private_image_hist_t *h, ngx_atomic_uint_t count, ngx_uint_t p)
+{
+	ngx_uint_t         i;
+	ngx_atomic_uint_t  rank, seen;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	rank = (count * p + 99999) / 100000;
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+
+	seen = 0;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+
+		if (seen >= rank)
+		{
+			return ngx_min(ngx_http_private_image_hist_value(i), (ngx_int_t) h->max);
+		}
+	}
+
+	return (ngx_int_t) h->max;
+}
+
+// 所有 worker 合计的某个直方图的分位数（微秒），样本数少于 min 时返回 -1
+ngx_int_t
+ngx_http_private_image_percentile(ngx_uint_t hist, ngx_uint_t p, ngx_atomic_uint_t min)
+{
+	ngx_uint_t                      i, n;
+	ngx_atomic_uint_t               count;
+	ngx_http_private_image_slot_t  *slot;
+	ngx_http_private_image_hist_t  *h, total;
+
+	if (ngx_http_private_image_sh == NULL)
+	{
+		return -1;
+	}
+
+	ngx_memzero(&total, sizeof(ngx_http_private_image_hist_t));
+
+	for (n = 0; n < ngx_http_private_image_sh->nslots; n++)
+	{
+		slot = (ngx_http_private_image_slot_t *)
+			(ngx_http_private_image_sh->slots + n * ngx_http_private_image_sh->stride);
+		h = &slot->hists[hist];
+
+		for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS; i++)
+		{
+			total.buckets[i] += h->buckets[i];
+		}
+
+		total.max = ngx_max(total.max, h->max);
+	}
+
+	count = ngx_http_private_image_hist_count(&total);
+	if (count < min)
+	{
+		return -1;
+	}
+
+	return ngx_http_private_image_hist_percentile(&total, count, p);
+}
+
+char *
+ngx_http_private_image_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_loc_conf_t *plcf = conf;
+	ngx_str_t                         *value;
+	ngx_http_core_loc_conf_t          *clcf;
+
+	value = cf->args->elts;
+
+	plcf->status_format = NGX_HTTP_PRIVATE_IMAGE_STATUS_JSON;
+
+	if (cf->args->nelts > 1)
+	{
+		if (ngx_strcmp(value[1].data, "prometheus") == 0)
+		{
+			plcf->status_format = NGX_HTTP_PRIVATE_IMAGE_STATUS_PROMETHEUS;
+		}
+		else if (ngx_strcmp(value[1].data, "json") != 0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid status format \"%V\"", &value[1]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_private_image_status_handler;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_status_handler(ngx_http_request_t *r)
+{
+	ngx_int_t                            rc;
+	ngx_uint_t                           format;
+	ngx_str_t                            arg;
+	ngx_buf_t                           *b;
+	ngx_chain_t                          out;
+	ngx_uint_t                           n, percentiles[NGX_HTTP_PRIVATE_IMAGE_MAX_PERCENTILES];
+	ngx_chain_t                         *cl;
+	ngx_http_private_image_slot_t       *total;
+	ngx_http_private_image_zone_ctx_t   *ctx;
+	ngx_http_private_image_loc_conf_t   *plcf;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+	{
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+	if (rc != NGX_OK)
+	{
+		return rc;
+	}
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->shm_zone == NULL)
+	{
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "private_image_status requires private_image_zone");
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+	format = plcf->status_format;
+
+	// 可以通过 ?format=json 或 ?format=prometheus 覆盖配置的输出格式
+	if (ngx_http_arg(r, (u_char *) "format", 6, &arg) == NGX_OK)
+	{
+		if (arg.len == 10 && ngx_strncmp(arg.data, "prometheus", 10) == 0)
+		{
+			format = NGX_HTTP_PRIVATE_IMAGE_STATUS_PROMETHEUS;
+		}
+		else if (arg.len == 4 && ngx_strncmp(arg.data, "json", 4) == 0)
+		{
+			format = NGX_HTTP_PRIVATE_IMAGE_STATUS_JSON;
+		}
+	}
+
+	// 直方图较大，汇总结果放在请求内存池而不是栈上
+	total = ngx_palloc(r->pool, sizeof(ngx_http_private_image_slot_t));
+	if (total == NULL)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx = pmcf->shm_zone->data;
+	ngx_http_private_image_sum(ctx->sh, total);
+
+	n = ngx_http_private_image_percentiles(r, percentiles);
+
+	out.next = NULL;
+
+	if (format == NGX_HTTP_PRIVATE_IMAGE_STATUS_PROMETHEUS)
+	{
+		b = ngx_http_private_image_status_prometheus(r, ctx->sh, total, percentiles, n);
+		ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+
+		// 热点用户和 token 追加在统计项之后
+		if (b != NULL && pmcf->top_zone)
+		{
+			cl = ngx_alloc_chain_link(r->pool);
+			if (cl == NULL)
+			{
+				return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			}
+
+			cl->buf = ngx_http_private_image_top_prometheus(r);
+			if (cl->buf == NULL)
+			{
+				return NGX_HTTP_INTERNAL_SERVER_ERROR;
+			}
+
+			cl->next = NULL;
+			out.next = cl;
+		}
+	}
+	else
+	{
+		b = ngx_http_private_image_status_json(r, ctx->sh, total, percentiles, n);
+		ngx_str_set(&r->headers_out.content_type, "application/json");
+	}
+
+	if (b == NULL)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	out.buf = b;
+
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = 0;
+
+	for (cl = &out; cl; cl = cl->next)
+	{
+		r->headers_out.content_length_n += cl->buf->last - cl->buf->pos;
+		b = cl->buf;
+	}
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+	{
+		return rc;
+	}
+
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	return ngx_http_output_filter(r, &out);
+}
+
+// 解析 ?percentiles=50,99,99.9，未指定或格式错误时使用默认的分位数
+static ngx_uint_t
+ngx_http_private_image_percentiles(ngx_http_request_t *r, ngx_uint_t *percentiles)
+{
+	u_char     *p, *last, *comma;
+	ngx_int_t   value;
+	ngx_uint_t  n;
+	ngx_str_t   arg;
+
+	n = 0;
+
+	if (ngx_http_arg(r, (u_char *) "percentiles", 11, &arg) == NGX_OK)
+	{
+		p = arg.data;
+		last = arg.data + arg.len;
+
+		while (p < last && n < NGX_HTTP_PRIVATE_IMAGE_MAX_PERCENTILES)
+		{
+			comma = ngx_strlchr(p, last, ',');
+			if (comma == NULL)
+			{
+				comma = last;
+			}
+
+			value = ngx_atofp(p, comma - p, 3);
+			if (value == NGX_ERROR || value > 100000)
+			{
+				n = 0;
+				break;
+			}
+
+			percentiles[n++] = value;
+			p = comma + 1;
+		}
+	}
+
+	if (n == 0)
+	{
+		n = sizeof(ngx_http_private_image_default_percentiles) / sizeof(ngx_uint_t);
+		ngx_memcpy(percentiles, ngx_http_private_image_default_percentiles, sizeof(ngx_http_private_image_default_percentiles));
+	}
+
+	return n;
+}
+
+// 汇总所有 worker 的统计槽，读取时不加锁，各个计数器之间不保证是同一时刻的快照
+static void
+ngx_http_private_image_sum(ngx_http_private_image_shctx_t *sh, ngx_http_private_image_slot_t *total)
+{
+	ngx_uint_t                      i, j, n;
+	ngx_http_private_image_slot_t  *slot;
+	ngx_http_private_image_hist_t  *h, *th;
+
+	ngx_memzero(total, sizeof(ngx_http_private_image_slot_t));
+
+	for (n = 0; n < sh->nslots; n++)
+	{
+		slot = (ngx_http_private_image_slot_t *) (sh->slots + n * sh->stride);
+
+		for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS; i++)
+		{
+			total->counters[i] += slot->counters[i];
+		}
+
+		for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NHISTS; i++)
+		{
+			h = &slot->hists[i];
+			th = &total->hists[i];
+
+			for (j = 0; j < NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS; j++)
+			{
+				th->buckets[j] += h->buckets[j];
+			}
+
+			th->sum += h->sum;
+			th->max = ngx_max(th->max, h->max);
+		}
+	}
+}
+
+static ngx_buf_t *
+ngx_http_private_image_status_json(ngx_http_request_t *r, ngx_http_private_image_shctx_t *sh, ngx_http_private_image_slot_t *total, ngx_uint_t *percentiles, ngx_uint_t n)
+{
+	char                           *json;
+	size_t                          len;
+	ngx_uint_t                      i, k;
+	ngx_buf_t                      *b;
+	ngx_atomic_uint_t               count;
+	cJSON                          *root, *hist, *pct;
+	ngx_http_private_image_hist_t  *h;
+	u_char                          name[sizeof("p100.000")];
+	// 直方图的键，最长的名字为 "total"
+	u_char                          key[sizeof("total") - 1 + sizeof("_time")];
+
+	root = cJSON_CreateObject();
+	if (root == NULL)
+	{
+		return NULL;
+	}
+
+	cJSON_AddNumberToObject(root, "uptime", (double) (ngx_time() - sh->start));
+	cJSON_AddNumberToObject(root, "slots", (double) sh->nslots);
+	cJSON_AddStringToObject(root, "breaker", (char *) ngx_http_private_image_breaker_states[sh->breaker.state].data);
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS; i++)
+	{
+		cJSON_AddNumberToObject(root, (char *) ngx_http_private_image_counter_names[i].data, (double) total->counters[i]);
+	}
+
+	// 各个耗时直方图，单位秒
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NHISTS; i++)
+	{
+		h = &total->hists[i];
+		count = ngx_http_private_image_hist_count(h);
+
+		ngx_sprintf(key, "%V_time%Z", &ngx_http_private_image_hist_names[i]);
+
+		hist = cJSON_AddObjectToObject(root, (char *) key);
+		cJSON_AddNumberToObject(hist, "count", (double) count);
+		cJSON_AddNumberToObject(hist, "sum", (double) h->sum / 1000000);
+		cJSON_AddNumberToObject(hist, "max", (double) h->max / 1000000);
+
+		pct = cJSON_AddObjectToObject(hist, "percentiles");
+
+		for (k = 0; k < n; k++)
+		{
+			// 99900 输出为 "p99.9"，50000 输出为 "p50"
+			if (percentiles[k] % 1000 == 0)
+			{
+				ngx_sprintf(name, "p%ui%Z", percentiles[k] / 1000);
+			}
+			else
+			{
+				len = ngx_sprintf(name, "p%ui.%03ui", percentiles[k] / 1000, percentiles[k] % 1000) - name;
+				while (name[len - 1] == '0')
+				{
+					len--;
+				}
+				name[len] = '\0';
+			}
+
+			cJSON_AddNumberToObject(pct, (char *) name,
+			                        (double) ngx_http_private_image_hist_percentile(h, count, percentiles[k]) / 1000000);
+		}
+	}
+
+	if (ngx_http_private_image_top_json(r, root) != NGX_OK)
+	{
+		cJSON_Delete(root);
+		return NULL;
+	}
+
+	json = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+
+	if (json == NULL)
+	{
+		return NULL;
+	}
+
+	len = ngx_strlen(json);
+
+	b = ngx_create_temp_buf(r->pool, len + 1);
+	if (b != NULL)
+	{
+		b->last = ngx_cpymem(b->last, json, len);
+		*b->last++ = LF;
+	}
+
+	cJSON_free(json);
+
+	return b;
+}
+
+// 直方图按 Prometheus 的 summary 类型输出分位数
+static ngx_buf_t *
+ngx_http_private_image_status_prometheus(ngx_http_request_t *r, ngx_http_private_image_shctx_t *sh, ngx_http_private_image_slot_t *total, ngx_uint_t *percentiles, ngx_uint_t n)
+{
+	size_t                          len;
+	ngx_int_t                       value;
+	ngx_uint_t                      i, k;
+	ngx_buf_t                      *b;
+	ngx_atomic_uint_t               count;
+	ngx_http_private_image_hist_t  *h;
+
+	len = NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS * (2 * sizeof("# TYPE private_image__total counter" CRLF) + 32 + NGX_ATOMIC_T_LEN)
+	      + NGX_HTTP_PRIVATE_IMAGE_NHISTS * (n + 4) * (sizeof("# TYPE private_image_total_duration_seconds summary" CRLF)
+	                                                   + sizeof("{quantile=\"0.00000\"} ") + 2 * NGX_ATOMIC_T_LEN);
+
+	len += sizeof("# TYPE private_image_breaker_state gauge" CRLF)
+	       + 3 * sizeof("private_image_breaker_state{state=\"half_open\"} 1" CRLF);
+
+	b = ngx_create_temp_buf(r->pool, len);
+	if (b == NULL)
+	{
+		return NULL;
+	}
+
+	// 熔断器状态按 Prometheus 的 StateSet 方式输出，当前状态为 1，其余为 0
+	b->last = ngx_cpymem(b->last, "# TYPE private_image_breaker_state gauge\n",
+	                     sizeof("# TYPE private_image_breaker_state gauge\n") - 1);
+
+	for (i = 0; i < sizeof(ngx_http_private_image_breaker_states) / sizeof(ngx_str_t); i++)
+	{
+		b->last = ngx_sprintf(b->last, "private_image_breaker_state{state=\"%V\"} %d\n",
+		                      &ngx_http_private_image_breaker_states[i], sh->breaker.state == i);
+	}
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS; i++)
+	{
+		b->last = ngx_sprintf(b->last, "# TYPE private_image_%V_total counter\n"
+		                      "private_image_%V_total %uA\n",
+		                      &ngx_http_private_image_counter_names[i],
+		                      &ngx_http_private_image_counter_names[i],
+		                      total->counters[i]);
+	}
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NHISTS; i++)
+	{
+		h = &total->hists[i];
+		count = ngx_http_private_image_hist_count(h);
+
+		b->last = ngx_sprintf(b->last, "# TYPE private_image_%V_duration_seconds summary\n",
+		                      &ngx_http_private_image_hist_names[i]);
+
+		for (k = 0; k < n; k++)
+		{
+			value = ngx_http_private_image_hist_percentile(h, count, percentiles[k]);
+
+			b->last = ngx_sprintf(b->last, "private_image_%V_duration_seconds{quantile=\"%ui.%05ui\"} %i.%06i\n",
+			                      &ngx_http_private_image_hist_names[i],
+			                      percentiles[k] / 100000, percentiles[k] % 100000,
+			                      value / 1000000, value % 1000000);
+		}
+
+		b->last = ngx_sprintf(b->last, "private_image_%V_duration_seconds_sum %uA.%06uA\n"
+		                      "private_image_%V_duration_seconds_count %uA\n",
+		                      &ngx_http_private_image_hist_names[i], h->sum / 1000000, h->sum % 1000000,
+		                      &ngx_http_private_image_hist_names[i], count);
+	}
+
+	return b;
+}
@@ -1,28 +1,157 @@
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
+#include "ngx_private_image_module.h"
 #include <curl/curl.h>
 #include "cJSON.h"
 
-#define  AUTHORIZE_OK          0
-#define  AUTHORIZE_FAIL       -1
+// 自适应超时取鉴权耗时 p99 的倍数，样本数不足时使用配置的超时
+#define  NGX_HTTP_PRIVATE_IMAGE_ADAPTIVE_FACTOR    3
+#define  NGX_HTTP_PRIVATE_IMAGE_ADAPTIVE_MIN       10
+#define  NGX_HTTP_PRIVATE_IMAGE_ADAPTIVE_SAMPLES   100
 
+// 每个 worker 最多积累的对冲请求额度
+#define  NGX_HTTP_PRIVATE_IMAGE_HEDGE_BURST        10
+
+// 每个 worker 缓存的 curl 句柄数，句柄中保留着与鉴权服务的长连接
+#define  NGX_HTTP_PRIVATE_IMAGE_CURL_CACHE         16
+
+// 按分位数计算的超时和对冲延迟，每个 worker 缓存一秒
+typedef struct
+{
+	ngx_msec_t  updated;
+	ngx_uint_t  p;
+	ngx_int_t   value;
+} ngx_http_private_image_pcache_t;
+
+// 用过的 curl 句柄，下次鉴权时复用其中的连接，避免每次重新建立连接和产生 TIME_WAIT。
+// 后台刷新的线程也会使用，用自旋锁保护
+typedef struct
+{
+	ngx_atomic_t  lock;
+	ngx_uint_t    neasy;
+	ngx_uint_t    nmulti;
+	CURL         *easy[NGX_HTTP_PRIVATE_IMAGE_CURL_CACHE];
+	CURLM        *multi[NGX_HTTP_PRIVATE_IMAGE_CURL_CACHE];
+} ngx_http_private_image_curl_cache_t;
+
+// 一次鉴权请求的参数和结果。后台刷新时在线程中使用，不能引用 ngx_http_request_t
 typedef struct
 {
-	ngx_str_t output_words;
-} ngx_http_private_image_loc_conf_t;
+	ngx_pool_t                          *pool;
+	ngx_log_t                           *log;
+	ngx_http_private_image_main_conf_t  *pmcf;
+	ngx_str_t                            token;
+	ngx_str_t                            uri;
+	char                                *header;
+	char                                *post_field;
+	ngx_msec_t                           connect_timeout;
+	ngx_msec_t                           timeout;
+	// 鉴权服务地址，hedge_delay 不为 0 时启用对冲请求
+	ngx_array_t                         *peers;
+	ngx_uint_t                           protocol;
+	ngx_msec_t                           hedge_delay;
+	ngx_int_t                            rc;
+	// 鉴权耗时（微秒）
+	ngx_int_t                            usec;
+	ngx_http_private_image_grant_t       grant;
+	// 批量鉴权时每个 uri 的结果，nbatch 为 0 表示只鉴权一个 uri
+	ngx_uint_t                           nbatch;
+	ngx_str_t                           *uris;
+	ngx_int_t                           *rcs;
+	ngx_http_private_image_grant_t      *grants;
+} ngx_http_private_image_auth_t;
+
+// nginx 1.14 还没有定义 429
+#ifdef NGX_HTTP_TOO_MANY_REQUESTS
+#define  NGX_HTTP_PRIVATE_IMAGE_TOO_MANY_REQUESTS  NGX_HTTP_TOO_MANY_REQUESTS
+#else
+#define  NGX_HTTP_PRIVATE_IMAGE_TOO_MANY_REQUESTS  429
+#endif
 
 static char* ngx_http_private_image(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 
+static void* ngx_http_private_image_create_main_conf(ngx_conf_t* cf);
+
 static void* ngx_http_private_image_create_loc_conf(ngx_conf_t* cf);
 
 static char* ngx_http_private_image_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child);
 
 static ngx_int_t ngx_http_private_image_handler(ngx_http_request_t* r);
 
-static ngx_str_t get_key_header (ngx_http_request_t* r, ngx_str_t header_name);
+static ngx_int_t ngx_http_private_image_send(ngx_http_request_t *r);
+
+static ngx_int_t ngx_http_private_image_open_error(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+
+static ngx_str_t *ngx_http_private_image_token_header(ngx_http_request_t *r, ngx_http_private_image_loc_conf_t *plcf);
+
+static ngx_int_t ngx_http_private_image_auth_init(ngx_http_request_t *r, ngx_pool_t *pool, ngx_str_t *header_val, ngx_http_private_image_auth_t *auth);
+
+static ngx_int_t ngx_http_private_image_authorize(ngx_http_request_t *r, ngx_str_t *header_val, ngx_http_private_image_grant_t *grant);
+
+static void ngx_http_private_image_auth_done(ngx_http_private_image_auth_t *auth);
+
+static void ngx_http_private_image_refresh(ngx_http_request_t *r, ngx_str_t *header_val);
+
+#if (NGX_THREADS)
+static void ngx_http_private_image_refresh_thread(void *data, ngx_log_t *log);
+
+static void ngx_http_private_image_refresh_done(ngx_event_t *ev);
+#endif
+
+static void check_authorize(ngx_http_private_image_auth_t *auth);
+
+static CURL *ngx_http_private_image_auth_handle(ngx_http_private_image_auth_t *auth, ngx_http_private_image_peer_t *peer, struct curl_slist *header, ngx_str_t *response);
+
+static CURL *ngx_http_private_image_curl_get(void);
+
+static void ngx_http_private_image_curl_free(CURL *curl);
+
+static CURLM *ngx_http_private_image_multi_get(void);
+
+static void ngx_http_private_image_multi_free(CURLM *multi);
+
+static void ngx_http_private_image_auth_parse(ngx_http_private_image_auth_t *auth, CURL *curl, CURLcode curl_code, ngx_str_t *response);
+
+static ngx_int_t ngx_http_private_image_auth_verdict(ngx_pool_t *pool, cJSON *parse, ngx_http_private_image_grant_t *grant);
+
+static void ngx_http_private_image_auth_hedged(ngx_http_private_image_auth_t *auth, ngx_http_private_image_peer_t *first, ngx_http_private_image_peer_t *second, struct curl_slist *header);
+
+static void ngx_http_private_image_hedge_earn(ngx_uint_t rate);
+
+static ngx_uint_t ngx_http_private_image_hedge_take(void);
+
+static ngx_int_t ngx_http_private_image_auth_percentile(ngx_http_private_image_pcache_t *pc, ngx_uint_t p);
+
+static char *ngx_http_private_image_auth_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static char *ngx_http_private_image_auth_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
-static ngx_int_t check_authorize(ngx_http_request_t* r, ngx_log_t* log, char *header);
+static void get_user_id(ngx_pool_t *pool, cJSON *item, ngx_str_t *user_id);
+
+static ngx_msec_t ngx_http_private_image_auth_timeout(ngx_http_private_image_loc_conf_t *plcf);
+
+static ngx_msec_t ngx_http_private_image_hedge_delay(ngx_http_private_image_loc_conf_t *plcf);
+
+static ngx_int_t ngx_http_private_image_add_variables(ngx_conf_t *cf);
+
+static ngx_int_t ngx_http_private_image_init(ngx_conf_t *cf);
+
+static ngx_int_t ngx_http_private_image_init_process(ngx_cycle_t *cycle);
+
+static void ngx_http_private_image_exit_process(ngx_cycle_t *cycle);
+
+static ngx_int_t ngx_http_private_image_log_handler(ngx_http_request_t *r);
+
+static ngx_int_t ngx_http_private_image_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_int_t ngx_http_private_image_cache_status_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_int_t ngx_http_private_image_user_id_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_conf_enum_t ngx_http_private_image_protocols[] =
+{
+	{ ngx_string("http"), NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_HTTP },
+	{ ngx_string("binary"), NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_BINARY },
+	{ ngx_null_string, 0 }
+};
 
 static ngx_command_t ngx_http_private_image_commands[] =
 {
@@ -36,19 +165,232 @@ static ngx_command_t ngx_http_private_image_commands[] =
 		// 该字段被NGX_HTTP_MODULE类型模块所用 (我们编写的基本上都是NGX_HTTP_MOUDLE，只有一些nginx核心模块是非NGX_HTTP_MODULE)，该字段指定当前配置项存储的内存位置。实际上是使用哪个内存池的问题。因为http模块对所有http模块所要保存的配置信息，划分了main, server和location三个地方进行存储，每个地方都有一个内存池用来分配存储这些信息的内存。这里可能的值为 NGX_HTTP_MAIN_CONF_OFFSET、NGX_HTTP_SRV_CONF_OFFSET或NGX_HTTP_LOC_CONF_OFFSET。当然也可以直接置为0，就是NGX_HTTP_MAIN_CONF_OFFSET。
 		NGX_HTTP_LOC_CONF_OFFSET,
 		// 指定该配置项值的精确存放位置，一般指定为某一个结构体变量的字段偏移。因为对于配置信息的存储，一般我们都是定义个结构体来存储的。那么比如我们定义了一个结构体A，该项配置的值需要存储到该结构体的b字段。那么在这里就可以填写为offsetof(A, b)。对于有些配置项，它的值不需要保存或者是需要保存到更为复杂的结构中时，这里可以设置为0。
-		offsetof(ngx_http_private_image_loc_conf_t, output_words),
+		0,
 		// 该字段存储一个指针。可以指向任何一个在读取配置过程中需要的数据，以便于进行配置读取的处理。大多数时候，都不需要，所以简单地设为0即可。
 		NULL
 	},
+	{
+		ngx_string("private_image_zone"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		ngx_http_private_image_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_top_zone"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE123,
+		ngx_http_private_image_top_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_limit_zone"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+		ngx_http_private_image_limit_zone,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_limit"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_http_private_image_limit,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_cache"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+		ngx_http_private_image_auth_cache,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_revoke"),
+		NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+		ngx_http_private_image_auth_revoke,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_token_table"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+		ngx_http_private_image_token_table,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_breaker"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+		ngx_http_private_image_breaker,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_pass"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+		ngx_http_private_image_auth_pass,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_protocol"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_enum_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_private_image_loc_conf_t, auth_protocol),
+		&ngx_http_private_image_protocols
+	},
+	{
+		ngx_string("private_image_auth_hedge"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+		ngx_http_private_image_auth_hedge,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_batch"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+		ngx_http_private_image_auth_batch,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_connect_timeout"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_private_image_loc_conf_t, auth_connect_timeout),
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_header"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_private_image_loc_conf_t, auth_header),
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_field"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_str_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_private_image_loc_conf_t, auth_field),
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_timeout"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_conf_set_msec_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_private_image_loc_conf_t, auth_timeout),
+		NULL
+	},
+	{
+		ngx_string("private_image_auth_adaptive_timeout"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+		ngx_conf_set_flag_slot,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		offsetof(ngx_http_private_image_loc_conf_t, auth_adaptive_timeout),
+		NULL
+	},
+	{
+		ngx_string("private_image_file_cache"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+		ngx_http_private_image_file_cache,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_missing_cache"),
+		NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+		ngx_http_private_image_missing_cache,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_open_threads"),
+		NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+		ngx_http_private_image_open_threads,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
+	{
+		ngx_string("private_image_status"),
+		NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+		ngx_http_private_image_status,
+		NGX_HTTP_LOC_CONF_OFFSET,
+		0,
+		NULL
+	},
 	// 需要注意的是，就是在ngx_http_hello_commands这个数组定义的最后，都要加一个ngx_null_command作为结尾。
 	ngx_null_command
 };
 
+static ngx_http_variable_t ngx_http_private_image_vars[] =
+{
+	{
+		ngx_string("private_image_auth_time"), NULL,
+		ngx_http_private_image_time_variable,
+		offsetof(ngx_http_private_image_ctx_t, auth_time),
+		NGX_HTTP_VAR_NOCACHEABLE, 0
+	},
+	{
+		ngx_string("private_image_open_time"), NULL,
+		ngx_http_private_image_time_variable,
+		offsetof(ngx_http_private_image_ctx_t, open_time),
+		NGX_HTTP_VAR_NOCACHEABLE, 0
+	},
+	{
+		ngx_string("private_image_auth_cache_status"), NULL,
+		ngx_http_private_image_cache_status_variable, 0,
+		NGX_HTTP_VAR_NOCACHEABLE, 0
+	},
+	{
+		ngx_string("private_image_user_id"), NULL,
+		ngx_http_private_image_user_id_variable, 0,
+		NGX_HTTP_VAR_NOCACHEABLE, 0
+	},
+	ngx_http_null_variable
+};
+
+static ngx_str_t ngx_http_private_image_cache_status[] =
+{
+	ngx_null_string,
+	ngx_string("HIT"),
+	ngx_string("MISS"),
+	ngx_string("STALE"),
+	ngx_string("BYPASS"),
+	ngx_string("UPDATING")
+};
+
+// 下一个使用的鉴权服务地址，worker 内的线程共用
+static ngx_atomic_t ngx_http_private_image_peer;
+
+// 当前 worker 的对冲请求额度
+static ngx_atomic_t ngx_http_private_image_hedge_budget;
+
+static ngx_http_private_image_curl_cache_t ngx_http_private_image_curl_cache;
+
 static ngx_http_module_t ngx_http_private_image_module_ctx =
 {
-	NULL,
-	NULL,
-	NULL,
+	ngx_http_private_image_add_variables,
+	ngx_http_private_image_init,
+	ngx_http_private_image_create_main_conf,
 	NULL,
 	NULL,
 	NULL,
@@ -64,10 +406,10 @@ ngx_module_t ngx_http_private_image_module  =
 	NGX_HTTP_MODULE,
 	NULL,
 	NULL,
+	ngx_http_private_image_init_process,
 	NULL,
 	NULL,
-	NULL,
-	NULL,
+	ngx_http_private_image_exit_process,
 	NULL,
 	NGX_MODULE_V1_PADDING
 };
@@ -78,24 +420,20 @@ static char
 	ngx_http_core_loc_conf_t *clcf;
 	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
 	clcf->handler = ngx_http_private_image_handler;
-	ngx_conf_set_str_slot(cf, cmd, conf);
 	return NGX_CONF_OK;
 }
 
 static ngx_int_t
 ngx_http_private_image_handler(ngx_http_request_t* r)
 {
-	ngx_log_t                 *log;
 	ngx_int_t                  rc;
-	u_char                    *last;
-	size_t                     root;
-	ngx_str_t                  path;
-	ngx_chain_t                out;
-	ngx_buf_t                 *b;
-	ngx_http_core_loc_conf_t  *clcf;
-	ngx_open_file_info_t       of;
-	// 初始化 Log
-	log = r->connection->log;
+	ngx_http_private_image_ctx_t *ctx;
+	ngx_http_private_image_grant_t grant;
+	ngx_uint_t                 refresh;
+	ngx_str_t                 *token;
+	ngx_http_private_image_loc_conf_t *plcf;
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_REQUESTS, 1);
 
 	// 只允许 get head 请求
 	if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
@@ -109,33 +447,132 @@ ngx_http_private_image_handler(ngx_http_request_t* r)
 		return NGX_HTTP_NOT_ALLOWED;
 	}
 
+	ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_private_image_ctx_t));
+	if (ctx == NULL)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	ctx->start = ngx_http_private_image_usec();
+	ctx->auth_time = -1;
+	ctx->open_time = -1;
+	ngx_http_set_ctx(r, ctx, ngx_http_private_image_module);
+
 	// 请求参数 HEDAER
-	ngx_str_t header_key = ngx_string("WX-KEY");
-	ngx_str_t header_val = get_key_header(r, header_key);
-	if (header_val.data == NULL)
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
+	token = ngx_http_private_image_token_header(r, plcf);
+	if (token == NULL)
 	{
 		return NGX_HTTP_FORBIDDEN;
 	}
-	else
+
+	ngx_str_t header_val = *token;
+
+	ctx->token = header_val;
+
+	// 鉴权服务推送的 token 表中有授权时，不再查缓存和请求鉴权服务
+	if (ngx_http_private_image_table_lookup(r, &header_val, &ctx->cached) == NGX_OK)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_TABLE_HITS, 1);
+		ctx->cache_status = NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT;
+
+		return ngx_http_private_image_access(r, AUTHORIZE_OK, &ctx->cached);
+	}
+
+	// 先查鉴权结果缓存，命中时不再请求鉴权服务
+	ctx->cache_status = ngx_http_private_image_cache_lookup(r, &header_val, &ctx->cached, &refresh);
+	ngx_http_private_image_probe_cache_lookup(r, ctx->cache_status);
+
+	if (ctx->cache_status == NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT
+	    || ctx->cache_status == NGX_HTTP_PRIVATE_IMAGE_CACHE_UPDATING)
 	{
-		// 字符串拼接
-		char *header;
-		ngx_int_t new_len = header_key.len + header_val.len + 2;
-		header = malloc(new_len);
-		ngx_memcpy(header, header_key.data, header_key.len);
-		strcat(header, ":");
-		strcat(header, (char *)header_val.data);
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_CACHE_HITS, 1);
 
-		// 进行权限校验
-		if (check_authorize(r, log, header) == AUTHORIZE_FAIL)
+		// 授权即将失效，由一个请求在后台刷新，其他请求继续使用旧的授权
+		if (refresh)
 		{
-			free(header);
-			return NGX_HTTP_FORBIDDEN;
+			ngx_http_private_image_refresh(r, &header_val);
 		}
 
-		free(header);
+		return ngx_http_private_image_access(r, AUTHORIZE_OK, &ctx->cached);
+	}
+
+	if (ctx->cache_status != NGX_HTTP_PRIVATE_IMAGE_CACHE_BYPASS)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_CACHE_MISSES, 1);
+	}
+
+	// 开启批量鉴权时请求在这里挂起，鉴权完成后由批次继续处理
+	rc = ngx_http_private_image_batch_add(r, &header_val);
+	if (rc != NGX_DECLINED)
+	{
+		return rc;
+	}
+
+	// 进行权限校验
+	ngx_memzero(&grant, sizeof(ngx_http_private_image_grant_t));
+	rc = ngx_http_private_image_authorize(r, &header_val, &grant);
+
+	return ngx_http_private_image_access(r, rc, &grant);
+}
+
+// 根据鉴权结果决定是否允许访问，通过后发送文件。批量鉴权的请求在鉴权完成后从这里继续
+ngx_int_t
+ngx_http_private_image_access(ngx_http_request_t *r, ngx_int_t rc, ngx_http_private_image_grant_t *grant)
+{
+	ngx_http_private_image_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+
+	if (rc == AUTHORIZE_ERROR && ctx->cache_status == NGX_HTTP_PRIVATE_IMAGE_CACHE_STALE)
+	{
+		// 鉴权服务不可用时使用 stale_if_error 时间内的过期授权
+		ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "private image auth unavailable, using stale grant");
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_STALE_SERVED, 1);
+		grant = &ctx->cached;
+		rc = AUTHORIZE_OK;
+	}
+	else if (ctx->cache_status == NGX_HTTP_PRIVATE_IMAGE_CACHE_STALE)
+	{
+		ctx->cache_status = NGX_HTTP_PRIVATE_IMAGE_CACHE_MISS;
+	}
+
+	ctx->user_id = grant->user_id;
+
+	// 热点统计，鉴权失败时只统计 token
+	ngx_http_private_image_top_update(r, &ctx->token, &ctx->user_id);
+
+	if (rc == AUTHORIZE_ERROR)
+	{
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	if (rc == AUTHORIZE_FAIL)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_FAILURES, 1);
+		return NGX_HTTP_FORBIDDEN;
+	}
+
+	// 限流在打开文件之前进行，被拒绝的请求不产生磁盘 IO
+	if (ngx_http_private_image_limit_check(r, &ctx->token, &ctx->user_id) == NGX_BUSY)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_LIMITED, 1);
+		return NGX_HTTP_PRIVATE_IMAGE_TOO_MANY_REQUESTS;
 	}
 
+	return ngx_http_private_image_send(r);
+}
+
+static ngx_int_t
+ngx_http_private_image_send(ngx_http_request_t *r)
+{
+	ngx_int_t                  rc;
+	u_char                    *last;
+	size_t                     root;
+	ngx_str_t                  path;
+	ngx_http_core_loc_conf_t  *clcf;
+	ngx_open_file_info_t       of;
+
 	// 转换为磁盘路径 path
 	last = ngx_http_map_uri_to_path(r, &path, &root, 0);
 	if (last == NULL)
@@ -143,6 +580,8 @@ ngx_http_private_image_handler(ngx_http_request_t* r)
 		return NGX_HTTP_NOT_FOUND;
 	}
 
+	path.len = last - path.data;
+
 	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
 	ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -154,68 +593,177 @@ ngx_http_private_image_handler(ngx_http_request_t* r)
 	of.errors = clcf->open_file_cache_errors;
 	of.events = clcf->open_file_cache_events;
 
-	if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK)
+	rc = ngx_http_private_image_open(r, &path, &of);
+	if (rc == NGX_AGAIN)
+	{
+		// 在线程池中打开，完成后继续发送
+		return NGX_DONE;
+	}
+
+	return ngx_http_private_image_send_file(r, &path, &of, rc);
+}
+
+// 文件打开后发送响应，rc 为打开的结果
+ngx_int_t
+ngx_http_private_image_send_file(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of, ngx_int_t rc)
+{
+	ngx_log_t                 *log;
+	ngx_chain_t                out;
+	ngx_buf_t                 *b;
+	ngx_http_private_image_ctx_t *ctx;
+
+	log = r->connection->log;
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+
+	ngx_http_private_image_probe_file_open(r, path, rc, of->err, ctx->open_time);
+
+	ngx_http_private_image_record(NGX_HTTP_PRIVATE_IMAGE_HIST_OPEN, ctx->open_time);
+
+	if (rc != NGX_OK)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_OPEN_FAILURES, 1);
+		return ngx_http_private_image_open_error(r, path, of);
+	}
+
+	// 目录和其他不是普通文件的路径不作为图片返回
+	if (!of->is_file)
 	{
-		ngx_log_error(NGX_LOG_ERR, log, of.err, "%s \"%s\" private image failed", of.failed, path.data);
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_OPEN_FAILURES, 1);
+		ngx_log_error(NGX_LOG_ERR, log, 0, "\"%s\" is not a regular file", path->data);
+		return NGX_HTTP_NOT_FOUND;
 	}
 
-	ngx_str_t type = ngx_string("image/png");
 	r->headers_out.status = NGX_HTTP_OK;
-	r->headers_out.content_length_n = of.size;
-	r->headers_out.last_modified_time = of.mtime;
-	r->headers_out.content_type = type;
+	r->headers_out.content_length_n = of->size;
+	r->headers_out.last_modified_time = of->mtime;
 	r->allow_ranges = 1;
 
-	b = ngx_calloc_buf(r->pool);
-	if (b == NULL)
+	// 鉴权已经通过，If-None-Match 和 If-Modified-Since 由 not_modified 过滤器检查，
+	// 没有变化时返回 304 并设置 header_only，不再发送文件
+	if (ngx_http_set_etag(r) != NGX_OK)
 	{
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
-	b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-	if (b->file == NULL)
+	if (ngx_http_private_image_content_type(r, path, of) != NGX_OK)
 	{
 		return NGX_HTTP_INTERNAL_SERVER_ERROR;
 	}
 
+	ngx_http_private_image_probe_send_header(r);
+
 	rc = ngx_http_send_header(r);
+
+	if (r->headers_out.status == NGX_HTTP_NOT_MODIFIED)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_NOT_MODIFIED, 1);
+	}
+
 	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
 	{
 		return rc;
 	}
 
-	b->file_pos = 0;
-	b->file_last = of.size;
+	// 小文件可能来自共享内存中的文件缓存
+	b = ngx_http_private_image_file_body(r, path, of);
+	if (b == NULL)
+	{
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
 
-	b->in_file = b->file_last ? 1 : 0;
 	b->last_buf = (r == r->main) ? 1 : 0;
 	b->last_in_chain = 1;
 
-	b->file->fd = of.fd;
-	b->file->name = path;
-	b->file->log = log;
-	b->file->directio = of.is_directio;
-
 	out.buf = b;
 	out.next = NULL;
 
 	return ngx_http_output_filter(r, &out);
 }
 
-static void*
-ngx_http_private_image_create_loc_conf(ngx_conf_t* cf)
+// 打开失败时按错误码返回状态码，与 ngx_http_static_module 一致：不存在的文件返回 404，
+// 没有权限返回 403，其他错误返回 500
+static ngx_int_t
+ngx_http_private_image_open_error(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
 {
-	ngx_http_private_image_loc_conf_t* conf;
+	ngx_uint_t                 level;
+	ngx_int_t                  rc;
+	ngx_http_core_loc_conf_t  *clcf;
 
-	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_loc_conf_t));
-	if (conf == NULL)
+	switch (of->err)
 	{
-		return NGX_CONF_ERROR;
+	case 0:
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	case NGX_ENOENT:
+	case NGX_ENOTDIR:
+	case NGX_ENAMETOOLONG:
+		level = NGX_LOG_ERR;
+		rc = NGX_HTTP_NOT_FOUND;
+		break;
+
+	case NGX_EACCES:
+#if (NGX_HAVE_OPENAT)
+	case NGX_EMLINK:
+	case NGX_ELOOP:
+#endif
+		level = NGX_LOG_ERR;
+		rc = NGX_HTTP_FORBIDDEN;
+		break;
+
+	default:
+		level = NGX_LOG_CRIT;
+		rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+		break;
 	}
-	conf->output_words.len = 0;
-	conf->output_words.data = NULL;
 
-	return conf;
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	if (rc != NGX_HTTP_NOT_FOUND || clcf->log_not_found)
+	{
+		ngx_log_error(level, r->connection->log, of->err, "%s \"%s\" failed", of->failed, path->data);
+	}
+
+	return rc;
+}
+
+static void*
+ngx_http_private_image_create_main_conf(ngx_conf_t* cf)
+{
+	ngx_http_private_image_main_conf_t* conf;
+
+	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_main_conf_t));
+	if (conf == NULL)
+	{
+		return NULL;
+	}
+
+	return conf;
+}
+
+static void*
+ngx_http_private_image_create_loc_conf(ngx_conf_t* cf)
+{
+	ngx_http_private_image_loc_conf_t* conf;
+
+	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_loc_conf_t));
+	if (conf == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+	conf->limit_zone = NGX_CONF_UNSET_PTR;
+	conf->auth_connect_timeout = NGX_CONF_UNSET_MSEC;
+	conf->auth_timeout = NGX_CONF_UNSET_MSEC;
+	conf->open_pool = NGX_CONF_UNSET_PTR;
+	conf->auth_adaptive_timeout = NGX_CONF_UNSET;
+	conf->auth_peers = NGX_CONF_UNSET_PTR;
+	conf->auth_protocol = NGX_CONF_UNSET_UINT;
+	conf->hedge_delay = NGX_CONF_UNSET_MSEC;
+	conf->hedge_percentile = NGX_CONF_UNSET_UINT;
+	conf->hedge_rate = NGX_CONF_UNSET_UINT;
+	conf->batch_window = NGX_CONF_UNSET_MSEC;
+	conf->batch_size = NGX_CONF_UNSET_UINT;
+
+	return conf;
 }
 
 static char*
@@ -223,7 +771,86 @@ ngx_http_private_image_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child)
 {
 	ngx_http_private_image_loc_conf_t* prev = parent;
 	ngx_http_private_image_loc_conf_t* conf = child;
-	ngx_conf_merge_str_value(conf->output_words, prev->output_words, "Nginx");
+	ngx_http_private_image_peer_t *peer;
+	ngx_uint_t i;
+	ngx_conf_merge_ptr_value(conf->limit_zone, prev->limit_zone, NULL);
+	ngx_conf_merge_msec_value(conf->auth_connect_timeout, prev->auth_connect_timeout, 200);
+	ngx_conf_merge_msec_value(conf->auth_timeout, prev->auth_timeout, 1000);
+	ngx_conf_merge_value(conf->auth_adaptive_timeout, prev->auth_adaptive_timeout, 0);
+
+	if (conf->auth_peers == NGX_CONF_UNSET_PTR)
+	{
+		if (prev->auth_peers == NGX_CONF_UNSET_PTR)
+		{
+			// 默认的鉴权服务地址
+			prev->auth_peers = ngx_array_create(cf->pool, 1, sizeof(ngx_http_private_image_peer_t));
+			if (prev->auth_peers == NULL)
+			{
+				return NGX_CONF_ERROR;
+			}
+
+			peer = ngx_array_push(prev->auth_peers);
+			if (peer == NULL)
+			{
+				return NGX_CONF_ERROR;
+			}
+
+			ngx_str_set(&peer->url, "http://localhost:1323");
+			ngx_str_null(&peer->unix_path);
+			peer->sockaddr = NULL;
+			peer->socklen = 0;
+		}
+
+		conf->auth_peers = prev->auth_peers;
+	}
+
+	ngx_conf_merge_uint_value(conf->auth_protocol, prev->auth_protocol, NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_HTTP);
+
+	if (conf->auth_protocol == NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_BINARY)
+	{
+		peer = conf->auth_peers->elts;
+
+		for (i = 0; i < conf->auth_peers->nelts; i++)
+		{
+			if (ngx_http_private_image_binary_peer(cf, &peer[i]) != NGX_OK)
+			{
+				return NGX_CONF_ERROR;
+			}
+		}
+	}
+
+	ngx_conf_merge_msec_value(conf->hedge_delay, prev->hedge_delay, 0);
+	ngx_conf_merge_uint_value(conf->hedge_percentile, prev->hedge_percentile, 0);
+	ngx_conf_merge_uint_value(conf->hedge_rate, prev->hedge_rate, 10);
+	ngx_conf_merge_msec_value(conf->batch_window, prev->batch_window, 0);
+	ngx_conf_merge_uint_value(conf->batch_size, prev->batch_size, 16);
+	ngx_conf_merge_str_value(conf->auth_header, prev->auth_header, "WX-KEY");
+
+	conf->auth_header_lc = ngx_pnalloc(cf->pool, conf->auth_header.len);
+	if (conf->auth_header_lc == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	conf->auth_header_hash = ngx_hash_strlow(conf->auth_header_lc, conf->auth_header.data, conf->auth_header.len);
+
+	ngx_conf_merge_str_value(conf->auth_field, prev->auth_field, "source_url");
+
+	conf->auth_header_prefix.len = conf->auth_header.len + 1;
+	conf->auth_header_prefix.data = ngx_pnalloc(cf->pool, conf->auth_header_prefix.len);
+	conf->auth_field_prefix.len = conf->auth_field.len + 1;
+	conf->auth_field_prefix.data = ngx_pnalloc(cf->pool, conf->auth_field_prefix.len);
+
+	if (conf->auth_header_prefix.data == NULL || conf->auth_field_prefix.data == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ngx_sprintf(conf->auth_header_prefix.data, "%V:", &conf->auth_header);
+	ngx_sprintf(conf->auth_field_prefix.data, "%V=", &conf->auth_field);
+
+	ngx_conf_merge_ptr_value(conf->open_pool, prev->open_pool, NULL);
+
 	return NGX_CONF_OK;
 }
 
@@ -236,7 +863,7 @@ getResponse(void* ptr, size_t size, size_t nmemb, ngx_str_t *response)
 	{
 		return NGX_ERROR;
 	}
-	ngx_memcpy(response->data, ptr, realsize);
+	ngx_memcpy(response->data + response->len, ptr, realsize);
 
 	response->len += realsize;
 	response->data[response->len] = '\0';
@@ -244,96 +871,1296 @@ getResponse(void* ptr, size_t size, size_t nmemb, ngx_str_t *response)
 	return realsize;
 }
 
+// 鉴权服务返回的用户 ID 可能是字符串也可能是数字，统一转成字符串保存在内存池中
+static void
+get_user_id(ngx_pool_t *pool, cJSON *item, ngx_str_t *user_id)
+{
+	u_char *p;
+
+	if (cJSON_IsString(item))
+	{
+		user_id->len = ngx_strlen(item->valuestring);
+		user_id->data = ngx_pnalloc(pool, user_id->len);
+		if (user_id->data == NULL)
+		{
+			user_id->len = 0;
+			return;
+		}
+		ngx_memcpy(user_id->data, item->valuestring, user_id->len);
+	}
+	else if (cJSON_IsNumber(item))
+	{
+		p = ngx_pnalloc(pool, NGX_INT64_LEN);
+		if (p == NULL)
+		{
+			return;
+		}
+		user_id->data = p;
+		user_id->len = ngx_sprintf(p, "%L", (int64_t) item->valuedouble) - p;
+	}
+}
+
+// 准备一次鉴权请求，数据都分配在 pool 中，后台刷新时 pool 与请求无关
 static ngx_int_t
-check_authorize(ngx_http_request_t* r, ngx_log_t *log, char *header_key)
+ngx_http_private_image_auth_init(ngx_http_request_t *r, ngx_pool_t *pool, ngx_str_t *header_val, ngx_http_private_image_auth_t *auth)
 {
-	ngx_int_t          result   = AUTHORIZE_FAIL;
-	ngx_str_t          response = ngx_null_string;
-	CURLcode           curl_code;
-	CURL              *curl;
+	u_char                             *p;
+	ngx_http_private_image_loc_conf_t  *plcf;
 
-	char prefix[] = "source_url=";
-	char *post_field = ngx_calloc(strlen(prefix) * sizeof(char *) + r->uri.len, log);
-	strcpy(post_field, prefix);
-	strcat(post_field, (char *)r->uri.data);
+	plcf = ngx_http_get_module_loc_conf(r, ngx_http_private_image_module);
 
-	curl = curl_easy_init();
-	if (curl)
+	ngx_memzero(auth, sizeof(ngx_http_private_image_auth_t));
+
+	auth->pool = pool;
+	auth->pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	auth->connect_timeout = plcf->auth_connect_timeout;
+	auth->timeout = ngx_http_private_image_auth_timeout(plcf);
+	auth->peers = plcf->auth_peers;
+	auth->protocol = plcf->auth_protocol;
+	auth->rc = AUTHORIZE_ERROR;
+
+	// 二进制协议不支持对冲请求
+	if (auth->protocol == NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_HTTP
+	    && plcf->auth_peers->nelts > 1 && (plcf->hedge_delay || plcf->hedge_percentile))
+	{
+		ngx_http_private_image_hedge_earn(plcf->hedge_rate);
+		auth->hedge_delay = ngx_http_private_image_hedge_delay(plcf);
+	}
+
+	auth->token.len = header_val->len;
+	auth->token.data = ngx_pstrdup(pool, header_val);
+
+	auth->uri.len = r->uri.len;
+	auth->uri.data = ngx_pstrdup(pool, &r->uri);
+
+	// 请求头 "WX-KEY:token" 和请求体 "source_url=uri"，curl 需要以 '\0' 结尾的字符串
+	auth->header = ngx_pnalloc(pool, plcf->auth_header_prefix.len + header_val->len + 1);
+	auth->post_field = ngx_pnalloc(pool, plcf->auth_field_prefix.len + r->uri.len + 1);
+
+	if (auth->token.data == NULL || auth->uri.data == NULL
+	    || auth->header == NULL || auth->post_field == NULL)
 	{
-		struct curl_slist *header    = NULL;
-		// set request url and set response
-		curl_easy_setopt(curl, CURLOPT_URL, "http://localhost:1323");
+		return NGX_ERROR;
+	}
+
+	p = ngx_cpymem(auth->header, plcf->auth_header_prefix.data, plcf->auth_header_prefix.len);
+	p = ngx_cpymem(p, header_val->data, header_val->len);
+	*p = '\0';
+
+	p = ngx_cpymem(auth->post_field, plcf->auth_field_prefix.data, plcf->auth_field_prefix.len);
+	p = ngx_cpymem(p, r->uri.data, r->uri.len);
+	*p = '\0';
 
-		// set header key
-		header = curl_slist_append(header, header_key);
+	return NGX_OK;
+}
 
-		/* curl_easy_setopt(curl, CURLOPT_HEADER, 1); */
+// 向鉴权服务发起一次鉴权：熔断时直接返回 AUTHORIZE_ERROR，否则记录耗时并把结果报告给熔断器
+static ngx_int_t
+ngx_http_private_image_authorize(ngx_http_request_t *r, ngx_str_t *header_val, ngx_http_private_image_grant_t *grant)
+{
+	ngx_http_private_image_auth_t  auth;
+	ngx_http_private_image_ctx_t  *ctx;
 
-		/* Now specify we want to POST data */
-		curl_easy_setopt(curl, CURLOPT_POST, 1);
+	if (ngx_http_private_image_breaker_allow(r) != NGX_OK)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_REJECTED, 1);
+		return AUTHORIZE_ERROR;
+	}
 
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_field);
+	if (ngx_http_private_image_auth_init(r, r->pool, header_val, &auth) != NGX_OK)
+	{
+		return AUTHORIZE_ERROR;
+	}
 
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, getResponse);
+	auth.log = r->connection->log;
 
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
 
-		// set request headers
-		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header);
-		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "POST");
+	ngx_http_private_image_probe_auth_start(r);
+	check_authorize(&auth);
+	ngx_http_private_image_probe_auth_end(r, auth.rc, auth.usec);
 
-		curl_code = curl_easy_perform(curl);
-		if (curl_code == CURLE_OK && response.data != NULL)
+	ctx->auth_time = auth.usec;
+
+	ngx_http_private_image_auth_done(&auth);
+
+	*grant = auth.grant;
+
+	return auth.rc;
+}
+
+// 批量鉴权：同一个 token 的多个请求合并为一次鉴权，每个请求的结果按顺序保存在 rcs 和 grants 中。
+// 授权信息分配在 pool 中，只有一个请求时按普通鉴权处理
+void
+ngx_http_private_image_authorize_batch(ngx_http_request_t **requests, ngx_uint_t n, ngx_pool_t *pool, ngx_str_t *header_val, ngx_int_t *rcs, ngx_http_private_image_grant_t *grants)
+{
+	u_char                        *p;
+	size_t                         len;
+	ngx_uint_t                     i;
+	ngx_str_t                     *uri;
+	ngx_http_private_image_auth_t  auth;
+	ngx_http_private_image_ctx_t  *ctx;
+	ngx_http_private_image_loc_conf_t  *plcf;
+
+	for (i = 0; i < n; i++)
+	{
+		rcs[i] = AUTHORIZE_ERROR;
+		ngx_memzero(&grants[i], sizeof(ngx_http_private_image_grant_t));
+		grants[i].ttl = -1;
+	}
+
+	if (n == 1)
+	{
+		rcs[0] = ngx_http_private_image_authorize(requests[0], header_val, &grants[0]);
+		return;
+	}
+
+	if (ngx_http_private_image_breaker_allow(requests[0]) != NGX_OK)
+	{
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_REJECTED, n);
+		return;
+	}
+
+	if (ngx_http_private_image_auth_init(requests[0], pool, header_val, &auth) != NGX_OK)
+	{
+		return;
+	}
+
+	auth.log = requests[0]->connection->log;
+	auth.nbatch = n;
+	auth.rcs = rcs;
+	auth.grants = grants;
+
+	auth.uris = ngx_palloc(pool, n * sizeof(ngx_str_t));
+	if (auth.uris == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		auth.uris[i] = requests[i]->uri;
+	}
+
+	if (auth.protocol == NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_BINARY)
+	{
+		goto send;
+	}
+
+	// 请求体 "source_url=uri1&source_url=uri2..."，uri 中的 '&' 等字符需要转义
+	plcf = ngx_http_get_module_loc_conf(requests[0], ngx_http_private_image_module);
+	len = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		uri = &auth.uris[i];
+		len += 1 + plcf->auth_field_prefix.len + uri->len
+		       + 2 * ngx_escape_uri(NULL, uri->data, uri->len, NGX_ESCAPE_ARGS);
+	}
+
+	p = ngx_pnalloc(pool, len + 1);
+	if (p == NULL)
+	{
+		return;
+	}
+
+	auth.post_field = (char *) p;
+
+	for (i = 0; i < n; i++)
+	{
+		if (i)
 		{
-			// get response json and check
-			cJSON* parse = cJSON_Parse((char *)response.data);
-			cJSON* status = cJSON_GetObjectItem(parse, "status");
-			if (status->valuestring != NULL && ngx_strcmp(status->valuestring, "200") == 0)
-			{
-				result = AUTHORIZE_OK;
-			}
-			cJSON_free(parse);
-			cJSON_free(status);
+			*p++ = '&';
 		}
 
-		curl_easy_cleanup(curl);
-		curl_slist_free_all(header);
+		p = ngx_cpymem(p, plcf->auth_field_prefix.data, plcf->auth_field_prefix.len);
+		p = (u_char *) ngx_escape_uri(p, auth.uris[i].data, auth.uris[i].len, NGX_ESCAPE_ARGS);
+	}
+
+	*p = '\0';
+
+send:
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_BATCHES, 1);
+
+	check_authorize(&auth);
+
+	for (i = 0; i < n; i++)
+	{
+		ctx = ngx_http_get_module_ctx(requests[i], ngx_http_private_image_module);
+		ctx->auth_time = auth.usec;
+
+		// 鉴权服务出错时可能只收到了一部分结果，整批都按出错处理
+		if (auth.rc != AUTHORIZE_OK)
+		{
+			rcs[i] = AUTHORIZE_ERROR;
+		}
 	}
 
-	return result;
+	ngx_http_private_image_auth_done(&auth);
 }
 
-static ngx_str_t
-get_key_header (ngx_http_request_t* r, ngx_str_t header_name)
+// 统计鉴权结果、报告给熔断器并更新缓存，请求内鉴权和后台刷新共用
+static void
+ngx_http_private_image_auth_done(ngx_http_private_image_auth_t *auth)
 {
-	ngx_list_part_t *part = &r->headers_in.headers.part;
-	ngx_table_elt_t *header = part->elts;
-	ngx_str_t result = ngx_null_string;
-	unsigned int i = 0;
+	ngx_uint_t  i;
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_CALLS, 1);
+	ngx_http_private_image_record(NGX_HTTP_PRIVATE_IMAGE_HIST_AUTH, auth->usec);
 
-	for (;; i ++)
+	if (auth->rc == AUTHORIZE_ERROR)
 	{
-		if (i >= part->nelts)
+		ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_ERRORS, 1);
+	}
+
+	ngx_http_private_image_breaker_report(auth->pmcf, auth->log, auth->rc != AUTHORIZE_ERROR);
+
+	if (auth->nbatch)
+	{
+		if (auth->rc != AUTHORIZE_OK)
+		{
+			return;
+		}
+
+		// 与单个鉴权一致，有 uri 被拒绝时先删除旧的授权，再缓存通过的结果
+		for (i = 0; i < auth->nbatch; i++)
 		{
-			if ((part->next == NULL))
+			if (auth->rcs[i] == AUTHORIZE_FAIL)
 			{
+				ngx_http_private_image_cache_remove(auth->pmcf, &auth->token);
 				break;
 			}
-			part = part->next;
-			header = part->elts;
-			i = 0;
 		}
 
-		if (header[i].hash == 0)
+		for (i = 0; i < auth->nbatch; i++)
 		{
-			continue;
+			if (auth->rcs[i] == AUTHORIZE_OK)
+			{
+				ngx_http_private_image_cache_store(auth->pmcf, auth->log, &auth->token, &auth->uris[i], &auth->grants[i]);
+			}
 		}
 
-		if (0 == ngx_strncasecmp(header[i].key.data, header_name.data, header[i].key.len))
-		{
-			return header[i].value;
-		}
+		return;
+	}
+
+	if (auth->rc == AUTHORIZE_OK)
+	{
+		ngx_http_private_image_cache_store(auth->pmcf, auth->log, &auth->token, &auth->uri, &auth->grant);
+	}
+	else if (auth->rc == AUTHORIZE_FAIL)
+	{
+		// token 已经失效，删除缓存的旧授权
+		ngx_http_private_image_cache_remove(auth->pmcf, &auth->token);
+	}
+}
+
+// 在后台刷新即将过期的授权，当前请求直接使用旧的授权，不等待刷新的结果。
+// 有线程池时在线程中请求鉴权服务，否则只能在当前请求中同步完成
+static void
+ngx_http_private_image_refresh(ngx_http_request_t *r, ngx_str_t *header_val)
+{
+	ngx_pool_t                     *pool;
+	ngx_http_private_image_auth_t  *auth;
+#if (NGX_THREADS)
+	ngx_thread_task_t              *task;
+#endif
+
+	if (ngx_http_private_image_breaker_allow(r) != NGX_OK)
+	{
+		return;
+	}
+
+	// 刷新可能比请求结束得晚，使用单独的内存池
+	pool = ngx_create_pool(1024, ngx_cycle->log);
+	if (pool == NULL)
+	{
+		return;
+	}
+
+#if (NGX_THREADS)
+	task = ngx_thread_task_alloc(pool, sizeof(ngx_http_private_image_auth_t));
+	if (task == NULL)
+	{
+		ngx_destroy_pool(pool);
+		return;
+	}
+
+	auth = task->ctx;
+#else
+	auth = ngx_palloc(pool, sizeof(ngx_http_private_image_auth_t));
+	if (auth == NULL)
+	{
+		ngx_destroy_pool(pool);
+		return;
+	}
+#endif
+
+	if (ngx_http_private_image_auth_init(r, pool, header_val, auth) != NGX_OK)
+	{
+		ngx_destroy_pool(pool);
+		return;
+	}
+
+	auth->log = ngx_cycle->log;
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_CACHE_REFRESHES, 1);
+
+#if (NGX_THREADS)
+	task->handler = ngx_http_private_image_refresh_thread;
+	task->event.data = auth;
+	task->event.handler = ngx_http_private_image_refresh_done;
+
+	if (ngx_thread_task_post(auth->pmcf->refresh_pool, task) == NGX_OK)
+	{
+		return;
+	}
+
+	// 线程池队列已满，放弃这次刷新，之后的请求会重新发起
+	ngx_destroy_pool(pool);
+#else
+	check_authorize(auth);
+	ngx_http_private_image_auth_done(auth);
+	ngx_destroy_pool(pool);
+#endif
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_private_image_refresh_thread(void *data, ngx_log_t *log)
+{
+	ngx_http_private_image_auth_t *auth = data;
+
+	check_authorize(auth);
+}
+
+static void
+ngx_http_private_image_refresh_done(ngx_event_t *ev)
+{
+	ngx_http_private_image_auth_t *auth = ev->data;
+
+	ngx_http_private_image_auth_done(auth);
+	ngx_destroy_pool(auth->pool);
+}
+
+#endif
+
+// 所有 worker 的鉴权耗时分位数（微秒），每个 worker 每秒最多重新计算一次，样本不足时返回 -1
+static ngx_int_t
+ngx_http_private_image_auth_percentile(ngx_http_private_image_pcache_t *pc, ngx_uint_t p)
+{
+	if (pc->updated == 0 || pc->p != p || ngx_current_msec - pc->updated >= 1000)
+	{
+		pc->value = ngx_http_private_image_percentile(NGX_HTTP_PRIVATE_IMAGE_HIST_AUTH, p,
+		                                              NGX_HTTP_PRIVATE_IMAGE_ADAPTIVE_SAMPLES);
+		pc->p = p;
+		pc->updated = ngx_current_msec;
+	}
+
+	return pc->value;
+}
+
+// 鉴权请求的总超时。开启自适应超时后取最近鉴权耗时 p99 的若干倍，
+// 鉴权服务正常时可以尽早放弃卡住的请求
+static ngx_msec_t
+ngx_http_private_image_auth_timeout(ngx_http_private_image_loc_conf_t *plcf)
+{
+	static ngx_http_private_image_pcache_t  pc;
+	ngx_int_t                               p99;
+	ngx_msec_t                              timeout;
+
+	if (!plcf->auth_adaptive_timeout)
+	{
+		return plcf->auth_timeout;
+	}
+
+	p99 = ngx_http_private_image_auth_percentile(&pc, 99000);
+	if (p99 < 0)
+	{
+		return plcf->auth_timeout;
+	}
+
+	timeout = (ngx_msec_t) (p99 * NGX_HTTP_PRIVATE_IMAGE_ADAPTIVE_FACTOR + 999) / 1000;
+	timeout = ngx_max(timeout, NGX_HTTP_PRIVATE_IMAGE_ADAPTIVE_MIN);
+
+	return ngx_min(timeout, plcf->auth_timeout);
+}
+
+// 对冲延迟：固定值，或者最近鉴权耗时的某个分位数；样本不足时不对冲
+static ngx_msec_t
+ngx_http_private_image_hedge_delay(ngx_http_private_image_loc_conf_t *plcf)
+{
+	static ngx_http_private_image_pcache_t  pc;
+	ngx_int_t                               usec;
+
+	if (plcf->hedge_percentile == 0)
+	{
+		return plcf->hedge_delay;
+	}
+
+	usec = ngx_http_private_image_auth_percentile(&pc, plcf->hedge_percentile);
+	if (usec < 0)
+	{
+		return 0;
+	}
+
+	return ngx_max((ngx_msec_t) (usec + 999) / 1000, 1);
+}
+
+// 创建一个鉴权请求的 curl 句柄，响应内容写入 response
+static CURL *
+ngx_http_private_image_auth_handle(ngx_http_private_image_auth_t *auth, ngx_http_private_image_peer_t *peer, struct curl_slist *header, ngx_str_t *response)
+{
+	CURL *curl;
+
+	curl = ngx_http_private_image_curl_get();
+	if (curl == NULL)
+	{
+		return NULL;
+	}
+
+	// set request url and set response，配置中的字符串以 '\0' 结尾
+	curl_easy_setopt(curl, CURLOPT_URL, (char *) peer->url.data);
+
+	if (peer->unix_path.len)
+	{
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, (char *) peer->unix_path.data);
 	}
 
-	return result;
+	// 鉴权服务卡住时不能让 worker 一直等待；毫秒级超时需要关闭 curl 的信号处理
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long) auth->connect_timeout);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long) auth->timeout);
+
+	/* curl_easy_setopt(curl, CURLOPT_HEADER, 1); */
+
+	/* Now specify we want to POST data */
+	curl_easy_setopt(curl, CURLOPT_POST, 1);
+
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, auth->post_field);
+
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, getResponse);
+
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+
+	// set request headers
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header);
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "POST");
+
+	return curl;
+}
+
+// 解析鉴权服务的响应，结果保存在 auth->rc 和 auth->grant 中
+static void
+ngx_http_private_image_auth_parse(ngx_http_private_image_auth_t *auth, CURL *curl, CURLcode curl_code, ngx_str_t *response)
+{
+	long                             http_code;
+	int                              i;
+	cJSON                           *parse, *results, *item;
+	ngx_log_t                       *log = auth->log;
+	ngx_http_private_image_grant_t  *grant = &auth->grant;
+
+	auth->rc = AUTHORIZE_ERROR;
+
+	http_code = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+	if (curl_code != CURLE_OK)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0, "private image auth request failed: %s", curl_easy_strerror(curl_code));
+		return;
+	}
+
+	if (http_code >= 500)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0, "private image auth server returned %l", http_code);
+		return;
+	}
+
+	if (response->data == NULL)
+	{
+		return;
+	}
+
+	// get response json and check
+	parse = cJSON_Parse((char *)response->data);
+
+	if (auth->nbatch == 0)
+	{
+		auth->rc = ngx_http_private_image_auth_verdict(auth->pool, parse, grant);
+		cJSON_Delete(parse);
+		return;
+	}
+
+	// 批量鉴权的响应 {"results":[...]}，每一项与单个鉴权的响应相同，顺序与请求中的 uri 一致
+	results = cJSON_GetObjectItem(parse, "results");
+	if (!cJSON_IsArray(results) || cJSON_GetArraySize(results) != (int) auth->nbatch)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0, "private image auth server returned invalid batch response");
+		cJSON_Delete(parse);
+		return;
+	}
+
+	i = 0;
+	cJSON_ArrayForEach(item, results)
+	{
+		auth->rcs[i] = ngx_http_private_image_auth_verdict(auth->pool, item, &auth->grants[i]);
+		i++;
+	}
+
+	auth->rc = AUTHORIZE_OK;
+	cJSON_Delete(parse);
+}
+
+// 解析一个鉴权结果，授权信息分配在 pool 中；无法解析时返回 AUTHORIZE_ERROR
+static ngx_int_t
+ngx_http_private_image_auth_verdict(ngx_pool_t *pool, cJSON *parse, ngx_http_private_image_grant_t *grant)
+{
+	cJSON  *status, *item;
+
+	status = cJSON_GetObjectItem(parse, "status");
+	if (cJSON_IsString(status) && ngx_strcmp(status->valuestring, "200") == 0)
+	{
+		get_user_id(pool, cJSON_GetObjectItem(parse, "user_id"), &grant->user_id);
+
+		// 授权范围和有效期，用于缓存鉴权结果
+		item = cJSON_GetObjectItem(parse, "prefix");
+		if (cJSON_IsString(item) && item->valuestring[0] == '/')
+		{
+			grant->prefix.len = ngx_strlen(item->valuestring);
+			grant->prefix.data = ngx_pnalloc(pool, grant->prefix.len);
+			if (grant->prefix.data == NULL)
+			{
+				grant->prefix.len = 0;
+			}
+			else
+			{
+				ngx_memcpy(grant->prefix.data, item->valuestring, grant->prefix.len);
+			}
+		}
+
+		item = cJSON_GetObjectItem(parse, "ttl");
+		if (cJSON_IsNumber(item) && item->valuedouble >= 0)
+		{
+			grant->ttl = (time_t) item->valuedouble;
+		}
+
+		return AUTHORIZE_OK;
+	}
+
+	return (parse != NULL) ? AUTHORIZE_FAIL : AUTHORIZE_ERROR;
+}
+
+// 请求鉴权服务，结果保存在 auth->rc 和 auth->grant 中。
+// 后台刷新时在线程池中执行，不能访问请求和 nginx 的事件循环
+static void
+check_authorize(ngx_http_private_image_auth_t *auth)
+{
+	ngx_str_t          response = ngx_null_string;
+	ngx_uint_t         first;
+	ngx_http_private_image_peer_t *peers;
+	ngx_int_t          start;
+	CURLcode           curl_code;
+	CURL              *curl;
+	struct curl_slist *header = NULL;
+
+	start = ngx_http_private_image_usec();
+
+	auth->rc = AUTHORIZE_ERROR;
+	auth->grant.ttl = -1;
+
+	// 多个鉴权服务地址时轮流使用
+	peers = auth->peers->elts;
+	first = (ngx_uint_t) ngx_atomic_fetch_add(&ngx_http_private_image_peer, 1) % auth->peers->nelts;
+
+	if (auth->protocol == NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_BINARY)
+	{
+		if (auth->nbatch)
+		{
+			if (ngx_http_private_image_binary_auth(&peers[first], auth->log, auth->pool, auth->connect_timeout,
+			                                       auth->timeout, &auth->token, auth->uris, auth->nbatch,
+			                                       auth->rcs, auth->grants)
+			    == NGX_OK)
+			{
+				auth->rc = AUTHORIZE_OK;
+			}
+		}
+		else if (ngx_http_private_image_binary_auth(&peers[first], auth->log, auth->pool, auth->connect_timeout,
+		                                            auth->timeout, &auth->token, &auth->uri, 1,
+		                                            &auth->rc, &auth->grant)
+		         != NGX_OK)
+		{
+			auth->rc = AUTHORIZE_ERROR;
+		}
+
+		goto done;
+	}
+
+	// set header key
+	header = curl_slist_append(header, auth->header);
+	if (header == NULL)
+	{
+		goto done;
+	}
+
+	if (auth->hedge_delay && auth->peers->nelts > 1)
+	{
+		ngx_http_private_image_auth_hedged(auth, &peers[first], &peers[(first + 1) % auth->peers->nelts], header);
+		goto done;
+	}
+
+	curl = ngx_http_private_image_auth_handle(auth, &peers[first], header, &response);
+	if (curl)
+	{
+		curl_code = curl_easy_perform(curl);
+		ngx_http_private_image_auth_parse(auth, curl, curl_code, &response);
+
+		free(response.data);
+
+		ngx_http_private_image_curl_free(curl);
+	}
+
+done:
+
+	curl_slist_free_all(header);
+
+	auth->usec = ngx_http_private_image_usec() - start;
+}
+
+// 对冲请求：先向 first 发请求，hedge_delay 毫秒内没有结果时再向 second 发一个相同的请求，
+// 使用最先返回的有效结果；第一个请求很快出错时对冲请求相当于一次重试。
+// 对冲请求的数量受 hedge_rate 限制，避免放大鉴权服务的负载
+static void
+ngx_http_private_image_auth_hedged(ngx_http_private_image_auth_t *auth, ngx_http_private_image_peer_t *first, ngx_http_private_image_peer_t *second, struct curl_slist *header)
+{
+	int         running, left, i;
+	long        timeout;
+	ngx_int_t   start, elapsed;
+	ngx_uint_t  inflight, hedge;
+	ngx_str_t   response[2];
+	CURL       *curl[2];
+	CURLM      *multi;
+	CURLMsg    *msg;
+
+	// multi 句柄有自己的连接缓存，对冲请求的连接保存在这里
+	multi = ngx_http_private_image_multi_get();
+	if (multi == NULL)
+	{
+		return;
+	}
+
+	ngx_memzero(response, sizeof(response));
+	curl[1] = NULL;
+
+	curl[0] = ngx_http_private_image_auth_handle(auth, first, header, &response[0]);
+	if (curl[0] == NULL)
+	{
+		ngx_http_private_image_multi_free(multi);
+		return;
+	}
+
+	curl_multi_add_handle(multi, curl[0]);
+
+	start = ngx_http_private_image_usec();
+	inflight = 1;
+	// 0 表示还没有决定是否对冲，1 表示已经发出对冲请求，2 表示超过限额不再对冲
+	hedge = 0;
+
+	for ( ;; )
+	{
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+		{
+			if (msg->msg != CURLMSG_DONE)
+			{
+				continue;
+			}
+
+			i = (msg->easy_handle == curl[0]) ? 0 : 1;
+			inflight--;
+
+			ngx_http_private_image_auth_parse(auth, msg->easy_handle, msg->data.result, &response[i]);
+
+			if (auth->rc != AUTHORIZE_ERROR)
+			{
+				if (i == 1)
+				{
+					ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_HEDGE_WINS, 1);
+				}
+
+				goto finish;
+			}
+
+			// 出错时如果另一个请求还没有结束，继续等待它的结果
+			if (inflight == 0 && hedge != 0)
+			{
+				goto finish;
+			}
+		}
+
+		elapsed = (ngx_http_private_image_usec() - start) / 1000;
+
+		if (hedge == 0 && (inflight == 0 || elapsed >= (ngx_int_t) auth->hedge_delay))
+		{
+			if (ngx_http_private_image_hedge_take())
+			{
+				curl[1] = ngx_http_private_image_auth_handle(auth, second, header, &response[1]);
+				if (curl[1] == NULL)
+				{
+					goto finish;
+				}
+
+				curl_multi_add_handle(multi, curl[1]);
+				inflight++;
+				hedge = 1;
+
+				ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_AUTH_HEDGES, 1);
+				continue;
+			}
+
+			hedge = 2;
+		}
+
+		if (inflight == 0)
+		{
+			goto finish;
+		}
+
+		timeout = hedge ? 1000 : (long) ((ngx_int_t) auth->hedge_delay - elapsed);
+		curl_multi_wait(multi, NULL, 0, (int) ngx_max(timeout, 1), NULL);
+	}
+
+finish:
+
+	for (i = 0; i < 2; i++)
+	{
+		if (curl[i])
+		{
+			curl_multi_remove_handle(multi, curl[i]);
+			ngx_http_private_image_curl_free(curl[i]);
+		}
+
+		free(response[i].data);
+	}
+
+	ngx_http_private_image_multi_free(multi);
+}
+
+// 取一个缓存的 curl 句柄，清除上次设置的选项，但保留其中的连接
+static CURL *
+ngx_http_private_image_curl_get(void)
+{
+	CURL                                 *curl;
+	ngx_http_private_image_curl_cache_t  *cache = &ngx_http_private_image_curl_cache;
+
+	curl = NULL;
+
+	ngx_spinlock(&cache->lock, 1, 2048);
+
+	if (cache->neasy)
+	{
+		curl = cache->easy[--cache->neasy];
+	}
+
+	ngx_unlock(&cache->lock);
+
+	if (curl == NULL)
+	{
+		return curl_easy_init();
+	}
+
+	curl_easy_reset(curl);
+
+	return curl;
+}
+
+// 句柄放回缓存，缓存已满时关闭
+static void
+ngx_http_private_image_curl_free(CURL *curl)
+{
+	ngx_http_private_image_curl_cache_t  *cache = &ngx_http_private_image_curl_cache;
+
+	ngx_spinlock(&cache->lock, 1, 2048);
+
+	if (cache->neasy < NGX_HTTP_PRIVATE_IMAGE_CURL_CACHE)
+	{
+		cache->easy[cache->neasy++] = curl;
+		curl = NULL;
+	}
+
+	ngx_unlock(&cache->lock);
+
+	if (curl)
+	{
+		curl_easy_cleanup(curl);
+	}
+}
+
+static CURLM *
+ngx_http_private_image_multi_get(void)
+{
+	CURLM                                *multi;
+	ngx_http_private_image_curl_cache_t  *cache = &ngx_http_private_image_curl_cache;
+
+	multi = NULL;
+
+	ngx_spinlock(&cache->lock, 1, 2048);
+
+	if (cache->nmulti)
+	{
+		multi = cache->multi[--cache->nmulti];
+	}
+
+	ngx_unlock(&cache->lock);
+
+	return multi ? multi : curl_multi_init();
+}
+
+static void
+ngx_http_private_image_multi_free(CURLM *multi)
+{
+	ngx_http_private_image_curl_cache_t  *cache = &ngx_http_private_image_curl_cache;
+
+	ngx_spinlock(&cache->lock, 1, 2048);
+
+	if (cache->nmulti < NGX_HTTP_PRIVATE_IMAGE_CURL_CACHE)
+	{
+		cache->multi[cache->nmulti++] = multi;
+		multi = NULL;
+	}
+
+	ngx_unlock(&cache->lock);
+
+	if (multi)
+	{
+		curl_multi_cleanup(multi);
+	}
+}
+
+// 每次鉴权按 hedge_rate 积累对冲额度，发出对冲请求时消耗一个，额度用千分之一个请求表示。
+// 后台刷新的线程也会调用，所以使用原子操作
+static void
+ngx_http_private_image_hedge_earn(ngx_uint_t rate)
+{
+	ngx_atomic_uint_t  budget;
+
+	budget = ngx_http_private_image_hedge_budget;
+
+	if (budget < NGX_HTTP_PRIVATE_IMAGE_HEDGE_BURST * 1000)
+	{
+		(void) ngx_atomic_fetch_add(&ngx_http_private_image_hedge_budget, rate * 10);
+	}
+}
+
+static ngx_uint_t
+ngx_http_private_image_hedge_take(void)
+{
+	ngx_atomic_uint_t  budget;
+
+	for ( ;; )
+	{
+		budget = ngx_http_private_image_hedge_budget;
+
+		if (budget < 1000)
+		{
+			return 0;
+		}
+
+		if (ngx_atomic_cmp_set(&ngx_http_private_image_hedge_budget, budget, budget - 1000))
+		{
+			return 1;
+		}
+	}
+}
+
+// private_image_auth_pass url|unix:/path.sock[:/uri] ...
+static char *
+ngx_http_private_image_auth_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_loc_conf_t *plcf = conf;
+	u_char                            *p, *last;
+	ngx_uint_t                         i;
+	ngx_str_t                         *value, uri;
+	ngx_http_private_image_peer_t     *peer;
+
+	if (plcf->auth_peers != NGX_CONF_UNSET_PTR)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	plcf->auth_peers = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_http_private_image_peer_t));
+	if (plcf->auth_peers == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	// 配置解析出的字符串以 '\0' 结尾，可以直接交给 curl
+	for (i = 1; i < cf->args->nelts; i++)
+	{
+		peer = ngx_array_push(plcf->auth_peers);
+		if (peer == NULL)
+		{
+			return NGX_CONF_ERROR;
+		}
+
+		if (ngx_strncmp(value[i].data, "unix:", 5) != 0)
+		{
+			peer->url = value[i];
+			ngx_str_null(&peer->unix_path);
+			peer->sockaddr = NULL;
+			peer->socklen = 0;
+			continue;
+		}
+
+		// 与 proxy_pass 的写法一致，套接字路径之后可以用 ':' 指定请求的 uri
+		p = value[i].data + 5;
+		last = value[i].data + value[i].len;
+
+		peer->unix_path.data = p;
+		peer->unix_path.len = last - p;
+		peer->sockaddr = NULL;
+		peer->socklen = 0;
+
+		ngx_str_set(&uri, "/");
+
+		p = ngx_strlchr(p, last, ':');
+		if (p)
+		{
+			peer->unix_path.len = p - peer->unix_path.data;
+			*p = '\0';
+
+			uri.data = p + 1;
+			uri.len = last - uri.data;
+		}
+
+		if (peer->unix_path.len == 0 || uri.len == 0 || uri.data[0] != '/')
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid auth address \"%V\"", &value[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		// 通过 unix 域套接字连接时 curl 仍然需要一个 http 地址，主机名只用于 Host 请求头
+		peer->url.len = sizeof("http://localhost") - 1 + uri.len;
+		peer->url.data = ngx_pnalloc(cf->pool, peer->url.len + 1);
+		if (peer->url.data == NULL)
+		{
+			return NGX_CONF_ERROR;
+		}
+
+		ngx_sprintf(peer->url.data, "http://localhost%V%Z", &uri);
+	}
+
+	return NGX_CONF_OK;
+}
+
+// private_image_auth_hedge off | delay=time|pNN [rate=N%]
+static char *
+ngx_http_private_image_auth_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_loc_conf_t *plcf = conf;
+	ngx_int_t                          n;
+	ngx_uint_t                         i;
+	ngx_str_t                         *value, s;
+
+	if (plcf->hedge_rate != NGX_CONF_UNSET_UINT)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	plcf->hedge_delay = 0;
+	plcf->hedge_percentile = 0;
+	plcf->hedge_rate = 10;
+
+	if (ngx_strcmp(value[1].data, "off") == 0)
+	{
+		return (cf->args->nelts == 2) ? NGX_CONF_OK : "has too many parameters";
+	}
+
+	for (i = 1; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "delay=p", 7) == 0)
+		{
+			// 分位数，例如 p95、p99.5
+			n = ngx_atofp(value[i].data + 7, value[i].len - 7, 3);
+			if (n <= 0 || n >= 100000)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid percentile \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			plcf->hedge_percentile = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "delay=", 6) == 0)
+		{
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			plcf->hedge_delay = ngx_parse_time(&s, 0);
+			if (plcf->hedge_delay == (ngx_msec_t) NGX_ERROR || plcf->hedge_delay == 0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid delay \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "rate=", 5) == 0)
+		{
+			s.data = value[i].data + 5;
+			s.len = value[i].len - 5;
+
+			if (s.len && s.data[s.len - 1] == '%')
+			{
+				s.len--;
+			}
+
+			n = ngx_atoi(s.data, s.len);
+			if (n <= 0 || n > 100)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			plcf->hedge_rate = n;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if (plcf->hedge_delay == 0 && plcf->hedge_percentile == 0)
+	{
+		return "requires \"delay\"";
+	}
+
+	return NGX_CONF_OK;
+}
+
+// 查找携带 token 的请求头：先比较解析请求头时已经算好的哈希，再比较长度和小写形式
+static ngx_str_t *
+ngx_http_private_image_token_header(ngx_http_request_t *r, ngx_http_private_image_loc_conf_t *plcf)
+{
+	ngx_uint_t        i;
+	ngx_list_part_t  *part;
+	ngx_table_elt_t  *header;
+
+	part = &r->headers_in.headers.part;
+	header = part->elts;
+
+	for (i = 0; /* void */; i++)
+	{
+		if (i >= part->nelts)
+		{
+			if (part->next == NULL)
+			{
+				break;
+			}
+
+			part = part->next;
+			header = part->elts;
+			i = 0;
+		}
+
+		if (header[i].hash != plcf->auth_header_hash
+		    || header[i].key.len != plcf->auth_header.len
+		    || ngx_memcmp(header[i].lowcase_key, plcf->auth_header_lc, plcf->auth_header.len) != 0)
+		{
+			continue;
+		}
+
+		return &header[i].value;
+	}
+
+	return NULL;
+}
+
+static ngx_int_t
+ngx_http_private_image_init(ngx_conf_t *cf)
+{
+	ngx_http_handler_pt        *h;
+	ngx_http_core_main_conf_t  *cmcf;
+
+	// 在 log 阶段统计发送的字节数
+	cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+	h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+	if (h == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	*h = ngx_http_private_image_log_handler;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_init_process(ngx_cycle_t *cycle)
+{
+	// 后台刷新会在多个线程中使用 curl，全局初始化不是线程安全的，需要提前完成
+	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+	{
+		ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "curl_global_init() failed");
+		return NGX_ERROR;
+	}
+
+	if (ngx_http_private_image_cache_init_process(cycle) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	if (ngx_http_private_image_file_init_process(cycle) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	return ngx_http_private_image_metrics_init_process(cycle);
+}
+
+// 保存鉴权缓存的快照，关闭缓存的 curl 句柄和其中的连接
+static void
+ngx_http_private_image_exit_process(ngx_cycle_t *cycle)
+{
+	ngx_http_private_image_curl_cache_t  *cache = &ngx_http_private_image_curl_cache;
+
+	ngx_http_private_image_cache_exit_process(cycle);
+
+	ngx_http_private_image_binary_exit_process();
+
+	while (cache->neasy)
+	{
+		curl_easy_cleanup(cache->easy[--cache->neasy]);
+	}
+
+	while (cache->nmulti)
+	{
+		curl_multi_cleanup(cache->multi[--cache->nmulti]);
+	}
+}
+
+static ngx_int_t
+ngx_http_private_image_log_handler(ngx_http_request_t *r)
+{
+	ngx_http_private_image_ctx_t  *ctx;
+
+	// 只统计由本模块处理的请求
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	if (ctx == NULL)
+	{
+		return NGX_OK;
+	}
+
+	ngx_http_private_image_count(NGX_HTTP_PRIVATE_IMAGE_BYTES_SENT, r->connection->sent);
+	ngx_http_private_image_record(NGX_HTTP_PRIVATE_IMAGE_HIST_TOTAL, ngx_http_private_image_usec() - ctx->start);
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_add_variables(ngx_conf_t *cf)
+{
+	ngx_http_variable_t  *var, *v;
+
+	for (v = ngx_http_private_image_vars; v->name.len; v++)
+	{
+		var = ngx_http_add_variable(cf, &v->name, v->flags);
+		if (var == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		var->get_handler = v->get_handler;
+		var->data = v->data;
+	}
+
+	return NGX_OK;
+}
+
+// 耗时以秒为单位输出，保留到微秒，与 $request_time 的格式保持一致
+static ngx_int_t
+ngx_http_private_image_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	u_char                        *p;
+	ngx_int_t                      usec;
+	ngx_http_private_image_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	if (ctx == NULL)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	usec = *(ngx_int_t *) ((char *) ctx + data);
+	if (usec < 0)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	p = ngx_pnalloc(r->pool, NGX_INT_T_LEN + sizeof(".000000") - 1);
+	if (p == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	v->len = ngx_sprintf(p, "%i.%06i", usec / 1000000, usec % 1000000) - p;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+	v->data = p;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_cache_status_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_http_private_image_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	if (ctx == NULL || ctx->cache_status == NGX_HTTP_PRIVATE_IMAGE_CACHE_NONE)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	v->len = ngx_http_private_image_cache_status[ctx->cache_status].len;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+	v->data = ngx_http_private_image_cache_status[ctx->cache_status].data;
+
+	return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_user_id_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+	ngx_http_private_image_ctx_t  *ctx;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_private_image_module);
+	if (ctx == NULL || ctx->user_id.len == 0)
+	{
+		v->not_found = 1;
+		return NGX_OK;
+	}
+
+	v->len = ctx->user_id.len;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+	v->data = ctx->user_id.data;
+
+	return NGX_OK;
 }
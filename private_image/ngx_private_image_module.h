@@ -0,0 +1,339 @@
+#ifndef _NGX_PRIVATE_IMAGE_MODULE_H_INCLUDED_
+#define _NGX_PRIVATE_IMAGE_MODULE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_private_image_probes.h"
+
+// 鉴权结果
+#define  AUTHORIZE_OK          0
+#define  AUTHORIZE_FAIL       -1
+// 鉴权服务出错（超时、连接失败、5xx 或者返回的内容无法解析），与鉴权不通过区分开
+#define  AUTHORIZE_ERROR      -2
+
+// 与鉴权服务通信的协议
+#define  NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_HTTP    0
+#define  NGX_HTTP_PRIVATE_IMAGE_PROTOCOL_BINARY  1
+
+// 鉴权缓存的命中状态，对应 $private_image_auth_cache_status
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_NONE      0
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT       1
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_MISS      2
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_STALE     3
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_BYPASS    4
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_UPDATING  5
+
+// 共享内存中的统计计数器
+#define  NGX_HTTP_PRIVATE_IMAGE_REQUESTS        0
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_CALLS      1
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_FAILURES   2
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_HITS      3
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_MISSES    4
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_EVICTIONS 5
+#define  NGX_HTTP_PRIVATE_IMAGE_OPEN_FAILURES   6
+#define  NGX_HTTP_PRIVATE_IMAGE_BYTES_SENT      7
+#define  NGX_HTTP_PRIVATE_IMAGE_LIMITED         8
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_ERRORS     9
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_REJECTED   10
+#define  NGX_HTTP_PRIVATE_IMAGE_STALE_SERVED    11
+#define  NGX_HTTP_PRIVATE_IMAGE_BREAKER_TRIPS   12
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_REFRESHES 13
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_HEDGES     14
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_HEDGE_WINS 15
+#define  NGX_HTTP_PRIVATE_IMAGE_AUTH_BATCHES    16
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_HITS      17
+#define  NGX_HTTP_PRIVATE_IMAGE_REVOCATIONS      18
+#define  NGX_HTTP_PRIVATE_IMAGE_CACHE_L1_HITS    19
+#define  NGX_HTTP_PRIVATE_IMAGE_MISSING_HITS    20
+#define  NGX_HTTP_PRIVATE_IMAGE_NOT_MODIFIED    21
+#define  NGX_HTTP_PRIVATE_IMAGE_FILE_CACHE_HITS 22
+#define  NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS       23
+
+// 鉴权服务熔断器的状态
+#define  NGX_HTTP_PRIVATE_IMAGE_BREAKER_CLOSED     0
+#define  NGX_HTTP_PRIVATE_IMAGE_BREAKER_OPEN       1
+#define  NGX_HTTP_PRIVATE_IMAGE_BREAKER_HALF_OPEN  2
+
+// 耗时直方图：鉴权往返、打开文件、整个请求
+#define  NGX_HTTP_PRIVATE_IMAGE_HIST_AUTH       0
+#define  NGX_HTTP_PRIVATE_IMAGE_HIST_OPEN       1
+#define  NGX_HTTP_PRIVATE_IMAGE_HIST_TOTAL      2
+#define  NGX_HTTP_PRIVATE_IMAGE_NHISTS          3
+
+// 对数-线性直方图（HdrHistogram 的分桶方式），单位微秒：
+// 每个 2 的幂区间再等分为 2^SUB_BITS 个子桶，相对误差不超过 1/2^SUB_BITS，
+// 超过 2^(MAX_EXP+1) 微秒（约 134 秒）的值计入最后一个桶
+#define  NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS   5
+#define  NGX_HTTP_PRIVATE_IMAGE_HIST_MAX_EXP    26
+#define  NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS                                  \
+	((NGX_HTTP_PRIVATE_IMAGE_HIST_MAX_EXP - NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS + 2) \
+	 << NGX_HTTP_PRIVATE_IMAGE_HIST_SUB_BITS)
+
+// 鉴权服务地址，字符串都以 '\0' 结尾，可以直接交给 curl
+typedef struct
+{
+	ngx_str_t  url;
+	// unix 域套接字的路径，为空表示使用 TCP
+	ngx_str_t  unix_path;
+	// 二进制协议直接连接的地址，配置解析时确定
+	struct sockaddr *sockaddr;
+	socklen_t        socklen;
+} ngx_http_private_image_peer_t;
+
+typedef struct
+{
+	// private_image_status 的输出格式
+	ngx_uint_t status_format;
+	// private_image_limit 引用的限流共享内存，NULL 表示不限流
+	ngx_shm_zone_t *limit_zone;
+	// 鉴权请求的连接超时和总超时
+	ngx_msec_t auth_connect_timeout;
+	ngx_msec_t auth_timeout;
+	// 根据鉴权耗时的 p99 自动缩短超时，auth_timeout 为上限
+	ngx_flag_t auth_adaptive_timeout;
+	// 鉴权服务地址（ngx_http_private_image_peer_t），多个地址时轮流使用
+	ngx_array_t *auth_peers;
+	// 鉴权协议，http 或者 binary
+	ngx_uint_t auth_protocol;
+	// 对冲请求的延迟：固定值或者鉴权耗时的分位数（千分之一百分点），都为 0 表示不对冲
+	ngx_msec_t hedge_delay;
+	ngx_uint_t hedge_percentile;
+	// 对冲请求占鉴权请求的最大比例（百分比）
+	ngx_uint_t hedge_rate;
+	// 批量鉴权的等待时间和每批最多的请求数，batch_window 为 0 表示不合并
+	ngx_msec_t batch_window;
+	ngx_uint_t batch_size;
+	// 携带 token 的请求头，小写形式和哈希在合并配置时计算
+	ngx_str_t auth_header;
+	u_char *auth_header_lc;
+	ngx_uint_t auth_header_hash;
+	// 鉴权请求中 uri 的字段名
+	ngx_str_t auth_field;
+	// 合并配置时拼好的 "WX-KEY:" 和 "source_url="，鉴权时只需要追加 token 和 uri
+	ngx_str_t auth_header_prefix;
+	ngx_str_t auth_field_prefix;
+	// 打开图片文件的线程池，NULL 表示在当前线程中打开
+	ngx_thread_pool_t *open_pool;
+} ngx_http_private_image_loc_conf_t;
+
+typedef struct
+{
+	// private_image_zone 定义的统计共享内存
+	ngx_shm_zone_t *shm_zone;
+	// private_image_top_zone 定义的热点用户和 token 统计共享内存
+	ngx_shm_zone_t *top_zone;
+	// private_image_auth_cache 定义的鉴权结果缓存
+	ngx_shm_zone_t *cache_zone;
+#if (NGX_THREADS)
+	// 鉴权结果后台刷新使用的线程池
+	ngx_thread_pool_t *refresh_pool;
+#endif
+	// 鉴权服务推送的 token 表文件
+	ngx_str_t token_table;
+	// 熔断器参数：窗口内失败率达到 breaker_threshold（百分比，0 表示关闭）
+	// 且请求数不少于 breaker_requests 时熔断 breaker_open 毫秒
+	ngx_uint_t breaker_threshold;
+	ngx_uint_t breaker_requests;
+	ngx_msec_t breaker_window;
+	ngx_msec_t breaker_open;
+	// 不存在的图片路径的负缓存：每个 worker 的槽数（0 表示关闭）和有效期
+	ngx_uint_t missing_size;
+	time_t     missing_valid;
+	// private_image_file_cache 定义的小文件内容缓存
+	ngx_shm_zone_t *file_zone;
+} ngx_http_private_image_main_conf_t;
+
+// 鉴权服务返回的授权信息
+typedef struct
+{
+	ngx_str_t  user_id;
+	// 授权覆盖的 uri 前缀，为空表示只授权当前 uri
+	ngx_str_t  prefix;
+	// 授权的有效期（秒），-1 表示鉴权服务没有指定
+	time_t     ttl;
+} ngx_http_private_image_grant_t;
+
+typedef struct ngx_http_private_image_batch_s  ngx_http_private_image_batch_t;
+
+typedef struct ngx_http_private_image_open_s  ngx_http_private_image_open_t;
+
+// 请求上下文，记录各阶段耗时（微秒，-1 表示未执行该阶段）等信息，供变量读取
+typedef struct
+{
+	// 进入 handler 时的时间戳，用于统计整个请求的耗时
+	ngx_int_t  start;
+	ngx_int_t  auth_time;
+	ngx_int_t  open_time;
+	ngx_uint_t cache_status;
+	ngx_str_t  user_id;
+	ngx_str_t  token;
+	// 缓存中的授权，命中或者 stale_if_error 时使用
+	ngx_http_private_image_grant_t  cached;
+	// 等待批量鉴权时所在的批次和位置，请求提前结束时从批次中移除
+	ngx_http_private_image_batch_t *batch;
+	ngx_uint_t                      batch_index;
+	// 在线程池中打开文件时的任务
+	ngx_http_private_image_open_t  *open;
+	// 从文件缓存中取到的图片内容，data 为 NULL 表示发送文件
+	ngx_str_t                       image;
+} ngx_http_private_image_ctx_t;
+
+// 每个 worker 独占一个统计槽，按缓存行对齐，更新时不会和其他 worker 争抢同一缓存行
+typedef struct
+{
+	ngx_atomic_t sum;
+	ngx_atomic_t max;
+	ngx_atomic_t buckets[NGX_HTTP_PRIVATE_IMAGE_HIST_BUCKETS];
+} ngx_http_private_image_hist_t;
+
+typedef struct
+{
+	ngx_atomic_t counters[NGX_HTTP_PRIVATE_IMAGE_NCOUNTERS];
+	ngx_http_private_image_hist_t hists[NGX_HTTP_PRIVATE_IMAGE_NHISTS];
+} ngx_http_private_image_slot_t;
+
+// 熔断器状态，所有 worker 共享，用原子操作更新
+typedef struct
+{
+	ngx_atomic_t state;
+	// 当前统计窗口的起始时间和窗口内的鉴权次数、失败次数
+	ngx_atomic_t window_start;
+	ngx_atomic_t requests;
+	ngx_atomic_t failures;
+	// 熔断开始的时间
+	ngx_atomic_t opened;
+	// 半开状态下探测请求的开始时间，0 表示没有探测请求
+	ngx_atomic_t probe;
+} ngx_http_private_image_breaker_t;
+
+typedef struct
+{
+	time_t                            start;
+	ngx_http_private_image_breaker_t  breaker;
+	ngx_uint_t                        nslots;
+	size_t                            stride;
+	u_char                           *slots;
+} ngx_http_private_image_shctx_t;
+
+typedef struct
+{
+	ngx_http_private_image_shctx_t *sh;
+	ngx_slab_pool_t                *shpool;
+	ngx_cycle_t                    *cycle;
+} ngx_http_private_image_zone_ctx_t;
+
+// 单调时钟的微秒时间戳，CLOCK_MONOTONIC 走 vDSO，不会陷入内核
+static ngx_inline ngx_int_t
+ngx_http_private_image_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ngx_int_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 是否为处理请求的进程。cache manager 和 cache loader 也会调用 init_process，
+// 其中 ngx_worker 同样为 0，不能只靠 ngx_worker 区分
+static ngx_inline ngx_uint_t
+ngx_http_private_image_is_worker(void)
+{
+	return ngx_process == NGX_PROCESS_WORKER || ngx_process == NGX_PROCESS_SINGLE;
+}
+
+// 64 位哈希，用于 token 和用户 ID 的快速比较，避免保存原始 token
+static ngx_inline uint64_t
+ngx_http_private_image_hash(u_char *data, size_t len)
+{
+	return ((uint64_t) ngx_murmur_hash2(data, len) << 32) | ngx_crc32_long(data, len);
+}
+
+ngx_int_t ngx_http_private_image_parse_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_str_t *name, ssize_t *size);
+
+char *ngx_http_private_image_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+char *ngx_http_private_image_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_private_image_metrics_init_process(ngx_cycle_t *cycle);
+
+void ngx_http_private_image_count(ngx_uint_t counter, ngx_atomic_int_t n);
+
+void ngx_http_private_image_record(ngx_uint_t hist, ngx_int_t usec);
+
+ngx_int_t ngx_http_private_image_percentile(ngx_uint_t hist, ngx_uint_t p, ngx_atomic_uint_t min);
+
+struct cJSON;
+
+char *ngx_http_private_image_top_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+void ngx_http_private_image_top_update(ngx_http_request_t *r, ngx_str_t *token, ngx_str_t *user_id);
+
+ngx_int_t ngx_http_private_image_top_json(ngx_http_request_t *r, struct cJSON *root);
+
+ngx_buf_t *ngx_http_private_image_top_prometheus(ngx_http_request_t *r);
+
+char *ngx_http_private_image_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+char *ngx_http_private_image_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_private_image_limit_check(ngx_http_request_t *r, ngx_str_t *token, ngx_str_t *user_id);
+
+char *ngx_http_private_image_auth_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_uint_t ngx_http_private_image_cache_lookup(ngx_http_request_t *r, ngx_str_t *token, ngx_http_private_image_grant_t *grant, ngx_uint_t *refresh);
+
+void ngx_http_private_image_cache_store(ngx_http_private_image_main_conf_t *pmcf, ngx_log_t *log, ngx_str_t *token, ngx_str_t *uri, ngx_http_private_image_grant_t *grant);
+
+ngx_uint_t ngx_http_private_image_cache_remove(ngx_http_private_image_main_conf_t *pmcf, ngx_str_t *token);
+
+ngx_int_t ngx_http_private_image_cache_init_process(ngx_cycle_t *cycle);
+
+void ngx_http_private_image_cache_exit_process(ngx_cycle_t *cycle);
+
+char *ngx_http_private_image_auth_revoke(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+char *ngx_http_private_image_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_private_image_breaker_allow(ngx_http_request_t *r);
+
+void ngx_http_private_image_breaker_report(ngx_http_private_image_main_conf_t *pmcf, ngx_log_t *log, ngx_uint_t ok);
+
+char *ngx_http_private_image_token_table(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_private_image_table_lookup(ngx_http_request_t *r, ngx_str_t *token, ngx_http_private_image_grant_t *grant);
+
+char *ngx_http_private_image_auth_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_private_image_batch_add(ngx_http_request_t *r, ngx_str_t *token);
+
+void ngx_http_private_image_authorize_batch(ngx_http_request_t **requests, ngx_uint_t n, ngx_pool_t *pool, ngx_str_t *header_val, ngx_int_t *rcs, ngx_http_private_image_grant_t *grants);
+
+ngx_int_t ngx_http_private_image_access(ngx_http_request_t *r, ngx_int_t rc, ngx_http_private_image_grant_t *grant);
+
+ngx_int_t ngx_http_private_image_binary_peer(ngx_conf_t *cf, ngx_http_private_image_peer_t *peer);
+
+ngx_int_t ngx_http_private_image_binary_auth(ngx_http_private_image_peer_t *peer, ngx_log_t *log, ngx_pool_t *pool, ngx_msec_t connect_timeout, ngx_msec_t timeout, ngx_str_t *token, ngx_str_t *uris, ngx_uint_t n, ngx_int_t *rcs, ngx_http_private_image_grant_t *grants);
+
+void ngx_http_private_image_binary_exit_process(void);
+
+char *ngx_http_private_image_open_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+char *ngx_http_private_image_file_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+char *ngx_http_private_image_missing_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+ngx_int_t ngx_http_private_image_file_init_process(ngx_cycle_t *cycle);
+
+ngx_int_t ngx_http_private_image_open(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+
+ngx_int_t ngx_http_private_image_content_type(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+
+ngx_buf_t *ngx_http_private_image_file_body(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+
+ngx_int_t ngx_http_private_image_send_file(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of, ngx_int_t rc);
+
+extern ngx_module_t ngx_http_private_image_module;
+
+#endif /* _NGX_PRIVATE_IMAGE_MODULE_H_INCLUDED_ */
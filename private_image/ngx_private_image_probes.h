@@ -0,0 +1,48 @@
+#ifndef _NGX_PRIVATE_IMAGE_PROBES_H_INCLUDED_
+#define _NGX_PRIVATE_IMAGE_PROBES_H_INCLUDED_
+
+// USDT 静态探针，provider 为 private_image。
+// 编译时设置 NGX_PRIVATE_IMAGE_USDT=yes 才会启用，探针本身只是一条 nop 指令，
+// 没有挂载 bpftrace / SystemTap 时没有额外开销；未启用时展开为空语句。
+//
+// 例如统计鉴权耗时分布：
+// bpftrace -e 'usdt:/usr/local/nginx/sbin/nginx:private_image:auth__end { @us = hist(arg1); }'
+
+#if (NGX_HTTP_PRIVATE_IMAGE_USDT)
+
+#include <sys/sdt.h>
+
+// arg0: uri, arg1: uri 长度
+#define ngx_http_private_image_probe_auth_start(r)                            \
+	DTRACE_PROBE2(private_image, auth__start, (r)->uri.data, (r)->uri.len)
+
+// arg0: 鉴权结果（0 成功，-1 失败），arg1: 耗时（微秒）
+#define ngx_http_private_image_probe_auth_end(r, rc, usec)                    \
+	DTRACE_PROBE2(private_image, auth__end, (long) (rc), (long) (usec))
+
+// arg0: 缓存状态（NGX_HTTP_PRIVATE_IMAGE_CACHE_HIT 等）
+#define ngx_http_private_image_probe_cache_lookup(r, status)                  \
+	DTRACE_PROBE1(private_image, cache__lookup, (long) (status))
+
+// arg0: 文件路径，arg1: 返回值，arg2: errno，arg3: 耗时（微秒）
+#define ngx_http_private_image_probe_file_open(r, path, rc, err, usec)        \
+	DTRACE_PROBE4(private_image, file__open, (path)->data, (long) (rc),       \
+	              (long) (err), (long) (usec))
+
+// arg0: 响应状态码，arg1: 响应包体长度
+#define ngx_http_private_image_probe_send_header(r)                           \
+	DTRACE_PROBE2(private_image, send__header,                                \
+	              (long) (r)->headers_out.status,                             \
+	              (long) (r)->headers_out.content_length_n)
+
+#else
+
+#define ngx_http_private_image_probe_auth_start(r)
+#define ngx_http_private_image_probe_auth_end(r, rc, usec)
+#define ngx_http_private_image_probe_cache_lookup(r, status)
+#define ngx_http_private_image_probe_file_open(r, path, rc, err, usec)
+#define ngx_http_private_image_probe_send_header(r)
+
+#endif
+
+#endif /* _NGX_PRIVATE_IMAGE_PROBES_H_INCLUDED_ */
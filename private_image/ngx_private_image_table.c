@@ -0,0 +1,278 @@
+#include "ngx_private_image_module.h"
+#include "ngx_private_image_table.h"
+
+// 鉴权服务推送的 token 表：鉴权服务把有效的 token 写入一个文件，每个 worker 只读映射，
+// 查找时不需要请求鉴权服务，也不需要加锁。文件格式见 ngx_private_image_table.h。
+// 没有找到时继续使用缓存和鉴权服务
+
+// 读表时遇到写入方正在写的重试次数，超过后按未命中处理
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_RETRIES  4
+
+// 检查文件是否被替换的间隔
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_CHECK    1000
+
+typedef struct
+{
+	u_char           *addr;
+	size_t            size;
+	ngx_file_uniq_t   uniq;
+	ngx_msec_t        checked;
+} ngx_http_private_image_table_t;
+
+static void ngx_http_private_image_table_map(ngx_str_t *path, ngx_log_t *log);
+
+static ngx_int_t ngx_http_private_image_table_find(ngx_http_private_image_table_header_t *header, ngx_uint_t t, ngx_str_t *token, uint64_t key, ngx_http_private_image_table_slot_t *found);
+
+// 当前 worker 的映射
+static ngx_http_private_image_table_t  ngx_http_private_image_table;
+
+// private_image_token_table path
+char *
+ngx_http_private_image_token_table(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ngx_str_t                          *value;
+
+	if (pmcf->token_table.data)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	pmcf->token_table = value[1];
+
+	if (ngx_conf_full_name(cf->cycle, &pmcf->token_table, 0) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+// 查找 token，找到且授权覆盖当前 uri 时返回 NGX_OK，授权信息复制到请求的内存池
+ngx_int_t
+ngx_http_private_image_table_lookup(ngx_http_request_t *r, ngx_str_t *token, ngx_http_private_image_grant_t *grant)
+{
+	uint64_t                               key;
+	ngx_uint_t                             i;
+	ngx_int_t                              rc;
+	ngx_http_private_image_table_slot_t    slot;
+	ngx_http_private_image_table_header_t *header;
+	ngx_http_private_image_main_conf_t    *pmcf;
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+
+	if (pmcf->token_table.data == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	// 鉴权服务可能重新创建文件，定期检查
+	if (ngx_http_private_image_table.addr == NULL
+	    || ngx_current_msec - ngx_http_private_image_table.checked >= NGX_HTTP_PRIVATE_IMAGE_TABLE_CHECK)
+	{
+		ngx_http_private_image_table_map(&pmcf->token_table, r->connection->log);
+	}
+
+	if (ngx_http_private_image_table.addr == NULL)
+	{
+		return NGX_DECLINED;
+	}
+
+	header = (ngx_http_private_image_table_header_t *) ngx_http_private_image_table.addr;
+	key = ngx_http_private_image_table_key(token->data, token->len);
+
+	rc = NGX_DECLINED;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_TABLE_RETRIES; i++)
+	{
+		rc = ngx_http_private_image_table_find(header, header->active & 1, token, key, &slot);
+		if (rc != NGX_AGAIN)
+		{
+			break;
+		}
+	}
+
+	if (rc != NGX_OK)
+	{
+		return NGX_DECLINED;
+	}
+
+	if (slot.expire && slot.expire <= ngx_time())
+	{
+		return NGX_DECLINED;
+	}
+
+	if (slot.user_len > NGX_HTTP_PRIVATE_IMAGE_TABLE_USER_LEN
+	    || slot.prefix_len > NGX_HTTP_PRIVATE_IMAGE_TABLE_PREFIX_LEN)
+	{
+		return NGX_DECLINED;
+	}
+
+	if (slot.prefix_len
+	    && (r->uri.len < slot.prefix_len || ngx_memcmp(r->uri.data, slot.prefix, slot.prefix_len) != 0))
+	{
+		return NGX_DECLINED;
+	}
+
+	ngx_memzero(grant, sizeof(ngx_http_private_image_grant_t));
+	grant->ttl = -1;
+
+	if (slot.user_len)
+	{
+		grant->user_id.data = ngx_pnalloc(r->pool, slot.user_len);
+		if (grant->user_id.data == NULL)
+		{
+			return NGX_DECLINED;
+		}
+
+		ngx_memcpy(grant->user_id.data, slot.user_id, slot.user_len);
+		grant->user_id.len = slot.user_len;
+	}
+
+	return NGX_OK;
+}
+
+// 在第 t 张表中查找，结果复制到 found；写入方正在写这张表时返回 NGX_AGAIN
+static ngx_int_t
+ngx_http_private_image_table_find(ngx_http_private_image_table_header_t *header, ngx_uint_t t, ngx_str_t *token, uint64_t key, ngx_http_private_image_table_slot_t *found)
+{
+	uint64_t                              seq;
+	ngx_uint_t                            i, n, mask;
+	ngx_int_t                             rc;
+	ngx_http_private_image_table_slot_t  *slots;
+
+	seq = header->seq[t];
+	if (seq & 1)
+	{
+		return NGX_AGAIN;
+	}
+
+	ngx_memory_barrier();
+
+	slots = (ngx_http_private_image_table_slot_t *) (ngx_http_private_image_table.addr
+	        + sizeof(ngx_http_private_image_table_header_t)
+	        + t * header->nslots * sizeof(ngx_http_private_image_table_slot_t));
+
+	mask = header->nslots - 1;
+	rc = NGX_DECLINED;
+
+	for (i = 0, n = key & mask; i < header->max_probe; i++, n = (n + 1) & mask)
+	{
+		// key 相同时再比较长度和第二个哈希，排除 64 位哈希的冲突
+		if (slots[n].key == key && slots[n].token_len == token->len
+		    && slots[n].check == ngx_http_private_image_table_check(token->data, token->len))
+		{
+			*found = slots[n];
+			rc = NGX_OK;
+			break;
+		}
+
+		if (slots[n].key == 0)
+		{
+			break;
+		}
+	}
+
+	ngx_memory_barrier();
+
+	if (header->seq[t] != seq)
+	{
+		return NGX_AGAIN;
+	}
+
+	return rc;
+}
+
+// 映射 token 表文件；文件不存在或者格式不对时不使用，下次检查时再试
+static void
+ngx_http_private_image_table_map(ngx_str_t *path, ngx_log_t *log)
+{
+	u_char                                 *addr;
+	size_t                                  size;
+	ngx_fd_t                                fd;
+	ngx_file_info_t                         fi;
+	ngx_http_private_image_table_t         *tbl = &ngx_http_private_image_table;
+	ngx_http_private_image_table_header_t  *header;
+
+	tbl->checked = ngx_current_msec;
+
+	if (ngx_file_info(path->data, &fi) == NGX_FILE_ERROR)
+	{
+		if (tbl->addr)
+		{
+			ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "private image token table \"%V\" removed", path);
+			munmap(tbl->addr, tbl->size);
+			tbl->addr = NULL;
+		}
+
+		return;
+	}
+
+	// 文件没有被替换，映射继续有效，写入方对文件的修改直接可见
+	if (tbl->addr && ngx_file_uniq(&fi) == tbl->uniq && (size_t) ngx_file_size(&fi) == tbl->size)
+	{
+		return;
+	}
+
+	fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+	if (fd == NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%V\" failed", path);
+		return;
+	}
+
+	if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_fd_info_n " \"%V\" failed", path);
+		ngx_close_file(fd);
+		return;
+	}
+
+	size = (size_t) ngx_file_size(&fi);
+	addr = NULL;
+
+	if (size >= sizeof(ngx_http_private_image_table_header_t))
+	{
+		addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "mmap(\"%V\") failed", path);
+			addr = NULL;
+		}
+	}
+
+	ngx_close_file(fd);
+
+	if (addr == NULL)
+	{
+		return;
+	}
+
+	header = (ngx_http_private_image_table_header_t *) addr;
+
+	if (header->magic != NGX_HTTP_PRIVATE_IMAGE_TABLE_MAGIC
+	    || header->version != NGX_HTTP_PRIVATE_IMAGE_TABLE_VERSION
+	    || header->nslots == 0 || (header->nslots & (header->nslots - 1))
+	    || header->max_probe == 0 || header->max_probe > header->nslots
+	    || size < sizeof(ngx_http_private_image_table_header_t)
+	              + 2 * (size_t) header->nslots * sizeof(ngx_http_private_image_table_slot_t))
+	{
+		ngx_log_error(NGX_LOG_ERR, log, 0, "private image token table \"%V\" is invalid", path);
+		munmap(addr, size);
+		return;
+	}
+
+	if (tbl->addr)
+	{
+		munmap(tbl->addr, tbl->size);
+	}
+
+	tbl->addr = addr;
+	tbl->size = size;
+	tbl->uniq = ngx_file_uniq(&fi);
+
+	ngx_log_error(NGX_LOG_INFO, log, 0, "private image token table \"%V\" mapped, %uD slots, generation %uL",
+	              path, header->nslots, header->generation);
+}
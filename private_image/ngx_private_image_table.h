@@ -0,0 +1,76 @@
+#ifndef _NGX_PRIVATE_IMAGE_TABLE_H_INCLUDED_
+#define _NGX_PRIVATE_IMAGE_TABLE_H_INCLUDED_
+
+// 鉴权服务推送的 token 表的文件格式，模块和 tools/token_table.c 共用，只依赖标准类型。
+//
+// 文件由一个头部和两张大小相同的表组成，两张表轮流使用：写入方写不活跃的那张，
+// 写之前把这张表的 seq 加一（奇数表示正在写），写完再加一，然后切换 active 并增加 generation。
+// 读取方读表前后各读一次 seq，两次相同且为偶数时结果有效，不需要加锁。
+// 表使用线性探测，槽的位置为 key & (nslots - 1)，最多探测 max_probe 个槽。
+// key、check 和 token_len 都相同才认为是同一个 token，单独的 64 位哈希可能冲突
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_MAGIC    0x54544950  /* "PITT" */
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_VERSION  2
+
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_USER_LEN    32
+#define  NGX_HTTP_PRIVATE_IMAGE_TABLE_PREFIX_LEN  72
+
+typedef struct
+{
+	uint32_t           magic;
+	uint32_t           version;
+	// 每张表的槽数，2 的幂
+	uint32_t           nslots;
+	uint32_t           max_probe;
+	volatile uint64_t  generation;
+	volatile uint64_t  active;
+	volatile uint64_t  seq[2];
+	uint8_t            reserved[16];
+} ngx_http_private_image_table_header_t;
+
+// key 为 token 的 64 位 FNV-1a 哈希，0 表示空槽；check 为 token 的 32 位 FNV-1a 哈希；
+// expire 为过期的 unix 时间（秒），0 表示不过期；prefix 为授权的 uri 前缀，为空表示授权所有 uri
+typedef struct
+{
+	uint64_t  key;
+	int64_t   expire;
+	uint32_t  check;
+	uint16_t  token_len;
+	uint8_t   user_len;
+	uint8_t   prefix_len;
+	uint8_t   user_id[NGX_HTTP_PRIVATE_IMAGE_TABLE_USER_LEN];
+	uint8_t   prefix[NGX_HTTP_PRIVATE_IMAGE_TABLE_PREFIX_LEN];
+} ngx_http_private_image_table_slot_t;
+
+static inline uint64_t
+ngx_http_private_image_table_key(const uint8_t *data, size_t len)
+{
+	uint64_t  h = 0xcbf29ce484222325ULL;
+
+	while (len--)
+	{
+		h ^= *data++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h ? h : 1;
+}
+
+static inline uint32_t
+ngx_http_private_image_table_check(const uint8_t *data, size_t len)
+{
+	uint32_t  h = 0x811c9dc5;
+
+	while (len--)
+	{
+		h ^= *data++;
+		h *= 0x01000193;
+	}
+
+	return h;
+}
+
+#endif /* _NGX_PRIVATE_IMAGE_TABLE_H_INCLUDED_ */
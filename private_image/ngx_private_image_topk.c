@@ -0,0 +1,584 @@
+#include "ngx_private_image_module.h"
+#include "cJSON.h"
+
+// 热点统计：Count-Min sketch 估计每个 key 的请求数，再用一个小的 top-K 表
+// 保存估计值最大的 key。sketch 的更新是几次无锁的原子加，只有估计值超过
+// top-K 表中的最小值时才尝试加锁更新 top-K 表，拿不到锁就跳过，不会阻塞请求
+
+#define  NGX_HTTP_PRIVATE_IMAGE_TOP_USERS      0
+#define  NGX_HTTP_PRIVATE_IMAGE_TOP_TOKENS     1
+#define  NGX_HTTP_PRIVATE_IMAGE_NTOPS          2
+
+// sketch 的行数，每行使用不同的哈希函数
+#define  NGX_HTTP_PRIVATE_IMAGE_TOP_DEPTH      4
+#define  NGX_HTTP_PRIVATE_IMAGE_TOP_LABEL_LEN  32
+#define  NGX_HTTP_PRIVATE_IMAGE_TOP_MAX        256
+
+typedef struct
+{
+	uint64_t      key;
+	ngx_atomic_t  count;
+	size_t        len;
+	// 用户 ID，或 token 哈希的十六进制串，不保存原始 token
+	u_char        label[NGX_HTTP_PRIVATE_IMAGE_TOP_LABEL_LEN];
+} ngx_http_private_image_top_item_t;
+
+typedef struct
+{
+	// top-K 表已满时表中的最小计数，用于无锁判断是否需要更新 top-K 表
+	ngx_atomic_t                        min;
+	ngx_uint_t                          n;
+	ngx_http_private_image_top_item_t  *items;
+	ngx_atomic_t                       *sketch;
+} ngx_http_private_image_top_t;
+
+typedef struct
+{
+	// 上一次衰减的时间
+	ngx_atomic_t                  epoch;
+	ngx_uint_t                    width;
+	ngx_http_private_image_top_t  tops[NGX_HTTP_PRIVATE_IMAGE_NTOPS];
+} ngx_http_private_image_top_shctx_t;
+
+typedef struct
+{
+	ngx_http_private_image_top_shctx_t  *sh;
+	ngx_slab_pool_t                     *shpool;
+	ngx_uint_t                           k;
+	ngx_uint_t                           width;
+	time_t                               decay;
+} ngx_http_private_image_top_ctx_t;
+
+static ngx_int_t ngx_http_private_image_top_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+static void ngx_http_private_image_top_track(ngx_http_private_image_top_ctx_t *ctx, ngx_http_private_image_top_t *top, uint64_t key, u_char *label, size_t len);
+
+static void ngx_http_private_image_top_decay(ngx_http_private_image_top_ctx_t *ctx);
+
+static ngx_http_private_image_top_item_t *ngx_http_private_image_top_snapshot(ngx_http_request_t *r, ngx_http_private_image_top_ctx_t *ctx, ngx_uint_t which, ngx_uint_t *n);
+
+static int ngx_libc_cdecl ngx_http_private_image_top_cmp(const void *one, const void *two);
+
+static u_char *ngx_http_private_image_top_escape_label(u_char *dst, u_char *src, size_t size);
+
+static ngx_str_t ngx_http_private_image_top_names[] =
+{
+	ngx_string("users"),
+	ngx_string("tokens")
+};
+
+static ngx_str_t ngx_http_private_image_top_labels[] =
+{
+	ngx_string("user"),
+	ngx_string("token")
+};
+
+// private_image_top_zone name:size [top=N] [decay=time]
+char *
+ngx_http_private_image_top_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_private_image_main_conf_t *pmcf = conf;
+	ssize_t                             size;
+	ngx_int_t                           k;
+	ngx_uint_t                          i, width;
+	ngx_str_t                          *value, name, s;
+	ngx_http_private_image_top_ctx_t   *ctx;
+
+	if (pmcf->top_zone)
+	{
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if (ngx_http_private_image_parse_zone(cf, &value[1], &name, &size) != NGX_OK)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_private_image_top_ctx_t));
+	if (ctx == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	ctx->k = 32;
+	ctx->decay = 60;
+
+	for (i = 2; i < cf->args->nelts; i++)
+	{
+		if (ngx_strncmp(value[i].data, "top=", 4) == 0)
+		{
+			k = ngx_atoi(value[i].data + 4, value[i].len - 4);
+			if (k == NGX_ERROR || k == 0 || k > NGX_HTTP_PRIVATE_IMAGE_TOP_MAX)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid top value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			ctx->k = k;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data, "decay=", 6) == 0)
+		{
+			s.data = value[i].data + 6;
+			s.len = value[i].len - 6;
+
+			ctx->decay = ngx_parse_time(&s, 1);
+			if (ctx->decay == (time_t) NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid decay value \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	// sketch 的宽度取 2 的幂，占用共享内存的一半左右，其余留给 top-K 表和 slab 的开销
+	width = 256;
+	while (width * 2 * NGX_HTTP_PRIVATE_IMAGE_NTOPS * NGX_HTTP_PRIVATE_IMAGE_TOP_DEPTH * sizeof(ngx_atomic_t)
+	       <= (size_t) size / 2)
+	{
+		width *= 2;
+	}
+
+	if (width * NGX_HTTP_PRIVATE_IMAGE_NTOPS * NGX_HTTP_PRIVATE_IMAGE_TOP_DEPTH * sizeof(ngx_atomic_t)
+	    > (size_t) size / 2)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	ctx->width = width;
+
+	pmcf->top_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_private_image_module);
+	if (pmcf->top_zone == NULL)
+	{
+		return NGX_CONF_ERROR;
+	}
+
+	if (pmcf->top_zone->data)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+		return NGX_CONF_ERROR;
+	}
+
+	pmcf->top_zone->init = ngx_http_private_image_top_init_zone;
+	pmcf->top_zone->data = ctx;
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_private_image_top_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_http_private_image_top_ctx_t  *octx = data;
+	ngx_http_private_image_top_ctx_t  *ctx;
+	ngx_uint_t                         i;
+	size_t                             len;
+	ngx_http_private_image_top_t      *top;
+
+	ctx = shm_zone->data;
+
+	if (octx)
+	{
+		// top 或 sketch 宽度变化时沿用旧的布局
+		ctx->sh = octx->sh;
+		ctx->shpool = octx->shpool;
+		ctx->k = octx->k;
+		ctx->width = octx->width;
+		return NGX_OK;
+	}
+
+	ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists)
+	{
+		ctx->sh = ctx->shpool->data;
+		return NGX_OK;
+	}
+
+	ctx->sh = ngx_slab_calloc(ctx->shpool, sizeof(ngx_http_private_image_top_shctx_t));
+	if (ctx->sh == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ctx->shpool->data = ctx->sh;
+	ctx->sh->epoch = ngx_time();
+	ctx->sh->width = ctx->width;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NTOPS; i++)
+	{
+		top = &ctx->sh->tops[i];
+
+		top->items = ngx_slab_calloc(ctx->shpool, ctx->k * sizeof(ngx_http_private_image_top_item_t));
+		if (top->items == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		top->sketch = ngx_slab_calloc(ctx->shpool, NGX_HTTP_PRIVATE_IMAGE_TOP_DEPTH * ctx->width * sizeof(ngx_atomic_t));
+		if (top->sketch == NULL)
+		{
+			return NGX_ERROR;
+		}
+	}
+
+	len = sizeof(" in private_image_top zone \"\"") + shm_zone->shm.name.len;
+
+	ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+	if (ctx->shpool->log_ctx == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_sprintf(ctx->shpool->log_ctx, " in private_image_top zone \"%V\"%Z", &shm_zone->shm.name);
+
+	return NGX_OK;
+}
+
+// 每个请求调用一次，token 为请求头中的原始 token，user_id 为鉴权返回的用户 ID（可能为空）
+void
+ngx_http_private_image_top_update(ngx_http_request_t *r, ngx_str_t *token, ngx_str_t *user_id)
+{
+	time_t                               now;
+	uint64_t                             key;
+	ngx_atomic_uint_t                    epoch;
+	ngx_http_private_image_top_ctx_t    *ctx;
+	ngx_http_private_image_main_conf_t  *pmcf;
+	u_char                               label[16];
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->top_zone == NULL)
+	{
+		return;
+	}
+
+	ctx = pmcf->top_zone->data;
+
+	// 周期性地把所有计数减半，让统计结果反映最近的流量
+	if (ctx->decay)
+	{
+		now = ngx_time();
+		epoch = ctx->sh->epoch;
+
+		if (now - (time_t) epoch >= ctx->decay
+		    && ngx_atomic_cmp_set(&ctx->sh->epoch, epoch, (ngx_atomic_uint_t) now))
+		{
+			ngx_http_private_image_top_decay(ctx);
+		}
+	}
+
+	if (token->len)
+	{
+		key = ngx_http_private_image_hash(token->data, token->len);
+		ngx_hex_dump(label, (u_char *) &key, sizeof(uint64_t));
+
+		ngx_http_private_image_top_track(ctx, &ctx->sh->tops[NGX_HTTP_PRIVATE_IMAGE_TOP_TOKENS], key, label, sizeof(label));
+	}
+
+	if (user_id->len)
+	{
+		key = ngx_http_private_image_hash(user_id->data, user_id->len);
+
+		ngx_http_private_image_top_track(ctx, &ctx->sh->tops[NGX_HTTP_PRIVATE_IMAGE_TOP_USERS], key, user_id->data,
+		                                 ngx_min(user_id->len, NGX_HTTP_PRIVATE_IMAGE_TOP_LABEL_LEN));
+	}
+}
+
+static void
+ngx_http_private_image_top_track(ngx_http_private_image_top_ctx_t *ctx, ngx_http_private_image_top_t *top, uint64_t key, u_char *label, size_t len)
+{
+	uint32_t                            h1, h2;
+	ngx_uint_t                          i, m;
+	ngx_atomic_uint_t                   est, v;
+	ngx_http_private_image_top_item_t  *item;
+
+	// 双重哈希生成每一行的下标
+	h1 = (uint32_t) key;
+	h2 = (uint32_t) (key >> 32) | 1;
+	est = (ngx_atomic_uint_t) -1;
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_TOP_DEPTH; i++)
+	{
+		v = ngx_atomic_fetch_add(&top->sketch[i * ctx->width + ((h1 + i * h2) & (ctx->width - 1))], 1) + 1;
+		est = ngx_min(est, v);
+	}
+
+	if (top->n == ctx->k && est <= top->min)
+	{
+		return;
+	}
+
+	if (!ngx_shmtx_trylock(&ctx->shpool->mutex))
+	{
+		return;
+	}
+
+	item = NULL;
+
+	for (i = 0; i < top->n; i++)
+	{
+		if (top->items[i].key == key)
+		{
+			item = &top->items[i];
+			break;
+		}
+	}
+
+	if (item == NULL)
+	{
+		if (top->n < ctx->k)
+		{
+			item = &top->items[top->n++];
+		}
+		else
+		{
+			// 替换计数最小的项
+			m = 0;
+			for (i = 1; i < top->n; i++)
+			{
+				if (top->items[i].count < top->items[m].count)
+				{
+					m = i;
+				}
+			}
+
+			item = &top->items[m];
+		}
+
+		item->key = key;
+		item->len = len;
+		ngx_memcpy(item->label, label, len);
+	}
+
+	item->count = est;
+
+	if (top->n == ctx->k)
+	{
+		v = top->items[0].count;
+		for (i = 1; i < top->n; i++)
+		{
+			v = ngx_min(v, top->items[i].count);
+		}
+
+		top->min = v;
+	}
+
+	ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+// 衰减时与其他 worker 的原子加并发，可能丢失少量计数，对热点统计没有影响
+static void
+ngx_http_private_image_top_decay(ngx_http_private_image_top_ctx_t *ctx)
+{
+	ngx_uint_t                     i, j;
+	ngx_http_private_image_top_t  *top;
+
+	ngx_shmtx_lock(&ctx->shpool->mutex);
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NTOPS; i++)
+	{
+		top = &ctx->sh->tops[i];
+
+		for (j = 0; j < NGX_HTTP_PRIVATE_IMAGE_TOP_DEPTH * ctx->width; j++)
+		{
+			top->sketch[j] >>= 1;
+		}
+
+		for (j = 0; j < top->n; j++)
+		{
+			top->items[j].count >>= 1;
+		}
+
+		top->min >>= 1;
+	}
+
+	ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+static ngx_http_private_image_top_item_t *
+ngx_http_private_image_top_snapshot(ngx_http_request_t *r, ngx_http_private_image_top_ctx_t *ctx, ngx_uint_t which, ngx_uint_t *n)
+{
+	ngx_http_private_image_top_t       *top;
+	ngx_http_private_image_top_item_t  *items;
+
+	items = ngx_palloc(r->pool, ctx->k * sizeof(ngx_http_private_image_top_item_t));
+	if (items == NULL)
+	{
+		return NULL;
+	}
+
+	top = &ctx->sh->tops[which];
+
+	ngx_shmtx_lock(&ctx->shpool->mutex);
+
+	*n = top->n;
+	ngx_memcpy(items, top->items, top->n * sizeof(ngx_http_private_image_top_item_t));
+
+	ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+	ngx_qsort(items, *n, sizeof(ngx_http_private_image_top_item_t), ngx_http_private_image_top_cmp);
+
+	return items;
+}
+
+static int ngx_libc_cdecl
+ngx_http_private_image_top_cmp(const void *one, const void *two)
+{
+	const ngx_http_private_image_top_item_t *first = one;
+	const ngx_http_private_image_top_item_t *second = two;
+
+	if (first->count == second->count)
+	{
+		return 0;
+	}
+
+	return (first->count < second->count) ? 1 : -1;
+}
+
+ngx_int_t
+ngx_http_private_image_top_json(ngx_http_request_t *r, cJSON *root)
+{
+	ngx_uint_t                           i, j, n;
+	cJSON                               *top, *list, *item;
+	ngx_http_private_image_top_ctx_t    *ctx;
+	ngx_http_private_image_top_item_t   *items;
+	ngx_http_private_image_main_conf_t  *pmcf;
+	u_char                               label[NGX_HTTP_PRIVATE_IMAGE_TOP_LABEL_LEN + 1];
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	if (pmcf->top_zone == NULL)
+	{
+		return NGX_OK;
+	}
+
+	ctx = pmcf->top_zone->data;
+
+	top = cJSON_AddObjectToObject(root, "top");
+	if (top == NULL)
+	{
+		return NGX_ERROR;
+	}
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NTOPS; i++)
+	{
+		items = ngx_http_private_image_top_snapshot(r, ctx, i, &n);
+		if (items == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		list = cJSON_AddArrayToObject(top, (char *) ngx_http_private_image_top_names[i].data);
+		if (list == NULL)
+		{
+			return NGX_ERROR;
+		}
+
+		for (j = 0; j < n; j++)
+		{
+			item = cJSON_CreateObject();
+			if (item == NULL)
+			{
+				return NGX_ERROR;
+			}
+
+			cJSON_AddItemToArray(list, item);
+
+			ngx_memcpy(label, items[j].label, items[j].len);
+			label[items[j].len] = '\0';
+
+			cJSON_AddStringToObject(item, (char *) ngx_http_private_image_top_labels[i].data, (char *) label);
+			cJSON_AddNumberToObject(item, "count", (double) items[j].count);
+		}
+	}
+
+	return NGX_OK;
+}
+
+ngx_buf_t *
+ngx_http_private_image_top_prometheus(ngx_http_request_t *r)
+{
+	size_t                               len;
+	ngx_uint_t                           i, j, n;
+	ngx_buf_t                           *b;
+	ngx_http_private_image_top_ctx_t    *ctx;
+	ngx_http_private_image_top_item_t   *items;
+	ngx_http_private_image_main_conf_t  *pmcf;
+
+	pmcf = ngx_http_get_module_main_conf(r, ngx_http_private_image_module);
+	ctx = pmcf->top_zone->data;
+
+	len = NGX_HTTP_PRIVATE_IMAGE_NTOPS
+	      * (sizeof("# TYPE private_image_top_tokens_requests gauge" CRLF)
+	         + ctx->k * (sizeof("private_image_top_tokens_requests{token=\"\"} " CRLF)
+	                     + 2 * NGX_HTTP_PRIVATE_IMAGE_TOP_LABEL_LEN + NGX_ATOMIC_T_LEN));
+
+	b = ngx_create_temp_buf(r->pool, len);
+	if (b == NULL)
+	{
+		return NULL;
+	}
+
+	for (i = 0; i < NGX_HTTP_PRIVATE_IMAGE_NTOPS; i++)
+	{
+		items = ngx_http_private_image_top_snapshot(r, ctx, i, &n);
+		if (items == NULL)
+		{
+			return NULL;
+		}
+
+		b->last = ngx_sprintf(b->last, "# TYPE private_image_top_%V_requests gauge\n",
+		                      &ngx_http_private_image_top_names[i]);
+
+		for (j = 0; j < n; j++)
+		{
+			b->last = ngx_sprintf(b->last, "private_image_top_%V_requests{%V=\"",
+			                      &ngx_http_private_image_top_names[i],
+			                      &ngx_http_private_image_top_labels[i]);
+
+			// 用户 ID 来自鉴权服务，按 Prometheus 标签值的要求转义
+			b->last = ngx_http_private_image_top_escape_label(b->last, items[j].label, items[j].len);
+
+			b->last = ngx_sprintf(b->last, "\"} %uA\n", items[j].count);
+		}
+	}
+
+	return b;
+}
+
+// Prometheus 文本格式的标签值只需要转义反斜杠、双引号和换行，其他字节原样输出，
+// 与 JSON 输出中解码后的值相同
+static u_char *
+ngx_http_private_image_top_escape_label(u_char *dst, u_char *src, size_t size)
+{
+	while (size--)
+	{
+		switch (*src)
+		{
+		case '\\':
+		case '"':
+			*dst++ = '\\';
+			*dst++ = *src;
+			break;
+
+		case '\n':
+			*dst++ = '\\';
+			*dst++ = 'n';
+			break;
+
+		default:
+			*dst++ = *src;
+		}
+
+		src++;
+	}
+
+	return dst;
+}
@@ -0,0 +1,366 @@
+/*
+ * 二进制鉴权协议的参考实现，用于测试和压测 private_image_auth_protocol binary。
+ * 所有请求都返回相同的结果，协议格式见 ngx_private_image_binary.c。
+ *
+ * 编译：cc -O2 -o auth_stub private_image/tools/auth_stub.c
+ * 运行：./auth_stub -l 127.0.0.1:1324 [-u user_id] [-t ttl] [-p prefix] [-d]
+ *       ./auth_stub -l unix:/run/auth.sock
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define  MAX_CONNS   1024
+#define  MAX_FRAME   65536
+#define  BUF_SIZE    (MAX_FRAME * 2)
+
+typedef struct
+{
+	int     fd;
+	size_t  in_len;
+	size_t  out_pos;
+	size_t  out_len;
+	char    in[BUF_SIZE];
+	char    out[BUF_SIZE];
+} conn_t;
+
+static const char *user_id = "1";
+static const char *prefix = "/";
+static uint32_t    ttl = 60;
+static int         deny;
+
+static conn_t     *conns[MAX_CONNS];
+static struct pollfd pfds[MAX_CONNS + 1];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: auth_stub -l host:port|unix:path [-u user_id] [-t ttl] [-p prefix] [-d]\n");
+	exit(1);
+}
+
+static void
+put16(char *p, uint16_t v)
+{
+	p[0] = (char) (v >> 8);
+	p[1] = (char) v;
+}
+
+static void
+put32(char *p, uint32_t v)
+{
+	p[0] = (char) (v >> 24);
+	p[1] = (char) (v >> 16);
+	p[2] = (char) (v >> 8);
+	p[3] = (char) v;
+}
+
+static uint32_t
+get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *) p;
+
+	return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16) | ((uint32_t) u[2] << 8) | u[3];
+}
+
+static int
+listen_on(const char *addr)
+{
+	int                 fd, on;
+	char                host[256], *port;
+	struct sockaddr_un  sun;
+	struct sockaddr_in  sin;
+
+	if (strncmp(addr, "unix:", 5) == 0)
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1)
+		{
+			return -1;
+		}
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, addr + 5, sizeof(sun.sun_path) - 1);
+		unlink(sun.sun_path);
+
+		if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	else
+	{
+		snprintf(host, sizeof(host), "%s", addr);
+
+		port = strrchr(host, ':');
+		if (port == NULL)
+		{
+			usage();
+		}
+
+		*port++ = '\0';
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons((uint16_t) atoi(port));
+
+		if (inet_pton(AF_INET, host, &sin.sin_addr) != 1)
+		{
+			usage();
+		}
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1)
+		{
+			return -1;
+		}
+
+		on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (listen(fd, 511) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+// 处理缓冲区中所有完整的请求帧，响应追加到输出缓冲区，格式错误时返回 -1
+static int
+process(conn_t *c)
+{
+	char      *p;
+	size_t     pos, size, ulen, plen, reply;
+	uint32_t   id;
+
+	ulen = strlen(user_id);
+	plen = strlen(prefix);
+	reply = 4 + 4 + 1 + 4 + 2 + ulen + 2 + plen;
+	pos = 0;
+
+	while (c->in_len - pos >= 4)
+	{
+		size = get32(c->in + pos);
+		if (size < 8 || size > MAX_FRAME)
+		{
+			return -1;
+		}
+
+		if (c->in_len - pos < 4 + size)
+		{
+			break;
+		}
+
+		// 输出缓冲区不够时等待发送完再处理
+		if (c->out_len + reply > BUF_SIZE)
+		{
+			break;
+		}
+
+		id = get32(c->in + pos + 4);
+		pos += 4 + size;
+
+		p = c->out + c->out_len;
+		put32(p, (uint32_t) (reply - 4));
+		put32(p + 4, id);
+		p[8] = deny ? 1 : 0;
+		put32(p + 9, ttl);
+		put16(p + 13, (uint16_t) ulen);
+		memcpy(p + 15, user_id, ulen);
+		put16(p + 15 + ulen, (uint16_t) plen);
+		memcpy(p + 17 + ulen, prefix, plen);
+
+		c->out_len += reply;
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+
+	return 0;
+}
+
+static void
+close_conn(int i)
+{
+	close(conns[i]->fd);
+	free(conns[i]);
+	conns[i] = NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int         lfd, fd, i, opt, on;
+	ssize_t     n;
+	conn_t     *c;
+	const char *addr = NULL;
+
+	while ((opt = getopt(argc, argv, "l:u:t:p:d")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			addr = optarg;
+			break;
+		case 'u':
+			user_id = optarg;
+			break;
+		case 't':
+			ttl = (uint32_t) strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			prefix = optarg;
+			break;
+		case 'd':
+			deny = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (addr == NULL)
+	{
+		usage();
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = listen_on(addr);
+	if (lfd == -1)
+	{
+		perror("listen");
+		return 1;
+	}
+
+	for ( ;; )
+	{
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+
+		for (i = 0; i < MAX_CONNS; i++)
+		{
+			pfds[i + 1].fd = conns[i] ? conns[i]->fd : -1;
+			pfds[i + 1].events = 0;
+
+			if (conns[i])
+			{
+				pfds[i + 1].events = (conns[i]->out_len > conns[i]->out_pos) ? POLLOUT : POLLIN;
+			}
+		}
+
+		if (poll(pfds, MAX_CONNS + 1, -1) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			perror("poll");
+			return 1;
+		}
+
+		if (pfds[0].revents & POLLIN)
+		{
+			while ((fd = accept(lfd, NULL, NULL)) != -1)
+			{
+				for (i = 0; i < MAX_CONNS && conns[i]; i++) { /* void */ }
+
+				c = (i < MAX_CONNS) ? calloc(1, sizeof(conn_t)) : NULL;
+				if (c == NULL)
+				{
+					close(fd);
+					continue;
+				}
+
+				on = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+				c->fd = fd;
+				conns[i] = c;
+			}
+		}
+
+		for (i = 0; i < MAX_CONNS; i++)
+		{
+			c = conns[i];
+
+			if (c == NULL || pfds[i + 1].revents == 0)
+			{
+				continue;
+			}
+
+			if (c->out_len > c->out_pos)
+			{
+				n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+				if (n == -1 && errno != EAGAIN)
+				{
+					close_conn(i);
+					continue;
+				}
+
+				if (n > 0)
+				{
+					c->out_pos += n;
+				}
+
+				if (c->out_pos == c->out_len)
+				{
+					c->out_pos = 0;
+					c->out_len = 0;
+
+					// 输出缓冲区满时可能还有没处理的请求
+					if (process(c) == -1)
+					{
+						close_conn(i);
+					}
+				}
+
+				continue;
+			}
+
+			n = read(c->fd, c->in + c->in_len, BUF_SIZE - c->in_len);
+			if (n == 0 || (n == -1 && errno != EAGAIN))
+			{
+				close_conn(i);
+				continue;
+			}
+
+			if (n > 0)
+			{
+				c->in_len += n;
+
+				if (process(c) == -1)
+				{
+					close_conn(i);
+				}
+			}
+		}
+	}
+}
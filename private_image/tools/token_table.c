@@ -0,0 +1,247 @@
+/*
+ * private_image_token_table 的写入工具，也是鉴权服务实现推送的参考，文件格式见
+ * ngx_private_image_table.h。
+ *
+ * 编译：cc -O2 -I private_image -o token_table private_image/tools/token_table.c
+ *
+ * token_table create FILE NSLOTS [MAX_PROBE]
+ *     创建空的 token 表，NSLOTS 向上取整为 2 的幂，默认最多探测 16 个槽。
+ *     先写临时文件再 rename，nginx 在一秒内映射新文件
+ *
+ * token_table load FILE < tokens
+ *     用标准输入中的 token 替换整张表，每行 "token<TAB>user_id[<TAB>prefix[<TAB>ttl]]"，
+ *     prefix 为空表示授权所有 uri，ttl 为有效期（秒），0 或者没有表示不过期。
+ *     写入不活跃的那张表后切换，读取方看到的始终是完整的一代数据
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ngx_private_image_table.h"
+
+typedef ngx_http_private_image_table_header_t  header_t;
+typedef ngx_http_private_image_table_slot_t    slot_t;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: token_table create FILE NSLOTS [MAX_PROBE]\n"
+	                "       token_table load FILE < tokens\n");
+	exit(1);
+}
+
+static int
+create(const char *file, unsigned long nslots, unsigned long max_probe)
+{
+	int        fd;
+	char       tmp[4096];
+	size_t     size;
+	header_t   header;
+	unsigned long  n;
+
+	for (n = 1; n < nslots; n <<= 1) { /* void */ }
+
+	if (max_probe == 0 || max_probe > n)
+	{
+		fprintf(stderr, "invalid MAX_PROBE\n");
+		return 1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		perror(tmp);
+		return 1;
+	}
+
+	size = sizeof(header_t) + 2 * n * sizeof(slot_t);
+
+	if (ftruncate(fd, (off_t) size) == -1)
+	{
+		perror("ftruncate");
+		close(fd);
+		return 1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = NGX_HTTP_PRIVATE_IMAGE_TABLE_MAGIC;
+	header.version = NGX_HTTP_PRIVATE_IMAGE_TABLE_VERSION;
+	header.nslots = (uint32_t) n;
+	header.max_probe = (uint32_t) max_probe;
+
+	if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fsync(fd) == -1)
+	{
+		perror("write");
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+
+	if (rename(tmp, file) == -1)
+	{
+		perror("rename");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+load(const char *file)
+{
+	int          fd, t;
+	char         line[4096], *token, *user_id, *prefix, *ttl, *nl;
+	size_t       size, len;
+	uint32_t     check;
+	uint64_t     key, mask, i, n, count;
+	time_t       now;
+	slot_t      *slots, *slot;
+	header_t    *header;
+	struct stat  st;
+
+	fd = open(file, O_RDWR);
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		perror(file);
+		return 1;
+	}
+
+	size = (size_t) st.st_size;
+
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	close(fd);
+
+	if (size < sizeof(header_t) || header->magic != NGX_HTTP_PRIVATE_IMAGE_TABLE_MAGIC
+	    || header->version != NGX_HTTP_PRIVATE_IMAGE_TABLE_VERSION
+	    || size < sizeof(header_t) + 2 * (size_t) header->nslots * sizeof(slot_t))
+	{
+		fprintf(stderr, "%s: invalid token table\n", file);
+		return 1;
+	}
+
+	// 写不活跃的那张表，奇数的 seq 让正在读这张表的 worker 重试
+	t = (int) ((header->active & 1) ^ 1);
+	slots = (slot_t *) ((char *) header + sizeof(header_t)) + (size_t) t * header->nslots;
+	mask = header->nslots - 1;
+
+	header->seq[t]++;
+	__sync_synchronize();
+
+	memset(slots, 0, header->nslots * sizeof(slot_t));
+
+	now = time(NULL);
+	count = 0;
+
+	while (fgets(line, sizeof(line), stdin))
+	{
+		nl = strchr(line, '\n');
+		if (nl)
+		{
+			*nl = '\0';
+		}
+
+		token = strtok(line, "\t");
+		user_id = strtok(NULL, "\t");
+		prefix = strtok(NULL, "\t");
+		ttl = strtok(NULL, "\t");
+
+		if (token == NULL || user_id == NULL)
+		{
+			continue;
+		}
+
+		if (strlen(token) > 0xffff || strlen(user_id) > NGX_HTTP_PRIVATE_IMAGE_TABLE_USER_LEN
+		    || (prefix && strlen(prefix) > NGX_HTTP_PRIVATE_IMAGE_TABLE_PREFIX_LEN))
+		{
+			fprintf(stderr, "skip %s: token, user_id or prefix too long\n", token);
+			continue;
+		}
+
+		len = strlen(token);
+		key = ngx_http_private_image_table_key((const uint8_t *) token, len);
+		check = ngx_http_private_image_table_check((const uint8_t *) token, len);
+
+		// 同一个 token 重复出现时覆盖之前的记录
+		for (i = 0, n = key & mask; i < header->max_probe; i++, n = (n + 1) & mask)
+		{
+			if (slots[n].key == 0
+			    || (slots[n].key == key && slots[n].check == check && slots[n].token_len == len))
+			{
+				break;
+			}
+		}
+
+		if (i == header->max_probe)
+		{
+			fprintf(stderr, "token table is too full, create a larger one\n");
+			header->seq[t]++;
+			return 1;
+		}
+
+		slot = &slots[n];
+		memset(slot, 0, sizeof(slot_t));
+		slot->key = key;
+		slot->check = check;
+		slot->token_len = (uint16_t) len;
+		slot->expire = (ttl && atol(ttl) > 0) ? (int64_t) (now + atol(ttl)) : 0;
+
+		len = strlen(user_id);
+		slot->user_len = (uint8_t) len;
+		memcpy(slot->user_id, user_id, len);
+
+		if (prefix)
+		{
+			len = strlen(prefix);
+			slot->prefix_len = (uint8_t) len;
+			memcpy(slot->prefix, prefix, len);
+		}
+
+		count++;
+	}
+
+	__sync_synchronize();
+	header->seq[t]++;
+	__sync_synchronize();
+
+	header->active = (uint64_t) t;
+	header->generation++;
+
+	printf("loaded %llu tokens, generation %llu\n",
+	       (unsigned long long) count, (unsigned long long) header->generation);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc >= 4 && strcmp(argv[1], "create") == 0)
+	{
+		return create(argv[2], strtoul(argv[3], NULL, 10), argc > 4 ? strtoul(argv[4], NULL, 10) : 16);
+	}
+
+	if (argc == 3 && strcmp(argv[1], "load") == 0)
+	{
+		return load(argv[2]);
+	}
+
+	usage();
+
+	return 1;
+}